@@ -118,6 +118,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/checkpointsync.h \
     src/coincontrol.h \
     src/compat.h \
+    src/sha256.h \
+    src/secp256k1.h \
     src/sync.h \
     src/util.h \
     src/uint256.h \
@@ -132,6 +134,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
+    src/bloom.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -188,6 +191,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/editaddressdialog.cpp \
     src/qt/bitcoinaddressvalidator.cpp \
     src/version.cpp \
+    src/sha256.cpp \
+    src/secp256k1.cpp \
     src/sync.cpp \
     src/util.cpp \
     src/netbase.cpp \
@@ -200,6 +205,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/checkpoints.cpp \
     src/checkpointsync.cpp \
     src/addrman.cpp \
+    src/bloom.cpp \
     src/db.cpp \
     src/walletdb.cpp \
     src/json/json_spirit_writer.cpp \
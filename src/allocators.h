@@ -80,7 +80,7 @@ struct secure_allocator : public std::allocator<T>
     {
         if (p != NULL)
         {
-            memset(p, 0, sizeof(T) * n);
+            memset((void*)p, 0, sizeof(T) * n);
             munlock(p, sizeof(T) * n);
         }
         std::allocator<T>::deallocate(p, n);
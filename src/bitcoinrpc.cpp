@@ -48,8 +48,11 @@ static CCriticalSection cs_nWalletUnlockTime;
 
 extern Value getconnectioncount(const Array& params, bool fHelp); // in rpcnet.cpp
 extern Value getpeerinfo(const Array& params, bool fHelp);
+extern Value getnettotals(const Array& params, bool fHelp);
 extern Value dumpprivkey(const Array& params, bool fHelp); // in rpcdump.cpp
 extern Value importprivkey(const Array& params, bool fHelp);
+extern Value getrescaninfo(const Array& params, bool fHelp);
+extern Value abortrescan(const Array& params, bool fHelp);
 extern Value getrawtransaction(const Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern Value listunspent(const Array& params, bool fHelp);
 extern Value createrawtransaction(const Array& params, bool fHelp);
@@ -780,9 +783,15 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    map<CTxDestination, set<uint256> >::iterator mi = pwalletMain->mapAddressTx.find(address.Get());
+    if (mi == pwalletMain->mapAddressTx.end())
+        return ValueFromAmount(nAmount);
+    BOOST_FOREACH(const uint256& hash, (*mi).second)
     {
-        const CWalletTx& wtx = (*it).second;
+        map<uint256, CWalletTx>::const_iterator mw = pwalletMain->mapWallet.find(hash);
+        if (mw == pwalletMain->mapWallet.end())
+            continue;
+        const CWalletTx& wtx = (*mw).second;
         if (wtx.IsCoinBase() || !wtx.IsFinal())
             continue;
 
@@ -824,11 +833,23 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
     set<CTxDestination> setAddress;
     GetAccountAddresses(strAccount, setAddress);
 
+    // Only transactions paying one of the account's addresses can add to it
+    set<uint256> setTx;
+    BOOST_FOREACH(const CTxDestination& address, setAddress)
+    {
+        map<CTxDestination, set<uint256> >::iterator mi = pwalletMain->mapAddressTx.find(address);
+        if (mi != pwalletMain->mapAddressTx.end())
+            setTx.insert((*mi).second.begin(), (*mi).second.end());
+    }
+
     // Tally
     int64 nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const uint256& hash, setTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        map<uint256, CWalletTx>::const_iterator mw = pwalletMain->mapWallet.find(hash);
+        if (mw == pwalletMain->mapWallet.end())
+            continue;
+        const CWalletTx& wtx = (*mw).second;
         if (wtx.IsCoinBase() || !wtx.IsFinal())
             continue;
 
@@ -850,9 +871,14 @@ int64 GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinD
     int64 nBalance = 0;
 
     // Tally wallet transactions
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    set<uint256> setTx;
+    pwalletMain->GetAccountTransactions(strAccount, setTx);
+    BOOST_FOREACH(const uint256& hash, setTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        map<uint256, CWalletTx>::const_iterator mw = pwalletMain->mapWallet.find(hash);
+        if (mw == pwalletMain->mapWallet.end())
+            continue;
+        const CWalletTx& wtx = (*mw).second;
         if (!wtx.IsFinal())
             continue;
 
@@ -975,6 +1001,9 @@ Value movecmd(const Array& params, bool fHelp)
     if (!walletdb.TxnCommit())
         throw JSONRPCError(-20, "database error");
 
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -1019,27 +1048,10 @@ Value sendfrom(const Array& params, bool fHelp)
 }
 
 
-Value sendmany(const Array& params, bool fHelp)
+// Turns an {address:amount,...} object into vecSend, returning the total amount
+static int64 GetSendToScripts(const Object& sendTo, vector<pair<CScript, int64> >& vecSend)
 {
-    if (fHelp || params.size() < 2 || params.size() > 4)
-        throw runtime_error(
-            "sendmany <fromaccount> {address:amount,...} [minconf=1] [comment]\n"
-            "amounts are double-precision floating point numbers"
-            + HelpRequiringPassphrase());
-
-    string strAccount = AccountFromValue(params[0]);
-    Object sendTo = params[1].get_obj();
-    int nMinDepth = 1;
-    if (params.size() > 2)
-        nMinDepth = params[2].get_int();
-
-    CWalletTx wtx;
-    wtx.strFromAccount = strAccount;
-    if (params.size() > 3 && params[3].type() != null_type && !params[3].get_str().empty())
-        wtx.mapValue["comment"] = params[3].get_str();
-
     set<CBitcoinAddress> setAddress;
-    vector<pair<CScript, int64> > vecSend;
 
     int64 totalAmount = 0;
     BOOST_FOREACH(const Pair& s, sendTo)
@@ -1059,6 +1071,30 @@ Value sendmany(const Array& params, bool fHelp)
 
         vecSend.push_back(make_pair(scriptPubKey, nAmount));
     }
+    return totalAmount;
+}
+
+Value sendmany(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 4)
+        throw runtime_error(
+            "sendmany <fromaccount> {address:amount,...} [minconf=1] [comment]\n"
+            "amounts are double-precision floating point numbers"
+            + HelpRequiringPassphrase());
+
+    string strAccount = AccountFromValue(params[0]);
+    Object sendTo = params[1].get_obj();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+
+    CWalletTx wtx;
+    wtx.strFromAccount = strAccount;
+    if (params.size() > 3 && params[3].type() != null_type && !params[3].get_str().empty())
+        wtx.mapValue["comment"] = params[3].get_str();
+
+    vector<pair<CScript, int64> > vecSend;
+    int64 totalAmount = GetSendToScripts(sendTo, vecSend);
 
     EnsureWalletIsUnlocked();
 
@@ -1083,6 +1119,63 @@ Value sendmany(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+Value sendbatch(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 5)
+        throw runtime_error(
+            strprintf("sendbatch <fromaccount> {address:amount,...} [minconf=1] [comment] [maxtxsize=%u]\n", DEFAULT_BATCH_TX_SIZE) +
+            "Pays every address, in as many transactions as it takes to keep each under [maxtxsize] bytes\n"
+            "amounts are double-precision floating point numbers\n"
+            "Returns the ids of the transactions sent as \"txids\"; if one of them failed,\n"
+            "\"error\" tells why and the payments not listed in \"txids\" were not made"
+            + HelpRequiringPassphrase());
+
+    string strAccount = AccountFromValue(params[0]);
+    Object sendTo = params[1].get_obj();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+    unsigned int nMaxTxSize = DEFAULT_BATCH_TX_SIZE;
+    if (params.size() > 4)
+    {
+        int nSize = params[4].get_int();
+        if (nSize < 1000 || nSize >= (int)MAX_BLOCK_SIZE_GEN/5)
+            throw JSONRPCError(-8, "Invalid parameter, maxtxsize out of range");
+        nMaxTxSize = nSize;
+    }
+
+    CWalletTx wtx;
+    wtx.strFromAccount = strAccount;
+    if (params.size() > 3 && params[3].type() != null_type && !params[3].get_str().empty())
+        wtx.mapValue["comment"] = params[3].get_str();
+
+    vector<pair<CScript, int64> > vecSend;
+    int64 totalAmount = GetSendToScripts(sendTo, vecSend);
+
+    EnsureWalletIsUnlocked();
+
+    // Check funds
+    int64 nBalance = GetAccountBalance(strAccount, nMinDepth);
+    if (totalAmount > nBalance)
+        throw JSONRPCError(-6, "Account has insufficient funds");
+
+    // Send
+    vector<uint256> vHash;
+    string strError = pwalletMain->SendMoneyBatch(vecSend, wtx, nMaxTxSize, vHash);
+    if (strError != "" && vHash.empty())
+        throw JSONRPCError(-4, strError);
+
+    // Whatever went out already is listed along with the error, so it isn't paid twice
+    Array txids;
+    BOOST_FOREACH(const uint256& hash, vHash)
+        txids.push_back(hash.GetHex());
+    Object ret;
+    ret.push_back(Pair("txids", txids));
+    if (strError != "")
+        ret.push_back(Pair("error", strError));
+    return ret;
+}
+
 Value addmultisigaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -1176,28 +1269,35 @@ Value ListReceived(const Array& params, bool fByAccounts)
     if (params.size() > 1)
         fIncludeEmpty = params[1].get_bool();
 
-    // Tally
+    // Tally, one of our addresses at a time
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    for (map<CTxDestination, set<uint256> >::iterator mi = pwalletMain->mapAddressTx.begin(); mi != pwalletMain->mapAddressTx.end(); ++mi)
     {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || !wtx.IsFinal())
+        const CTxDestination& dest = (*mi).first;
+        BOOST_FOREACH(const uint256& hash, (*mi).second)
+        {
+            map<uint256, CWalletTx>::const_iterator mw = pwalletMain->mapWallet.find(hash);
+        if (mw == pwalletMain->mapWallet.end())
             continue;
+        const CWalletTx& wtx = (*mw).second;
 
-        int nDepth = wtx.GetDepthInMainChain();
-        if (nDepth < nMinDepth)
-            continue;
+            if (wtx.IsCoinBase() || !wtx.IsFinal())
+                continue;
 
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-        {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address) || !IsMine(*pwalletMain, address))
+            int nDepth = wtx.GetDepthInMainChain();
+            if (nDepth < nMinDepth)
                 continue;
 
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
-            item.nConf = min(item.nConf, nDepth);
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                CTxDestination address;
+                if (!ExtractDestination(txout.scriptPubKey, address) || !(address == dest))
+                    continue;
+
+                tallyitem& item = mapTally[address];
+                item.nAmount += txout.nValue;
+                item.nConf = min(item.nConf, nDepth);
+            }
         }
     }
 
@@ -1417,29 +1517,11 @@ Value listtransactions(const Array& params, bool fHelp)
         throw JSONRPCError(-8, "Negative from");
 
     Array ret;
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-time multimap.
-    typedef pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef multimap<int64, TxPair > TxItems;
-    TxItems txByTime;
-
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        CWalletTx* wtx = &((*it).second);
-        txByTime.insert(make_pair(wtx->GetTxTime(), TxPair(wtx, (CAccountingEntry*)0)));
-    }
-    list<CAccountingEntry> acentries;
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
-    {
-        txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
-    }
 
+    // The wallet keeps every CWalletTx and CAccountingEntry sorted by time;
     // iterate backwards until we have nCount items to return:
-    for (TxItems::reverse_iterator it = txByTime.rbegin(); it != txByTime.rend(); ++it)
+    CWallet::TxItems& txByTime = pwalletMain->wtxOrdered;
+    for (CWallet::TxItems::reverse_iterator it = txByTime.rbegin(); it != txByTime.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1594,9 +1676,10 @@ Value gettransaction(const Array& params, bool fHelp)
     hash.SetHex(params[0].get_str());
 
     Object entry;
-    if (!pwalletMain->mapWallet.count(hash))
+    map<uint256, CWalletTx>::const_iterator mw = pwalletMain->mapWallet.find(hash);
+    if (mw == pwalletMain->mapWallet.end())
         throw JSONRPCError(-5, "Invalid or non-wallet transaction id");
-    const CWalletTx& wtx = pwalletMain->mapWallet[hash];
+    const CWalletTx& wtx = (*mw).second;
 
     int64 nCredit = wtx.GetCredit();
     int64 nDebit = wtx.GetDebit();
@@ -1636,16 +1719,53 @@ Value backupwallet(const Array& params, bool fHelp)
 }
 
 
+static CCriticalSection cs_THREAD_TOPUPKEYPOOL;
+
+void ThreadTopUpKeyPool(void* parg)
+{
+    // Make this thread recognisable as the key-topping-up thread
+    RenameThread("pxc-key-top");
+
+    // Counted so that shutdown waits for it before the wallet goes away
+    {
+        LOCK(cs_THREAD_TOPUPKEYPOOL);
+        vnThreadsRunning[THREAD_TOPUPKEYPOOL]++;
+    }
+    try
+    {
+        if (!fShutdown)
+            pwalletMain->TopUpKeyPoolInBackground();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadTopUpKeyPool()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadTopUpKeyPool()");
+    }
+    {
+        LOCK(cs_THREAD_TOPUPKEYPOOL);
+        vnThreadsRunning[THREAD_TOPUPKEYPOOL]--;
+    }
+}
+
 Value keypoolrefill(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "keypoolrefill\n"
-            "Fills the keypool."
+            "keypoolrefill [background=false]\n"
+            "Fills the keypool.\n"
+            "With background true, returns at once and fills it from another thread\n"
+            "without holding up the wallet while the keys are made."
             + HelpRequiringPassphrase());
 
     EnsureWalletIsUnlocked();
 
+    if (params.size() > 0 && params[0].get_bool())
+    {
+        if (!CreateThread(ThreadTopUpKeyPool, NULL))
+            throw JSONRPCError(-4, "Error starting keypool refill.");
+        return Value::null;
+    }
+
     pwalletMain->TopUpKeyPool();
 
     if (pwalletMain->GetKeyPoolSize() < GetArg("-keypool", 100))
@@ -1655,14 +1775,6 @@ Value keypoolrefill(const Array& params, bool fHelp)
 }
 
 
-void ThreadTopUpKeyPool(void* parg)
-{
-    // Make this thread recognisable as the key-topping-up thread
-    RenameThread("pxc-key-top");
-
-    pwalletMain->TopUpKeyPool();
-}
-
 void ThreadCleanWalletPassphrase(void* parg)
 {
     // Make this thread recognisable as the wallet relocking thread
@@ -2077,6 +2189,7 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->vtx[0].UpdateHash();
 
         /* Re-build the merkle root */
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
@@ -2197,9 +2310,10 @@ Value getworkex(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
 
-        if(coinbase.size() == 0)
+        if(coinbase.size() == 0) {
           pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        else
+          pblock->vtx[0].UpdateHash();
+        } else
           CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0];
 
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
@@ -2385,6 +2499,19 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value savemempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "Writes the memory pool to mempool.dat in the data directory.");
+
+    if (!DumpMempool())
+        throw JSONRPCError(-1, "Unable to dump memory pool to disk");
+
+    return Value::null;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -2497,73 +2624,78 @@ Value sendalert(const Array& params, bool fHelp) {
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      function                 safe mode?
-  //  ------------------------  -----------------------  ----------
-    { "help",                   &help,                   true },
-    { "stop",                   &stop,                   true },
-    { "getblockcount",          &getblockcount,          true },
-    { "getconnectioncount",     &getconnectioncount,     true },
-    { "addnode",                &addnode,                true },
-    { "getaddednodeinfo",       &getaddednodeinfo,       true },
-    { "getpeerinfo",            &getpeerinfo,            true },
-    { "getdifficulty",          &getdifficulty,          true },
-    { "getnetworkhashps",       &getnetworkhashps,       true },
-    { "getgenerate",            &getgenerate,            true },
-    { "setgenerate",            &setgenerate,            true },
-    { "gethashespersec",        &gethashespersec,        true },
-    { "getinfo",                &getinfo,                true },
-    { "getmininginfo",          &getmininginfo,          true },
-    { "getnewaddress",          &getnewaddress,          true },
-    { "getaccountaddress",      &getaccountaddress,      true },
-    { "setaccount",             &setaccount,             true },
-    { "getaccount",             &getaccount,             false },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true },
-    { "sendtoaddress",          &sendtoaddress,          false },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false },
-    { "backupwallet",           &backupwallet,           true },
-    { "keypoolrefill",          &keypoolrefill,          true },
-    { "walletpassphrase",       &walletpassphrase,       true },
-    { "walletpassphrasechange", &walletpassphrasechange, false },
-    { "walletlock",             &walletlock,             true },
-    { "encryptwallet",          &encryptwallet,          false },
-    { "validateaddress",        &validateaddress,        true },
-    { "getbalance",             &getbalance,             false },
-    { "move",                   &movecmd,                false },
-    { "sendfrom",               &sendfrom,               false },
-    { "sendmany",               &sendmany,               false },
-    { "addmultisigaddress",     &addmultisigaddress,     false },
-    { "getrawmempool",          &getrawmempool,          true },
-    { "getblock",               &getblock,               false },
-    { "getblockhash",           &getblockhash,           false },
-    { "gettransaction",         &gettransaction,         false },
-    { "listtransactions",       &listtransactions,       false },
-    { "signmessage",            &signmessage,            false },
-    { "verifymessage",          &verifymessage,          false },
-    { "getwork",                &getwork,                true },
-    { "getworkex",              &getworkex,              true },
-    { "listaccounts",           &listaccounts,           false },
-    { "settxfee",               &settxfee,               false },
-    { "setmininput",            &setmininput,            false },
-    { "getblocktemplate",       &getblocktemplate,       true },
-    { "listsinceblock",         &listsinceblock,         false },
-    { "dumpprivkey",            &dumpprivkey,            false },
-    { "importprivkey",          &importprivkey,          false },
-    { "getcheckpoint",          &getcheckpoint,          true },
-    { "sendcheckpoint",         &sendcheckpoint,         true },
-    { "enforcecheckpoint",      &enforcecheckpoint,      true },
-    { "makekeypair",            &makekeypair,            true },
-    { "listunspent",            &listunspent,            false },
-    { "getrawtransaction",      &getrawtransaction,      false },
-    { "createrawtransaction",   &createrawtransaction,   false },
-    { "decoderawtransaction",   &decoderawtransaction,   false },
-    { "signrawtransaction",     &signrawtransaction,     false },
-    { "sendrawtransaction",     &sendrawtransaction,     false },
-    { "sendalert",              &sendalert,              false },
-    { "lockunspent",            &lockunspent,            false },
-    { "listlockunspent",        &listlockunspent,        false },
+{ //  name                      function                 safe mode?  thread safe?
+  //  ------------------------  -----------------------  ----------  ------------
+    { "help",                   &help,                   true,       false },
+    { "stop",                   &stop,                   true,       false },
+    { "getblockcount",          &getblockcount,          true,       false },
+    { "getconnectioncount",     &getconnectioncount,     true,       false },
+    { "addnode",                &addnode,                true,       false },
+    { "getaddednodeinfo",       &getaddednodeinfo,       true,       false },
+    { "getpeerinfo",            &getpeerinfo,            true,       false },
+    { "getnettotals",           &getnettotals,           true,       false },
+    { "getdifficulty",          &getdifficulty,          true,       false },
+    { "getnetworkhashps",       &getnetworkhashps,       true,       false },
+    { "getgenerate",            &getgenerate,            true,       false },
+    { "setgenerate",            &setgenerate,            true,       false },
+    { "gethashespersec",        &gethashespersec,        true,       false },
+    { "getinfo",                &getinfo,                true,       false },
+    { "getmininginfo",          &getmininginfo,          true,       false },
+    { "getnewaddress",          &getnewaddress,          true,       false },
+    { "getaccountaddress",      &getaccountaddress,      true,       false },
+    { "setaccount",             &setaccount,             true,       false },
+    { "getaccount",             &getaccount,             false,      false },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,       false },
+    { "sendtoaddress",          &sendtoaddress,          false,      false },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,      false },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,      false },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,      false },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,      false },
+    { "backupwallet",           &backupwallet,           true,       false },
+    { "keypoolrefill",          &keypoolrefill,          true,       false },
+    { "walletpassphrase",       &walletpassphrase,       true,       false },
+    { "walletpassphrasechange", &walletpassphrasechange, false,      false },
+    { "walletlock",             &walletlock,             true,       false },
+    { "encryptwallet",          &encryptwallet,          false,      false },
+    { "validateaddress",        &validateaddress,        true,       false },
+    { "getbalance",             &getbalance,             false,      false },
+    { "move",                   &movecmd,                false,      false },
+    { "sendfrom",               &sendfrom,               false,      false },
+    { "sendmany",               &sendmany,               false,      false },
+    { "sendbatch",              &sendbatch,              false,      false },
+    { "addmultisigaddress",     &addmultisigaddress,     false,      false },
+    { "getrawmempool",          &getrawmempool,          true,       false },
+    { "savemempool",            &savemempool,            true,       false },
+    { "getblock",               &getblock,               false,      false },
+    { "getblockhash",           &getblockhash,           false,      false },
+    { "gettransaction",         &gettransaction,         false,      false },
+    { "listtransactions",       &listtransactions,       false,      false },
+    { "signmessage",            &signmessage,            false,      false },
+    { "verifymessage",          &verifymessage,          false,      false },
+    { "getwork",                &getwork,                true,       false },
+    { "getworkex",              &getworkex,              true,       false },
+    { "listaccounts",           &listaccounts,           false,      false },
+    { "settxfee",               &settxfee,               false,      false },
+    { "setmininput",            &setmininput,            false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,       false },
+    { "listsinceblock",         &listsinceblock,         false,      false },
+    { "dumpprivkey",            &dumpprivkey,            false,      false },
+    { "importprivkey",          &importprivkey,          false,      true },
+    { "getrescaninfo",          &getrescaninfo,          true,       true },
+    { "abortrescan",            &abortrescan,            true,       true },
+    { "getcheckpoint",          &getcheckpoint,          true,       false },
+    { "sendcheckpoint",         &sendcheckpoint,         true,       false },
+    { "enforcecheckpoint",      &enforcecheckpoint,      true,       false },
+    { "makekeypair",            &makekeypair,            true,       false },
+    { "listunspent",            &listunspent,            false,      false },
+    { "getrawtransaction",      &getrawtransaction,      false,      false },
+    { "createrawtransaction",   &createrawtransaction,   false,      false },
+    { "decoderawtransaction",   &decoderawtransaction,   false,      false },
+    { "signrawtransaction",     &signrawtransaction,     false,      false },
+    { "sendrawtransaction",     &sendrawtransaction,     false,      false },
+    { "sendalert",              &sendalert,              false,      false },
+    { "lockunspent",            &lockunspent,            false,      false },
+    { "listlockunspent",        &listlockunspent,        false,      false },
 };
 
 CRPCTable::CRPCTable()
@@ -3347,8 +3479,14 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
 
     try
     {
+        // Let the wallet catch up with blocks and transactions already accepted
+        SyncWithWalletQueue();
+
         // Execute
         Value result;
+        if (pcmd->threadSafe)
+            result = pcmd->actor(params, false);
+        else
         {
             LOCK2(cs_main, pwalletMain->cs_wallet);
             result = pcmd->actor(params, false);
@@ -3477,6 +3615,9 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "enforcecheckpoint"      && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "sendmany"               && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "sendmany"               && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "sendbatch"              && n > 1) ConvertTo<Object>(params[1]);
+    if (strMethod == "sendbatch"              && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "sendbatch"              && n > 4) ConvertTo<boost::int64_t>(params[4]);
     if (strMethod == "addmultisigaddress"     && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "addmultisigaddress"     && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "listunspent"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
@@ -3487,6 +3628,7 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "signrawtransaction"     && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<Array>(params[2]);
     if (strMethod == "getaddednodeinfo"       && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "keypoolrefill"          && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "getnetworkhashps"       && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "lockunspent"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "lockunspent"            && n > 1) ConvertTo<Array>(params[1]);
@@ -46,6 +46,8 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    // runs without cs_main and cs_wallet held, taking whatever locks it needs itself
+    bool threadSafe;
 };
 
 /**
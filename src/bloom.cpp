@@ -0,0 +1,105 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#include <math.h>
+
+#include "bloom.h"
+#include "util.h"
+
+using namespace std;
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    /* The optimal number of hash functions is log(fpRate) / log(0.5), but
+     * restrict it to the range 1-50. */
+    nHashFuncs = max(1, min((int)floor(logFpRate / log(0.5) + 0.5), 50));
+    /* In this rolling bloom filter, we'll store between 2 and 3 generations of nElements / 2 entries. */
+    nEntriesPerGeneration = max(1, (int)((nElements + 1) / 2));
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    /* The maximum fpRate = pow(1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits), nHashFuncs)
+     * =>          pow(fpRate, 1.0 / nHashFuncs) = 1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits)
+     * =>          1.0 - pow(fpRate, 1.0 / nHashFuncs) = exp(-nHashFuncs * nMaxElements / nFilterBits)
+     * =>          log(1.0 - pow(fpRate, 1.0 / nHashFuncs)) = -nHashFuncs * nMaxElements / nFilterBits
+     * =>          nFilterBits = -nHashFuncs * nMaxElements / log(1.0 - pow(fpRate, 1.0 / nHashFuncs))
+     * =>          nFilterBits = -nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs))
+     */
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    /* For each data element we need to store 2 bits. If both bits are 0, the
+     * bit is treated as unset. If the bits are (01), (10), or (11), the bit is
+     * treated as set in generation 1, 2, or 3 respectively.
+     * These bits are stored in separate integers: position P corresponds to bit
+     * (P & 63) of the integers data[(P >> 6) * 2] and data[(P >> 6) * 2 + 1]. */
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+unsigned int CRollingBloomFilter::Hash(unsigned int nHashNum, const uint256& hash) const
+{
+    // Inventory hashes are already uniformly distributed, so each hash
+    // function only needs to pick a different, secretly tweaked 64-bit
+    // lane and run it through a finalizer to decorrelate the indexes.
+    uint64 h = hash.Get64(nHashNum & 3) ^ nTweak ^ ((uint64)nHashNum * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return (unsigned int)h;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4) {
+            nGeneration = 1;
+        }
+        uint64 nGenerationMask1 = 0 - (uint64)(nGeneration & 1);
+        uint64 nGenerationMask2 = 0 - (uint64)(nGeneration >> 1);
+        /* Wipe old entries that used this generation number. */
+        for (unsigned int p = 0; p < data.size(); p += 2) {
+            uint64 p1 = data[p], p2 = data[p + 1];
+            uint64 mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (unsigned int n = 0; n < nHashFuncs; n++) {
+        unsigned int h = Hash(n, hash);
+        int bit = h & 0x3F;
+        /* map h to a cell (pair of words) in the table */
+        unsigned int pos = ((uint64)h * (data.size() >> 1)) >> 32;
+        data[pos << 1] = (data[pos << 1] & ~(((uint64)1) << bit)) | ((uint64)(nGeneration & 1)) << bit;
+        data[(pos << 1) | 1] = (data[(pos << 1) | 1] & ~(((uint64)1) << bit)) | ((uint64)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    for (unsigned int n = 0; n < nHashFuncs; n++) {
+        unsigned int h = Hash(n, hash);
+        int bit = h & 0x3F;
+        unsigned int pos = ((uint64)h * (data.size() >> 1)) >> 32;
+        /* If the relevant bit is not set in either data[pos & ~1] or data[pos | 1], the filter does not contain hash */
+        if ((((data[pos << 1] | data[(pos << 1) | 1]) >> bit) & 1) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRandHash().Get64();
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    for (std::vector<uint64>::iterator it = data.begin(); it != data.end(); it++) {
+        *it = 0;
+    }
+}
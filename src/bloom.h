@@ -0,0 +1,45 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include <vector>
+
+#include "uint256.h"
+
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive rate.
+ *
+ * contains(item) will always return true if item was one of the last N things
+ * insert()'ed ... but may also return true for items that were not inserted.
+ *
+ * Items are kept in three generations of N/2 entries each; every cell stores the
+ * generation it was last set in, so retiring the oldest generation is a single
+ * linear pass over the table instead of per-item bookkeeping.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+
+    void reset();
+
+private:
+    unsigned int Hash(unsigned int nHashNum, const uint256& hash) const;
+
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64> data;
+    unsigned int nHashFuncs;
+    uint64 nTweak;
+};
+
+#endif /* BITCOIN_BLOOM_H */
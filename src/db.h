@@ -249,6 +249,58 @@ protected:
         return 0;
     }
 
+    // Reads the next run of records at the cursor with one DB_MULTIPLE_KEY
+    // call instead of one call per record. vchBuffer is grown whenever a
+    // record doesn't fit and is wiped once the records have been copied out.
+    int ReadAtCursorBulk(Dbc* pcursor, std::vector<char>& vchBuffer, std::vector<std::pair<CDataStream, CDataStream> >& vRecords)
+    {
+        if (vchBuffer.size() < 1024 * 1024)
+            vchBuffer.resize(1024 * 1024);
+
+        Dbt datKey;
+        Dbt datValue;
+        int ret;
+        loop
+        {
+            datKey.set_flags(DB_DBT_MALLOC);
+            datValue.set_data(&vchBuffer[0]);
+            datValue.set_ulen(vchBuffer.size());
+            datValue.set_flags(DB_DBT_USERMEM);
+            try
+            {
+                ret = pcursor->get(&datKey, &datValue, DB_MULTIPLE_KEY | DB_NEXT);
+            }
+            catch (DbMemoryException&)
+            {
+                ret = DB_BUFFER_SMALL;
+            }
+            if (ret != DB_BUFFER_SMALL)
+                break;
+            // The size needed is reported back in datValue; bulk buffers
+            // must be a multiple of 1024 bytes
+            vchBuffer.resize(std::max(vchBuffer.size(), (size_t)(datValue.get_size() + 1023) / 1024 * 1024) * 2);
+        }
+        if (datKey.get_data() != NULL)
+            free(datKey.get_data());
+        if (ret != 0)
+            return ret;
+
+        DbMultipleKeyDataIterator it(datValue);
+        Dbt datRecordKey;
+        Dbt datRecordValue;
+        while (it.next(datRecordKey, datRecordValue))
+        {
+            const char* pchKey = (const char*)datRecordKey.get_data();
+            const char* pchValue = (const char*)datRecordValue.get_data();
+            vRecords.push_back(std::make_pair(CDataStream(pchKey, pchKey + datRecordKey.get_size(), SER_DISK, CLIENT_VERSION),
+                                              CDataStream(pchValue, pchValue + datRecordValue.get_size(), SER_DISK, CLIENT_VERSION)));
+        }
+
+        // Clear memory
+        memset(&vchBuffer[0], 0, vchBuffer.size());
+        return 0;
+    }
+
 public:
     bool TxnBegin()
     {
@@ -10,6 +10,7 @@
 #include "bitcoinrpc.h"
 #include "net.h"
 #include "init.h"
+#include "secp256k1.h"
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpointsync.h"
@@ -29,6 +30,7 @@ using namespace boost;
 CWallet* pwalletMain;
 CClientUIInterface uiInterface;
 uint nMsgSleep;
+static bool fDumpMempool = false;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -78,6 +80,9 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        FlushWalletQueue();
+        if (fDumpMempool)
+            DumpMempool();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -250,6 +255,12 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -headersfirst          " + _("Download block headers first, then block bodies from several peers in parallel (default: 1)") + "\n" +
+        "  -maxuploadrate=<n>     " + _("Limit uploads to <n>*1000 bytes per second, serving old blocks last (default: 0 = unlimited)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes, evicting the lowest fee rates first (default: 300; 0 = unlimited)") + "\n" +
+        "  -mempoolexpiry=<n>     " + _("Do not keep transactions in the memory pool longer than <n> hours (default: 72; 0 = forever)") + "\n" +
+        "  -persistmempool        " + _("Save the memory pool to mempool.dat on shutdown and load it on startup (default: 1)") + "\n" +
+        "  -sigcachesize=<n>      " + _("Use <n> megabytes of memory to cache valid signatures (default: 32)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -407,6 +418,10 @@ bool AppInit2()
     fPrintToConsole = GetBoolArg("-printtoconsole");
     fPrintToDebugger = GetBoolArg("-printtodebugger");
     fLogTimestamps = GetBoolArg("-logtimestamps");
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+    nMaxUploadRate = GetArg("-maxuploadrate", 0) * 1000;
+    nMaxMempoolSize = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    nMempoolExpiry = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
 
     if (mapArgs.count("-timeout"))
     {
@@ -486,6 +501,16 @@ bool AppInit2()
     printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
     printf("Used data directory %s\n", GetDataDir().string().c_str());
+    printf("Using SHA-256 implementation: %s\n", SHA256AutoDetect().c_str());
+    if (Secp256k1Start() && CKey::CheckNativeVerify())
+        printf("Using native secp256k1 signature verification\n");
+    else
+    {
+        Secp256k1Stop();
+        printf("Using OpenSSL signature verification\n");
+    }
+    uint64 nSigCacheEntries = InitSignatureCache(GetArg("-sigcachesize", DEFAULT_SIGCACHE_SIZE));
+    printf("Using %"PRI64u" entry signature cache\n", nSigCacheEntries);
     std::ostringstream strErrors;
 
     int64 nStart;
@@ -752,6 +777,17 @@ bool AppInit2()
            GetTimeMillis() - nStart, addrman.size());
     }
 
+    // The pool is only written back at shutdown once it has been read in,
+    // so an early exit does not wipe the previous mempool.dat
+    if (GetBoolArg("-persistmempool", true))
+    {
+        uiInterface.InitMessage(_("Loading memory pool..."));
+        printf("Loading memory pool...\n");
+        if (!LoadMempool())
+            printf("Invalid or missing mempool.dat\n");
+        fDumpMempool = true;
+    }
+
     // ********************************************************* Step 10: start node
 
     if (!CheckDiskSpace())
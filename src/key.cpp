@@ -10,6 +10,7 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "secp256k1.h"
 
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
@@ -151,6 +152,7 @@ CKey::CKey(const CKey& b)
     if (pkey == NULL)
         throw key_error("CKey::CKey(const CKey&) : EC_KEY_dup failed");
     fSet = b.fSet;
+    fCompressedPubKey = b.fCompressedPubKey;
 }
 
 CKey& CKey::operator=(const CKey& b)
@@ -158,6 +160,7 @@ CKey& CKey::operator=(const CKey& b)
     if (!EC_KEY_copy(pkey, b.pkey))
         throw key_error("CKey::operator=(const CKey&) : EC_KEY_copy failed");
     fSet = b.fSet;
+    fCompressedPubKey = b.fCompressedPubKey;
     return (*this);
 }
 
@@ -366,6 +369,136 @@ bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
     return true;
 }
 
+bool CKey::Verify(const std::vector<unsigned char>& vchPubKey, uint256 hash, const std::vector<unsigned char>& vchSig)
+{
+    if (!vchPubKey.empty() && !vchSig.empty())
+    {
+        int nResult = Secp256k1Verify(&vchPubKey[0], vchPubKey.size(), (unsigned char*)&hash, &vchSig[0], vchSig.size());
+        if (nResult >= 0)
+            return nResult == 1;
+    }
+
+    CKey key;
+    if (!key.SetPubKey(vchPubKey))
+        return false;
+    return key.Verify(hash, vchSig);
+}
+
+// Build a DER signature from raw R and S integer bytes, with optional bytes
+// appended after the sequence
+static std::vector<unsigned char> MakeDERSignature(const std::vector<unsigned char>& vchR, const std::vector<unsigned char>& vchS, unsigned int nExtra = 0)
+{
+    std::vector<unsigned char> vchSig;
+    vchSig.push_back(0x30);
+    vchSig.push_back(4 + vchR.size() + vchS.size());
+    vchSig.push_back(0x02);
+    vchSig.push_back(vchR.size());
+    vchSig.insert(vchSig.end(), vchR.begin(), vchR.end());
+    vchSig.push_back(0x02);
+    vchSig.push_back(vchS.size());
+    vchSig.insert(vchSig.end(), vchS.begin(), vchS.end());
+    vchSig.insert(vchSig.end(), nExtra, 0x00);
+    return vchSig;
+}
+
+// Malformed and edge-case encodings of a valid signature. The native
+// verifier must either leave these to OpenSSL or agree with it; the
+// plain sign/verify round trip below never produces them.
+static void GetDERVariants(const std::vector<unsigned char>& vchSig, std::vector<std::vector<unsigned char> >& vvchOut)
+{
+    unsigned int nLenR = vchSig[3];
+    std::vector<unsigned char> vchR(vchSig.begin() + 4, vchSig.begin() + 4 + nLenR);
+    std::vector<unsigned char> vchS(vchSig.begin() + 6 + nLenR, vchSig.end());
+
+    // the 32 value bytes of each integer, without a sign byte
+    std::vector<unsigned char> vchR32(vchR), vchS32(vchS);
+    if (vchR32.size() > 32)
+        vchR32.erase(vchR32.begin());
+    if (vchS32.size() > 32)
+        vchS32.erase(vchS32.begin());
+    while (vchR32.size() < 32)
+        vchR32.insert(vchR32.begin(), 0x00);
+    while (vchS32.size() < 32)
+        vchS32.insert(vchS32.begin(), 0x00);
+
+    for (int i = 0; i < 2; i++)
+    {
+        const std::vector<unsigned char>& vchInt = (i == 0 ? vchR : vchS);
+        const std::vector<unsigned char>& vchInt32 = (i == 0 ? vchR32 : vchS32);
+        std::vector<std::vector<unsigned char> > vvchInt;
+
+        // 33 bytes with a non-zero first byte
+        vvchInt.push_back(vchInt32);
+        vvchInt.back().insert(vvchInt.back().begin(), 0x01);
+        vvchInt.push_back(vchInt32);
+        vvchInt.back().insert(vvchInt.back().begin(), 0x80);
+        // needless leading zero
+        vvchInt.push_back(vchInt);
+        vvchInt.back().insert(vvchInt.back().begin(), 0x00);
+        // zero-padded to 32 bytes, and without its sign byte
+        vvchInt.push_back(vchInt32);
+        // zero, and a 34 byte integer
+        vvchInt.push_back(std::vector<unsigned char>(1, 0x00));
+        vvchInt.push_back(vchInt32);
+        vvchInt.back().insert(vvchInt.back().begin(), 2, 0x00);
+
+        for (unsigned int j = 0; j < vvchInt.size(); j++)
+            vvchOut.push_back(i == 0 ? MakeDERSignature(vvchInt[j], vchS) : MakeDERSignature(vchR, vvchInt[j]));
+    }
+
+    // trailing bytes, with and without the sequence length covering them
+    vvchOut.push_back(MakeDERSignature(vchR, vchS, 1));
+    vvchOut.push_back(MakeDERSignature(vchR, vchS, 1));
+    vvchOut.back()[1]++;
+    // wrong sequence and integer lengths, wrong tags
+    vvchOut.push_back(vchSig);
+    vvchOut.back()[1]--;
+    vvchOut.push_back(vchSig);
+    vvchOut.back()[3]++;
+    vvchOut.push_back(vchSig);
+    vvchOut.back()[0] = 0x31;
+    vvchOut.push_back(vchSig);
+    vvchOut.back()[2] = 0x03;
+    // truncated
+    vvchOut.push_back(std::vector<unsigned char>(vchSig.begin(), vchSig.end() - 1));
+}
+
+bool CKey::CheckNativeVerify()
+{
+    for (int i = 0; i < 4; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i & 1);
+        std::vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+        uint256 hash = GetRandHash();
+        std::vector<unsigned char> vchSig;
+        if (!key.Sign(hash, vchSig))
+            return false;
+
+        // once as signed, once with the hash changed
+        for (int j = 0; j < 2; j++)
+        {
+            if (j == 1)
+                *hash.begin() ^= 1;
+            int nNative = Secp256k1Verify(&vchPubKey[0], vchPubKey.size(), (unsigned char*)&hash, &vchSig[0], vchSig.size());
+            if (nNative != (key.Verify(hash, vchSig) ? 1 : 0))
+                return false;
+        }
+        *hash.begin() ^= 1;
+
+        std::vector<std::vector<unsigned char> > vvchSig;
+        GetDERVariants(vchSig, vvchSig);
+        for (unsigned int j = 0; j < vvchSig.size(); j++)
+        {
+            const std::vector<unsigned char>& vch = vvchSig[j];
+            int nNative = Secp256k1Verify(&vchPubKey[0], vchPubKey.size(), (unsigned char*)&hash, &vch[0], vch.size());
+            if (nNative >= 0 && nNative != (key.Verify(hash, vch) ? 1 : 0))
+                return error("CKey::CheckNativeVerify() : native verifier disagrees with OpenSSL on %s", HexStr(vch).c_str());
+        }
+    }
+    return true;
+}
+
 bool CKey::VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
     CKey key;
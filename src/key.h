@@ -156,6 +156,13 @@ public:
 
     bool Verify(uint256 hash, const std::vector<unsigned char>& vchSig);
 
+    // Verify a signature against a serialized public key, with the native
+    // secp256k1 code where it applies and OpenSSL otherwise
+    static bool Verify(const std::vector<unsigned char>& vchPubKey, uint256 hash, const std::vector<unsigned char>& vchSig);
+
+    // Cross-check the native verifier against OpenSSL on fresh keys
+    static bool CheckNativeVerify();
+
     // Verify a compact signature
     bool VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig);
 
@@ -83,6 +83,7 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        mapKeyCache.clear();
     }
 
     NotifyStatusChanged(this);
@@ -126,13 +127,8 @@ bool CCryptoKeyStore::AddKey(const CKey& key)
         if (!IsCrypted())
             return CBasicKeyStore::AddKey(key);
 
-        if (IsLocked())
-            return false;
-
         std::vector<unsigned char> vchCryptedSecret;
-        CPubKey vchPubKey = key.GetPubKey();
-        bool fCompressed;
-        if (!EncryptSecret(vMasterKey, key.GetSecret(fCompressed), vchPubKey.GetHash(), vchCryptedSecret))
+        if (!EncryptKey(key, vchCryptedSecret))
             return false;
 
         if (!AddCryptedKey(key.GetPubKey(), vchCryptedSecret))
@@ -141,6 +137,17 @@ bool CCryptoKeyStore::AddKey(const CKey& key)
     return true;
 }
 
+bool CCryptoKeyStore::EncryptKey(const CKey& key, std::vector<unsigned char>& vchCryptedSecret)
+{
+    LOCK(cs_KeyStore);
+    if (IsLocked())
+        return false;
+
+    CPubKey vchPubKey = key.GetPubKey();
+    bool fCompressed;
+    return EncryptSecret(vMasterKey, key.GetSecret(fCompressed), vchPubKey.GetHash(), vchCryptedSecret);
+}
+
 
 bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
@@ -154,12 +161,32 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
     return true;
 }
 
+void CCryptoKeyStore::CacheKey(const CKeyID &address, const CKey& key) const
+{
+    LOCK(cs_KeyStore);
+    if (mapKeyCache.size() >= MAX_KEY_CACHE_SIZE)
+        mapKeyCache.erase(mapKeyCache.begin());
+    mapKeyCache.insert(std::make_pair(address, key));
+}
+
 bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
 {
     {
         LOCK(cs_KeyStore);
+        KeyCache::const_iterator mc = mapKeyCache.find(address);
+        if (mc != mapKeyCache.end())
+        {
+            keyOut = (*mc).second;
+            return true;
+        }
+
         if (!IsCrypted())
-            return CBasicKeyStore::GetKey(address, keyOut);
+        {
+            if (!CBasicKeyStore::GetKey(address, keyOut))
+                return false;
+            CacheKey(address, keyOut);
+            return true;
+        }
 
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
@@ -173,12 +200,79 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
                 return false;
             keyOut.SetPubKey(vchPubKey);
             keyOut.SetSecret(vchSecret);
+            CacheKey(address, keyOut);
             return true;
         }
     }
     return false;
 }
 
+// Decrypts and sets up every nStep'th key; the keys that fail are left unset
+void static ThreadPrewarmKeys(const CKeyingMaterial* pvMasterKey, const std::vector<std::pair<CPubKey, std::vector<unsigned char> > >* pvCrypted,
+                              std::vector<CKey>* pvKey, unsigned int nFirst, unsigned int nStep)
+{
+    for (unsigned int i = nFirst; i < pvCrypted->size(); i += nStep)
+    {
+        const CPubKey &vchPubKey = (*pvCrypted)[i].first;
+        CSecret vchSecret;
+        if (!DecryptSecret(*pvMasterKey, (*pvCrypted)[i].second, vchPubKey.GetHash(), vchSecret) || vchSecret.size() != 32)
+            continue;
+        try
+        {
+            (*pvKey)[i].SetPubKey(vchPubKey);
+            (*pvKey)[i].SetSecret(vchSecret);
+        }
+        catch (key_error& e)
+        {
+            (*pvKey)[i].Reset();
+        }
+    }
+}
+
+// Fills the key cache for the given addresses ahead of signing with them,
+// decrypting the keys not cached yet on all cores at once
+void CCryptoKeyStore::PrewarmKeyCache(const std::vector<CKeyID> &vAddress) const
+{
+    CKeyingMaterial vMasterKeyCopy;
+    std::vector<CKeyID> vMissing;
+    std::vector<std::pair<CPubKey, std::vector<unsigned char> > > vCrypted;
+    {
+        LOCK(cs_KeyStore);
+        if (!IsCrypted() || IsLocked())
+            return;
+        BOOST_FOREACH(const CKeyID &address, vAddress)
+        {
+            if (mapKeyCache.count(address))
+                continue;
+            CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
+            if (mi == mapCryptedKeys.end())
+                continue;
+            vMissing.push_back(address);
+            vCrypted.push_back((*mi).second);
+        }
+        vMasterKeyCopy = vMasterKey;
+    }
+    if (vMissing.empty())
+        return;
+
+    std::vector<CKey> vKey(vMissing.size());
+    unsigned int nThreads = std::min(vMissing.size(), (size_t)std::max(1, (int)boost::thread::hardware_concurrency()));
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ThreadPrewarmKeys, &vMasterKeyCopy, &vCrypted, &vKey, i, nThreads));
+    threads.join_all();
+
+    {
+        LOCK(cs_KeyStore);
+        // The wallet may have been locked meanwhile
+        if (IsLocked())
+            return;
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            if (!vKey[i].IsNull())
+                CacheKey(vMissing[i], vKey[i]);
+    }
+}
+
 bool CCryptoKeyStore::GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const
 {
     {
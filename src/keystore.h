@@ -101,6 +101,10 @@ public:
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
+typedef std::map<CKeyID, CKey> KeyCache;
+
+/** The max. number of ready-to-sign keys CCryptoKeyStore keeps */
+static const unsigned int MAX_KEY_CACHE_SIZE = 1000;
 
 /** Keystore which keeps the private keys encrypted.
  * It derives from the basic key store, which is used if no encryption is active.
@@ -116,6 +120,14 @@ private:
     // if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
 
+    // keys GetKey has decrypted and set up before, so signing many inputs
+    // doesn't pay for that again each time; emptied by Lock(). The secrets
+    // live in the OpenSSL EC_KEY of each CKey, outside secure_allocator's
+    // locked pages, and are cleared by EC_KEY_free when a key is dropped.
+    mutable KeyCache mapKeyCache;
+
+    void CacheKey(const CKeyID &address, const CKey& key) const;
+
 protected:
     bool SetCrypted();
 
@@ -124,6 +136,9 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // encrypts the key's secret as AddKey would, without storing it
+    bool EncryptKey(const CKey& key, std::vector<unsigned char>& vchCryptedSecret);
+
 public:
     CCryptoKeyStore() : fUseCrypto(false)
     {
@@ -162,6 +177,7 @@ public:
     }
     bool GetKey(const CKeyID &address, CKey& keyOut) const;
     bool GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const;
+    void PrewarmKeyCache(const std::vector<CKeyID> &vAddress) const;
     void GetKeys(std::set<CKeyID> &setAddress) const
     {
         if (!IsCrypted())
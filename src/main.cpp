@@ -15,6 +15,9 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 
 using namespace std;
 using namespace boost;
@@ -52,8 +55,42 @@ CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CDataStream*> mapOrphanTransactions;
-map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+bool fHeadersFirst = true;
+static map<uint256, CHeaderIndex*> mapHeaderIndex;
+static CHeaderIndex* pindexBestHeader = NULL;
+/* The best header chain by height; NULL where the block is already indexed */
+static vector<CHeaderIndex*> vHeaderChain;
+/* The indexed block the listed header chain is rooted at */
+static CBlockIndex* pindexHeaderRoot = NULL;
+/* Block bodies requested in headers-first mode with the peer and time asked */
+static map<uint256, pair<CNode*, int64> > mapBlocksInFlight;
+static CNode* pnodeHeadersSync = NULL;
+/* Headers whose blocks turned out invalid, and any headers built on them */
+static set<uint256> setFailedHeaders;
+static int64 nHeadersSyncTime = 0;
+
+/* Compact blocks waiting for the transactions requested with getblocktxn */
+struct CPartialBlock
+{
+    CNode* pfrom;
+    int64 nTime;
+    CBlock block;
+    vector<unsigned int> vMissing;
+};
+static map<uint256, CPartialBlock> mapPartialBlocks;
+
+/** A transaction whose inputs are not known yet, and the peer it came from */
+struct COrphanTx
+{
+    CTransaction tx;
+    CNode* pfrom;
+    int64 nTimeExpire;
+    unsigned int nSize;
+};
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+map<CNode*, unsigned int> mapOrphanCountByPeer;
+uint64 nOrphanTxSize = 0;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -66,6 +103,8 @@ int64 nHPSTimerStart;
 // Settings
 int64 nTransactionFee = 0;
 int64 nMinimumInputValue = CENT / 100;
+int64 nMaxMempoolSize = DEFAULT_MAX_MEMPOOL_SIZE * 1000000;
+int64 nMempoolExpiry = DEFAULT_MEMPOOL_EXPIRY * 60 * 60;
 
 
 /* Old network magic number */
@@ -117,32 +156,210 @@ bool static GetTransaction(const uint256& hashTx, CWalletTx& wtx)
     return false;
 }
 
+// Notifications raised with cs_main held go through a queue and are applied
+// in order by ThreadWalletNotify, so wallet.dat writes don't hold up block
+// connection. Once that thread has fallen MAX_WALLET_QUEUE notifications
+// behind, the producer waits for it to catch up. Only while it isn't running,
+// i.e. before the node starts and at shutdown, are they applied right away.
+// Applying needs no cs_main: notifications carry what they need of the block
+// chain. The producer may thus wait with cs_main held, as long as nothing
+// holding cs_walletApply, cs_setpwalletRegistered or cs_wallet waits for
+// cs_main; the lock order is cs_main, cs_walletApply, cs_setpwalletRegistered,
+// cs_wallet, the same as LOCK2(cs_main, cs_wallet) of the RPC and GUI code.
+static CCriticalSection cs_walletApply;
+static boost::mutex cs_walletQueue;
+static boost::condition_variable condWalletQueue;
+static boost::condition_variable condWalletApplied;
+static deque<boost::function<void (CWallet*)> > queueWalletNotify;
+static uint64 nWalletQueued = 0;
+static uint64 nWalletApplied = 0;
+static bool fWalletQueueRunning = false;
+
+// Applies up to nMax queued notifications, each under the cs_wallet of
+// the wallet it goes to
+void static ApplyWalletNotifications(unsigned int nMax)
+{
+    LOCK(cs_walletApply);
+    for (unsigned int n = 0; n < nMax; n++)
+    {
+        boost::function<void (CWallet*)> notify;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_walletQueue);
+            if (queueWalletNotify.empty())
+                break;
+            notify = queueWalletNotify.front();
+            queueWalletNotify.pop_front();
+        }
+        LOCK(cs_setpwalletRegistered);
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        {
+            try
+            {
+                LOCK(pwallet->cs_wallet);
+                notify(pwallet);
+            }
+            catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ApplyWalletNotifications()");
+            }
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(cs_walletQueue);
+            nWalletApplied++;
+        }
+        condWalletApplied.notify_all();
+    }
+}
+
+void static QueueWalletNotification(const boost::function<void (CWallet*)>& notify)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_walletQueue);
+        while (fWalletQueueRunning && queueWalletNotify.size() >= MAX_WALLET_QUEUE)
+            condWalletApplied.timed_wait(lock, boost::posix_time::milliseconds(500));
+        if (fWalletQueueRunning)
+        {
+            queueWalletNotify.push_back(notify);
+            nWalletQueued++;
+            lock.unlock();
+            condWalletQueue.notify_one();
+            return;
+        }
+    }
+
+    // ThreadWalletNotify is gone or not started yet, whatever is still
+    // queued comes first
+    LOCK2(cs_walletApply, cs_setpwalletRegistered);
+    ApplyWalletNotifications(std::numeric_limits<unsigned int>::max());
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+    {
+        LOCK(pwallet->cs_wallet);
+        notify(pwallet);
+    }
+}
+
+// Waits until the wallets have seen every notification queued so far.
+// Must not be called with cs_main held.
+void SyncWithWalletQueue()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_walletQueue);
+        uint64 nTarget = nWalletQueued;
+        while (nWalletApplied < nTarget && fWalletQueueRunning)
+            condWalletApplied.timed_wait(lock, boost::posix_time::milliseconds(500));
+        if (nWalletApplied >= nTarget)
+            return;
+    }
+    ApplyWalletNotifications(std::numeric_limits<unsigned int>::max());
+}
+
+// Waits for ThreadWalletNotify to drain the queue and exit, then applies
+// whatever was queued since. Called at shutdown before the wallets go away.
+void FlushWalletQueue()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_walletQueue);
+        while (fWalletQueueRunning)
+            condWalletApplied.timed_wait(lock, boost::posix_time::milliseconds(500));
+    }
+    ApplyWalletNotifications(std::numeric_limits<unsigned int>::max());
+}
+
+void static ThreadWalletNotify2(void* parg)
+{
+    loop
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs_walletQueue);
+            while (queueWalletNotify.empty() && !fShutdown)
+                condWalletQueue.timed_wait(lock, boost::posix_time::milliseconds(500));
+            // Drain the queue before exiting
+            if (queueWalletNotify.empty())
+                break;
+        }
+        ApplyWalletNotifications(1);
+    }
+}
+
+void static StopWalletQueue()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_walletQueue);
+        fWalletQueueRunning = false;
+    }
+    condWalletApplied.notify_all();
+}
+
+void ThreadWalletNotify(void* parg)
+{
+    // Make this thread recognisable as the wallet notification thread
+    RenameThread("pxc-walletnotify");
+
+    try
+    {
+        vnThreadsRunning[THREAD_WALLETNOTIFY]++;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_walletQueue);
+            fWalletQueueRunning = true;
+        }
+        ThreadWalletNotify2(parg);
+        StopWalletQueue();
+        vnThreadsRunning[THREAD_WALLETNOTIFY]--;
+    }
+    catch (std::exception& e) {
+        StopWalletQueue();
+        vnThreadsRunning[THREAD_WALLETNOTIFY]--;
+        PrintException(&e, "ThreadWalletNotify()");
+    } catch (...) {
+        StopWalletQueue();
+        vnThreadsRunning[THREAD_WALLETNOTIFY]--;
+        PrintException(NULL, "ThreadWalletNotify()");
+    }
+    printf("ThreadWalletNotify exited\n");
+}
+
+void static WalletSyncBlock(CWallet* pwallet, boost::shared_ptr<CBlock> pblock)
+{
+    BOOST_FOREACH(const CTransaction& tx, pblock->vtx)
+        pwallet->AddToWalletIfInvolvingMe(tx, pblock.get(), true);
+}
+
+void static WalletSyncTransaction(CWallet* pwallet, const CTransaction& tx, boost::shared_ptr<CBlock> pblock, bool fUpdate)
+{
+    pwallet->AddToWalletIfInvolvingMe(tx, pblock.get(), fUpdate);
+}
+
 // erases transaction with the given hash from all wallets
 void static EraseFromWallets(uint256 hash)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->EraseFromWallet(hash);
+    QueueWalletNotification(boost::bind(&CWallet::EraseFromWallet, _1, hash));
 }
 
 // make sure all wallets know about the given transaction, in the given block
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->AddToWalletIfInvolvingMe(tx, pblock, fUpdate);
+    boost::shared_ptr<CBlock> pblockCopy;
+    if (pblock)
+        pblockCopy.reset(new CBlock(*pblock));
+    QueueWalletNotification(boost::bind(&WalletSyncTransaction, _1, tx, pblockCopy, fUpdate));
+}
+
+// make sure all wallets know about the transactions of a newly connected block
+void static SyncBlockWithWallets(const CBlock& block)
+{
+    boost::shared_ptr<CBlock> pblock(new CBlock(block));
+    QueueWalletNotification(boost::bind(&WalletSyncBlock, _1, pblock));
 }
 
 // notify wallets about a new best chain
 void static SetBestChain(const CBlockLocator& loc)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->SetBestChain(loc);
+    QueueWalletNotification(boost::bind(&CWallet::SetBestChain, _1, loc));
 }
 
 // notify wallets about an updated transaction
 void static UpdatedTransaction(const uint256& hashTx)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->UpdatedTransaction(hashTx);
+    QueueWalletNotification(boost::bind(&CWallet::UpdatedTransaction, _1, hashTx));
 }
 
 // dump all wallets
@@ -177,33 +394,42 @@ void static ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CDataStream& vMsg)
+bool AddOrphanTx(const CTransaction& tx, CNode* pfrom)
 {
-    CTransaction tx;
-    CDataStream(vMsg) >> tx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
-    CDataStream* pvMsg = new CDataStream(vMsg);
-
     // Ignore big transactions, to avoid a
     // send-big-orphans memory exhaustion attack. If a peer has a legitimate
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    if (pvMsg->size() > 5000)
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    if (nSize > 5000)
+    {
+        printf("ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
+        return false;
+    }
+
+    // No single peer gets to fill the pool for everybody else
+    if (pfrom && mapOrphanCountByPeer[pfrom] >= MAX_ORPHAN_TRANSACTIONS_PER_PEER)
     {
-        printf("ignoring large orphan tx (size: %u, hash: %s)\n", pvMsg->size(), hash.ToString().substr(0,10).c_str());
-        delete pvMsg;
+        printf("ignoring orphan tx %s, peer %s has too many\n", hash.ToString().substr(0,10).c_str(),
+          pfrom->addr.ToString().c_str());
         return false;
     }
 
-    mapOrphanTransactions[hash] = pvMsg;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.pfrom = pfrom;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = nSize;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(make_pair(hash, pvMsg));
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    if (pfrom)
+        mapOrphanCountByPeer[pfrom]++;
+    nOrphanTxSize += nSize;
 
     printf("stored orphan tx %s (mapsz %u)\n", hash.ToString().substr(0,10).c_str(),
         mapOrphanTransactions.size());
@@ -212,29 +438,66 @@ bool AddOrphanTx(const CDataStream& vMsg)
 
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
         return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx& orphan = (*it).second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator mi = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (mi == mapOrphanTransactionsByPrev.end())
+            continue;
+        (*mi).second.erase(hash);
+        if ((*mi).second.empty())
+            mapOrphanTransactionsByPrev.erase(mi);
+    }
+    if (orphan.pfrom)
+    {
+        map<CNode*, unsigned int>::iterator pi = mapOrphanCountByPeer.find(orphan.pfrom);
+        if (pi != mapOrphanCountByPeer.end() && --(*pi).second == 0)
+            mapOrphanCountByPeer.erase(pi);
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
+    nOrphanTxSize -= orphan.nSize;
+    mapOrphanTransactions.erase(it);
+}
+
+/* Forgets the orphans of a peer that is going away */
+void static EraseOrphansFor(CNode* pnode)
+{
+    if (!mapOrphanCountByPeer.count(pnode))
+        return;
+    vector<uint256> vErase;
+    for (map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+        if ((*mi).second.pfrom == pnode)
+            vErase.push_back((*mi).first);
+    BOOST_FOREACH(const uint256& hash, vErase)
+        EraseOrphanTx(hash);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64 nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+
+    // Expire old orphans first, their parents are unlikely to turn up now
+    static int64 nNextSweep;
+    int64 nNow = GetTime();
+    if (nNextSweep <= nNow)
+    {
+        vector<uint256> vExpired;
+        for (map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+            if ((*mi).second.nTimeExpire <= nNow)
+                vExpired.push_back((*mi).first);
+        BOOST_FOREACH(const uint256& hash, vExpired)
+            EraseOrphanTx(hash);
+        nEvicted += vExpired.size();
+        nNextSweep = nNow + ORPHAN_TX_EXPIRE_TIME / 4;
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTxSize > nMaxBytes)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
-        map<uint256, CDataStream*>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
         if (it == mapOrphanTransactions.end())
             it = mapOrphanTransactions.begin();
         EraseOrphanTx(it->first);
@@ -405,23 +668,8 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
             pblock = &blockTmp;
         }
 
-        // Update the tx's hashBlock
-        hashBlock = pblock->GetHash();
-
-        // Locate the transaction
-        for (nIndex = 0; nIndex < (int)pblock->vtx.size(); nIndex++)
-            if (pblock->vtx[nIndex] == *(CTransaction*)this)
-                break;
-        if (nIndex == (int)pblock->vtx.size())
-        {
-            vMerkleBranch.clear();
-            nIndex = -1;
-            printf("ERROR: SetMerkleBranch() : couldn't find tx in block\n");
+        if (!SetMerkleBranchFromBlock(*pblock))
             return 0;
-        }
-
-        // Fill in merkle branch
-        vMerkleBranch = pblock->GetMerkleBranch(nIndex);
     }
 
     // Is the tx in a block that's in the main chain
@@ -435,6 +683,31 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     return pindexBest->nHeight - pindex->nHeight + 1;
 }
 
+// Sets hashBlock, nIndex and the merkle branch from the block alone;
+// unlike SetMerkleBranch() this doesn't read the block chain, so
+// cs_main isn't needed
+bool CMerkleTx::SetMerkleBranchFromBlock(const CBlock& block)
+{
+    // Update the tx's hashBlock
+    hashBlock = block.GetHash();
+
+    // Locate the transaction
+    for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
+        if (block.vtx[nIndex] == *(CTransaction*)this)
+            break;
+    if (nIndex == (int)block.vtx.size())
+    {
+        vMerkleBranch.clear();
+        nIndex = -1;
+        printf("ERROR: SetMerkleBranch() : couldn't find tx in block\n");
+        return false;
+    }
+
+    // Fill in merkle branch
+    vMerkleBranch = block.GetMerkleBranch(nIndex);
+    return true;
+}
+
 
 
 
@@ -490,8 +763,56 @@ bool CTransaction::CheckTransaction() const
 }
 
 
+CTxMemPoolEntry::CTxMemPoolEntry()
+{
+    nFee = 0;
+    nTxSize = 0;
+    nTime = 0;
+    nHeight = 0;
+    dPriority = 0;
+    nValueInChain = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64 nFeeIn, int64 nTimeIn,
+                                 int nHeightIn, double dPriorityIn, int64 nValueInChainIn) :
+    tx(txIn), nFee(nFeeIn), nTime(nTimeIn), nHeight(nHeightIn),
+    dPriority(dPriorityIn), nValueInChain(nValueInChainIn)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+}
+
+/* Priority of a transaction's inputs, sum(value * confirmations) / size;
+ * also returns the value of the inputs already in the chain */
+static double GetInputPriority(const CTxMemPoolPrepared& prepared, int64& nValueInChainRet)
+{
+    double dPriority = 0;
+    nValueInChainRet = 0;
+    for (unsigned int i = 0; i < prepared.vChainInputs.size(); i++)
+    {
+        int nConf = 1;
+        map<uint256, CBlockIndex*>::iterator bi = mapBlockIndex.find(prepared.vChainInputs[i].first);
+        if (bi != mapBlockIndex.end() && (*bi).second->IsInMainChain())
+            nConf = pindexBest->nHeight - (*bi).second->nHeight;
+
+        int64 nValueIn = prepared.vChainInputs[i].second;
+        nValueInChainRet += nValueIn;
+        dPriority += (double)nValueIn * nConf;
+    }
+    return dPriority / prepared.nTxSize;
+}
+
 bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, int64 nAcceptTime)
+{
+    // The caller holds cs_main, so the chain cannot move between the halves
+    CTxMemPoolPrepared prepared;
+    if (!prepare(txdb, tx, fCheckInputs, pfMissingInputs, prepared))
+        return false;
+    return commit(tx, prepared, pfMissingInputs, nAcceptTime);
+}
+
+bool CTxMemPool::prepare(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
+                         bool* pfMissingInputs, CTxMemPoolPrepared& prepared)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -511,51 +832,45 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     if (!fTestNet && !tx.IsStandard())
         return error("CTxMemPool::accept() : nonstandard transaction type");
 
+    // Everything below is checked against this chain tip
+    const CBlockIndex* pindexPrepare;
+    {
+        LOCK(cs_main);
+        prepared.hashBestChain = hashBestChain;
+        pindexPrepare = pindexBest;
+    }
+
     // Do we already have it?
     uint256 hash = tx.GetHash();
     {
         LOCK(cs);
         if (mapTx.count(hash))
             return false;
+
+        // Conflicts with in-memory transactions are final for now,
+        // commit() has the last word
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (mapNextTx.count(txin.prevout))
+                return false;
     }
     if (fCheckInputs)
         if (txdb.ContainsTx(hash))
             return false;
 
-    // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
-    {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (mapNextTx.count(outpoint))
-        {
-            // Disable replacement feature for now
-            return false;
-
-            // Allow replacing with a newer version of the same transaction
-            if (i != 0)
-                return false;
-            ptxOld = mapNextTx[outpoint].ptx;
-            if (ptxOld->IsFinal())
-                return false;
-            if (!tx.IsNewerThan(*ptxOld))
-                return false;
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
-            {
-                COutPoint outpoint = tx.vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
-                    return false;
-            }
-            break;
-        }
-    }
+    // The inputs are looked up even when not checked, the pool entry
+    // records the fee and priority they give
+    MapPrevTx mapInputs;
+    map<uint256, CTxIndex> mapUnused;
+    bool fInvalid = false;
+    prepared.fHaveInputs = tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid);
+    prepared.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    prepared.nFees = prepared.fHaveInputs ? tx.GetValueIn(mapInputs) - tx.GetValueOut() : 0;
+    int64 nFees = prepared.nFees;
+    unsigned int nTxSize = prepared.nTxSize;
 
     if (fCheckInputs)
     {
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+        if (!prepared.fHaveInputs)
         {
             if (fInvalid)
                 return error("CTxMemPool::accept() : FetchInputs found invalid tx %s", hash.ToString().substr(0,10).c_str());
@@ -572,9 +887,6 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        int64 nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-        unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-
         // Don't accept it if it can't get into a block
         if(nFees < tx.GetMinFee(nTxSize, true, GMF_RELAY))
             return error("CTxMemPool::accept() : not enough fees");
@@ -606,21 +918,120 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false))
+        if (!tx.ConnectInputs(mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexPrepare, false, false))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
     }
 
-    // Store transaction in memory
+    // Note where the inputs are: parents in the pool must still be there
+    // at commit time, inputs in the chain give the transaction its priority
+    if (prepared.fHaveInputs)
+    {
+        map<uint256, uint256> mapInputBlock;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            MapPrevTx::iterator mi = mapInputs.find(txin.prevout.hash);
+            if (mi == mapInputs.end() || txin.prevout.n >= (*mi).second.second.vout.size())
+                continue;
+
+            const CTxIndex& txindex = (*mi).second.first;
+            if (txindex.pos == CDiskTxPos(1,1,1))
+            {
+                prepared.vPoolParents.push_back(txin.prevout.hash);
+                continue;
+            }
+
+            map<uint256, uint256>::iterator bi = mapInputBlock.find(txin.prevout.hash);
+            if (bi == mapInputBlock.end())
+            {
+                CBlock block;
+                uint256 hashBlock = 0;
+                if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                    hashBlock = block.GetHash();
+                bi = mapInputBlock.insert(make_pair(txin.prevout.hash, hashBlock)).first;
+            }
+            prepared.vChainInputs.push_back(make_pair((*bi).second, (*mi).second.second.vout[txin.prevout.n].nValue));
+        }
+    }
+
+    return true;
+}
+
+bool CTxMemPool::commit(CTransaction &tx, const CTxMemPoolPrepared& prepared,
+                        bool* pfMissingInputs, int64 nAcceptTime)
+{
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    uint256 hash = tx.GetHash();
+    if (prepared.hashBestChain != hashBestChain)
+        return error("CTxMemPool::accept() : chain changed while checking %s", hash.ToString().substr(0,10).c_str());
+
+    const CTransaction* ptxOld = NULL;
     {
         LOCK(cs);
+        if (mapTx.count(hash))
+            return false;
+
+        // Check for conflicts with in-memory transactions
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            COutPoint outpoint = tx.vin[i].prevout;
+            if (mapNextTx.count(outpoint))
+            {
+                // Disable replacement feature for now
+                return false;
+
+                // Allow replacing with a newer version of the same transaction
+                if (i != 0)
+                    return false;
+                ptxOld = mapNextTx[outpoint].ptx;
+                if (ptxOld->IsFinal())
+                    return false;
+                if (!tx.IsNewerThan(*ptxOld))
+                    return false;
+                for (unsigned int i = 0; i < tx.vin.size(); i++)
+                {
+                    COutPoint outpoint = tx.vin[i].prevout;
+                    if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
+                        return false;
+                }
+                break;
+            }
+        }
+
+        // Parents may have left the pool since prepare()
+        BOOST_FOREACH(const uint256& hashParent, prepared.vPoolParents)
+        {
+            if (!mapTx.count(hashParent))
+            {
+                if (pfMissingInputs)
+                    *pfMissingInputs = true;
+                return false;
+            }
+        }
+
+        // Store transaction in memory
         if (ptxOld)
         {
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+
+        int64 nValueInChain = 0;
+        double dPriority = GetInputPriority(prepared, nValueInChain);
+        addUnchecked(CTxMemPoolEntry(tx, prepared.nFees, nAcceptTime ? nAcceptTime : GetTime(), nBestHeight, dPriority, nValueInChain));
+
+        // Keep the pool within its limits, which may push the newcomer out again
+        if (nMempoolExpiry > 0)
+            Expire(GetTime() - nMempoolExpiry);
+        if (nMaxMempoolSize > 0)
+        {
+            TrimToSize(nMaxMempoolSize);
+            if (!exists(hash))
+                return error("CTxMemPool::accept() : memory pool full");
+        }
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -639,45 +1050,167 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+bool CTxMemPool::addUnchecked(const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        std::pair<txiter, bool> ret = mapTx.insert(entry);
+        if (!ret.second)
+            return false;
+        const CTransaction& tx = (*ret.first).tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        nTotalTxSize += entry.nTxSize;
         nTransactionsUpdated++;
     }
     return true;
 }
 
 
-bool CTxMemPool::remove(CTransaction &tx)
+bool CTxMemPool::remove(const CTransaction &tx)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end())
         {
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            BOOST_FOREACH(const CTxIn& txin, (*it).tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            nTotalTxSize -= (*it).nTxSize;
+            mapTx.erase(it);
             nTransactionsUpdated++;
         }
     }
     return true;
 }
 
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::vector<uint256>& vQueue)
+{
+    // The transaction and everything spending from it, breadth first
+    LOCK(cs);
+    vQueue.assign(1, hash);
+    set<uint256> setQueued(vQueue.begin(), vQueue.end());
+    for (unsigned int n = 0; n < vQueue.size(); n++)
+    {
+        txiter it = mapTx.find(vQueue[n]);
+        if (it == mapTx.end())
+            continue;
+        for (unsigned int i = 0; i < (*it).tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator mi = mapNextTx.find(COutPoint(vQueue[n], i));
+            if (mi == mapNextTx.end())
+                continue;
+            uint256 hashSpender = (*mi).second.ptx->GetHash();
+            if (setQueued.insert(hashSpender).second)
+                vQueue.push_back(hashSpender);
+        }
+    }
+}
+
+void CTxMemPool::removeRecursive(const CTransaction &tx, std::list<CTransaction>& removed)
+{
+    LOCK(cs);
+
+    vector<uint256> vQueue;
+    CalculateDescendants(tx.GetHash(), vQueue);
+
+    // Spenders first, so no entry is ever left without its inputs
+    for (vector<uint256>::reverse_iterator ri = vQueue.rbegin(); ri != vQueue.rend(); ++ri)
+    {
+        txiter it = mapTx.find(*ri);
+        if (it == mapTx.end())
+            continue;
+        removed.push_back((*it).tx);
+        remove(removed.back());
+    }
+}
+
+void CTxMemPool::TrimToSize(uint64 nSizeLimit, std::list<CTransaction>* pvRemoved)
+{
+    LOCK(cs);
+    std::list<CTransaction> removed;
+    while (nTotalTxSize > nSizeLimit && !mapTx.empty())
+    {
+        // The transaction whose package with its in-pool spenders pays the
+        // least per byte goes, along with those spenders which could not be
+        // mined without it; a cheap parent whose child pays for it stays.
+        // Candidates are taken by their own fee rate and the scan ends once
+        // that reaches the cheapest package found, as a package can only be
+        // cheaper than its head through descendants that come earlier.
+        typedef indexed_transaction_set::index<fee_rate>::type::iterator feeiter;
+        uint256 hashEvict = (*mapTx.get<fee_rate>().begin()).tx.GetHash();
+        int64 nEvictFees = 0;
+        uint64 nEvictSize = 0;
+        unsigned int nCandidates = 0;
+        for (feeiter fi = mapTx.get<fee_rate>().begin(); fi != mapTx.get<fee_rate>().end() && nCandidates < MAX_EVICTION_CANDIDATES; ++fi, nCandidates++)
+        {
+            if (nEvictSize > 0 && (double)(*fi).nFee * nEvictSize >= (double)nEvictFees * (*fi).nTxSize)
+                break;
+            int64 nFees;
+            uint64 nSize;
+            GetDescendantPackage((*fi).tx.GetHash(), nFees, nSize);
+            if (nEvictSize == 0 || (double)nFees * nEvictSize < (double)nEvictFees * nSize)
+            {
+                hashEvict = (*fi).tx.GetHash();
+                nEvictFees = nFees;
+                nEvictSize = nSize;
+            }
+        }
+        CTransaction tx = (*mapTx.find(hashEvict)).tx;
+        removeRecursive(tx, removed);
+    }
+    if (!removed.empty())
+        printf("CTxMemPool::TrimToSize() : evicted %u transactions, %"PRI64u" bytes left\n",
+               (unsigned int)removed.size(), nTotalTxSize);
+    if (pvRemoved)
+        pvRemoved->splice(pvRemoved->end(), removed);
+}
+
+void CTxMemPool::GetDescendantPackage(const uint256& hash, int64& nFeesRet, uint64& nSizeRet)
+{
+    LOCK(cs);
+    vector<uint256> vPackage;
+    CalculateDescendants(hash, vPackage);
+    nFeesRet = 0;
+    nSizeRet = 0;
+    BOOST_FOREACH(const uint256& hashTx, vPackage)
+    {
+        txiter it = mapTx.find(hashTx);
+        if (it == mapTx.end())
+            continue;
+        nFeesRet += (*it).nFee;
+        nSizeRet += (*it).nTxSize;
+    }
+}
+
+int CTxMemPool::Expire(int64 nTime)
+{
+    LOCK(cs);
+    std::list<CTransaction> removed;
+    while (!mapTx.empty())
+    {
+        const CTxMemPoolEntry& entry = *mapTx.get<entry_time>().begin();
+        if (entry.nTime >= nTime)
+            break;
+        CTransaction tx = entry.tx;
+        removeRecursive(tx, removed);
+    }
+    if (!removed.empty())
+        printf("CTxMemPool::Expire() : expired %u transactions\n", (unsigned int)removed.size());
+    return removed.size();
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (txiter mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back((*mi).tx.GetHash());
 }
 
 
@@ -777,11 +1310,8 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
         LOCK(cs_main);
         {
             LOCK(mempool.cs);
-            if (mempool.exists(hash))
-            {
-                tx = mempool.lookup(hash);
+            if (mempool.lookup(hash, tx))
                 return true;
-            }
         }
         CTxDB txdb("r");
         CTxIndex txindex;
@@ -1164,10 +1694,9 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             // Get prev tx from single transactions in memory
             {
                 LOCK(mempool.cs);
-                if (!mempool.exists(prevout.hash))
+                if (!mempool.lookup(prevout.hash, txPrev))
                     return error("FetchInputs() : %s mempool Tx prev not found %s", \
                       GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
-                txPrev = mempool.lookup(prevout.hash);
             }
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
@@ -1275,6 +1804,7 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        const CSignatureHashData txdata(*this);
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1290,11 +1820,11 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0, &txdata))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0, &txdata))
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1340,9 +1870,9 @@ bool CTransaction::ClientConnectInputs()
         {
             // Get prev tx from single transactions in memory
             COutPoint prevout = vin[i].prevout;
-            if (!mempool.exists(prevout.hash))
+            CTransaction txPrev;
+            if (!mempool.lookup(prevout.hash, txPrev))
                 return false;
-            CTransaction& txPrev = mempool.lookup(prevout.hash);
 
             if (prevout.n >= txPrev.vout.size())
                 return false;
@@ -1490,8 +2020,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     }
 
     // Watch for transactions paying to me
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, true);
+    SyncBlockWithWallets(*this);
 
     return true;
 }
@@ -1976,8 +2505,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing unless
+        // the gap is being downloaded from the header chain
+        if (pfrom && !mapHeaderIndex.count(hash))
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
         return true;
     }
@@ -2016,12 +2546,102 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 }
 
 
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    RAND_bytes((unsigned char*)&nNonce, sizeof(nNonce));
+
+    uint64 nKey0, nKey1;
+    GetShortIDKeys(nKey0, nKey1);
+    if (!block.vtx.empty())
+        vPrefilledTxn.push_back(block.vtx[0]);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs.push_back(GetShortID(block.vtx[i].GetHash(), nKey0, nKey1));
+}
+
+void CCompactBlock::GetShortIDKeys(uint64& nKey0, uint64& nKey1) const
+{
+    // Keyed by the block and a sender chosen nonce, so colliding
+    // transactions cannot be prepared in advance
+    uint256 hashBlock = header.GetHash();
+    uint256 hashKeys = Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+    nKey0 = hashKeys.Get64(0);
+    nKey1 = hashKeys.Get64(1);
+}
+
+uint64 static MixShortID(uint64 h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64 CCompactBlock::GetShortID(const uint256& hashTx, uint64 nKey0, uint64 nKey1)
+{
+    // 48 bits of a keyed mix of two 64-bit lanes of the transaction hash
+    return (MixShortID(hashTx.Get64(0) ^ nKey0) ^ MixShortID(hashTx.Get64(1) ^ nKey1)) & 0xFFFFFFFFFFFFULL;
+}
+
+bool CCompactBlock::FillBlock(CBlock& block, vector<unsigned int>& vMissing) const
+{
+    vMissing.clear();
+    if (vPrefilledTxn.size() != 1 || !vPrefilledTxn[0].IsCoinBase())
+        return error("CCompactBlock::FillBlock() : coinbase missing");
+    if (vShortTxIDs.size() >= MAX_BLOCK_SIZE / 60)
+        return error("CCompactBlock::FillBlock() : too many transactions");
+
+    block.SetNull();
+    block.nVersion = header.nVersion;
+    block.hashPrevBlock = header.hashPrevBlock;
+    block.hashMerkleRoot = header.hashMerkleRoot;
+    block.nTime = header.nTime;
+    block.nBits = header.nBits;
+    block.nNonce = header.nNonce;
+    block.vtx.resize(vShortTxIDs.size() + 1);
+    block.vtx[0] = vPrefilledTxn[0];
+
+    // Short ID collisions make the block ambiguous, the caller fetches it in full
+    map<uint64, unsigned int> mapShortIDs;
+    for (unsigned int i = 0; i < vShortTxIDs.size(); i++)
+        if (!mapShortIDs.insert(make_pair(vShortTxIDs[i], i + 1)).second)
+            return error("CCompactBlock::FillBlock() : duplicate short ID");
+
+    uint64 nKey0, nKey1;
+    GetShortIDKeys(nKey0, nKey1);
+    {
+        LOCK(mempool.cs);
+        for (CTxMemPool::txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            map<uint64, unsigned int>::const_iterator it = mapShortIDs.find(GetShortID((*mi).tx.GetHash(), nKey0, nKey1));
+            if (it == mapShortIDs.end())
+                continue;
+            if (!block.vtx[(*it).second].IsNull())
+                return error("CCompactBlock::FillBlock() : memory pool short ID collision");
+            block.vtx[(*it).second] = (*mi).tx;
+        }
+    }
+
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (block.vtx[i].IsNull())
+            vMissing.push_back(i);
+    return true;
+}
+
+
+
 
 
 
 
 
-
 bool CheckDiskSpace(uint64 nAdditionalBytes)
 {
     uint64 nFreeBytesAvailable = filesystem::space(GetDataDir()).available;
@@ -2354,6 +2974,192 @@ bool LoadExternalBlockFile(FILE* fileIn)
     return nLoaded > 0;
 }
 
+static const unsigned int MEMPOOL_DUMP_VERSION = 1;
+/* Transactions loaded per round of parallel signature checks; small
+ * enough for their signatures to stay in the signature cache */
+static const unsigned int MEMPOOL_LOAD_BATCH = 1000;
+
+/* Writes the memory pool to mempool.dat: the transactions with their entry
+ * times and fees, oldest first so that parents precede their spenders */
+bool DumpMempool()
+{
+    int64 nStart = GetTimeMillis();
+
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    unsigned int nCount;
+    {
+        LOCK(mempool.cs);
+        nCount = mempool.mapTx.size();
+        ssMempool << FLATDATA(pchMessageStart) << MEMPOOL_DUMP_VERSION;
+        WriteCompactSize(ssMempool, nCount);
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, mempool.mapTx.get<entry_time>())
+            ssMempool << entry.tx << entry.nTime << entry.nFee;
+    }
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    unsigned short randv = 0;
+    RAND_bytes((unsigned char *)&randv, sizeof(randv));
+    boost::filesystem::path pathTmp = GetDataDir() / strprintf("mempool.dat.%04x", randv);
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : fopen(%s) failed", pathTmp.string().c_str());
+
+    try {
+        fileout << ssMempool;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error");
+    }
+    fflush(fileout);
+    if (FileCommit(fileout))
+        return error("DumpMempool() : FileCommit() failed");
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+        return error("DumpMempool() : RenameOver() failed");
+
+    printf("Dumped %u memory pool transactions in %"PRI64d"ms\n", nCount, GetTimeMillis() - nStart);
+    return true;
+}
+
+/* Checks the signatures of every nStride-th transaction of a loaded batch;
+ * nothing is decided here, the point is to leave the results in the
+ * signature cache for the accept that follows */
+static void ThreadVerifyMempoolBatch(const vector<CTransaction>* pvtx, const map<uint256, unsigned int>* pmapLoaded,
+                                     unsigned int nBegin, unsigned int nEnd, unsigned int nStride)
+{
+    CTxDB txdb("r");
+    for (unsigned int n = nBegin; n < nEnd && !fShutdown; n += nStride)
+    {
+        const CTransaction& tx = (*pvtx)[n];
+        const CSignatureHashData txdata(tx);
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            map<uint256, unsigned int>::const_iterator mi = pmapLoaded->find(prevout.hash);
+            if (mi != pmapLoaded->end())
+            {
+                VerifySignature((*pvtx)[(*mi).second], tx, i, true, 0, &txdata);
+                continue;
+            }
+            CTransaction txPrev;
+            if (txdb.ReadDiskTx(prevout.hash, txPrev))
+                VerifySignature(txPrev, tx, i, true, 0, &txdata);
+        }
+    }
+}
+
+/* Reads mempool.dat back through the normal accept path */
+bool LoadMempool()
+{
+    int64 nStart = GetTimeMillis();
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    int nFileSize = GetFilesize(filein);
+    if (nFileSize < (int)sizeof(uint256))
+        return error("LoadMempool() : mempool.dat truncated");
+    vector<unsigned char> vchData(nFileSize - sizeof(uint256));
+    uint256 hashIn;
+    try {
+        if (!vchData.empty())
+            filein.read((char *)&vchData[0], vchData.size());
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : I/O error");
+    }
+    filein.fclose();
+
+    CDataStream ssMempool(vchData, SER_DISK, CLIENT_VERSION);
+    if (Hash(ssMempool.begin(), ssMempool.end()) != hashIn)
+        return error("LoadMempool() : checksum mismatch");
+
+    vector<CTransaction> vtx;
+    vector<int64> vTime;
+    try {
+        unsigned char pchMsgTmp[4];
+        unsigned int nVersion;
+        ssMempool >> FLATDATA(pchMsgTmp) >> nVersion;
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("LoadMempool() : invalid network magic number");
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool() : unknown version %u", nVersion);
+
+        unsigned int nCount = ReadCompactSize(ssMempool);
+        vtx.resize(nCount);
+        vTime.resize(nCount);
+        for (unsigned int n = 0; n < nCount; n++)
+        {
+            int64 nFee;
+            ssMempool >> vtx[n] >> vTime[n] >> nFee;
+        }
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : deserialize error");
+    }
+
+    map<uint256, unsigned int> mapLoaded;
+    for (unsigned int n = 0; n < vtx.size(); n++)
+        mapLoaded[vtx[n].GetHash()] = n;
+
+    unsigned int nThreads = max(1, (int)boost::thread::hardware_concurrency());
+    int64 nExpireTime = nMempoolExpiry > 0 ? GetTime() - nMempoolExpiry : 0;
+    int nAccepted = 0, nFailed = 0, nExpired = 0;
+    vector<unsigned int> vRetry;
+    for (unsigned int nBegin = 0; nBegin < vtx.size() && !fShutdown; nBegin += MEMPOOL_LOAD_BATCH)
+    {
+        unsigned int nEnd = min((unsigned int)vtx.size(), nBegin + MEMPOOL_LOAD_BATCH);
+
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&ThreadVerifyMempoolBatch, &vtx, &mapLoaded, nBegin + i, nEnd, nThreads));
+        threads.join_all();
+
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        for (unsigned int n = nBegin; n < nEnd; n++)
+        {
+            if (vTime[n] < nExpireTime)
+            {
+                nExpired++;
+                continue;
+            }
+            bool fMissingInputs = false;
+            if (mempool.accept(txdb, vtx[n], true, &fMissingInputs, vTime[n]))
+                nAccepted++;
+            else if (fMissingInputs)
+                vRetry.push_back(n);
+            else
+                nFailed++;
+        }
+    }
+
+    // Entries that reached the pool in a reorganisation may come before
+    // their parents; give them another pass once the rest is in
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        BOOST_FOREACH(unsigned int n, vRetry)
+        {
+            if (mempool.accept(txdb, vtx[n], true, NULL, vTime[n]))
+                nAccepted++;
+            else
+                nFailed++;
+        }
+    }
+
+    printf("Loaded %d memory pool transactions (%d failed, %d expired) in %"PRI64d"ms\n",
+           nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+    return true;
+}
+
 
 
 
@@ -2498,6 +3304,553 @@ bool CAlert::ProcessAlert()
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first synchronization
+//
+
+// The header chain is downloaded from one peer at a time with getheaders,
+// then the bodies are requested from all full peers inside a window moving
+// ahead of the best block. Bodies may arrive in any order; those without
+// a parent yet wait in mapOrphanBlocks and ProcessBlock() connects them
+// in order as the gaps are filled.
+
+void static SetBestHeader(CHeaderIndex* pindexNew)
+{
+    // Collect the new branch back to where it joins the listed chain
+    vector<CHeaderIndex*> vPath;
+    CHeaderIndex* pindex = pindexNew;
+    while (pindex && !(pindex->nHeight < (int)vHeaderChain.size() && vHeaderChain[pindex->nHeight] == pindex))
+    {
+        vPath.push_back(pindex);
+        pindex = pindex->pprev;
+    }
+
+    // A branch rooted at a block index entry replaces the whole list
+    if (pindex)
+        vHeaderChain.resize(pindex->nHeight + 1);
+    else
+    {
+        vHeaderChain.clear();
+        pindexHeaderRoot = mapBlockIndex[vPath.back()->hashPrev];
+    }
+    vHeaderChain.resize(pindexNew->nHeight + 1, NULL);
+    BOOST_FOREACH(CHeaderIndex* pindexPath, vPath)
+        vHeaderChain[pindexPath->nHeight] = pindexPath;
+
+    pindexBestHeader = pindexNew;
+}
+
+void static ResetHeaderSync()
+{
+    for (map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); mi++)
+        (*mi).second.first->nBlocksInFlight--;
+    mapBlocksInFlight.clear();
+
+    BOOST_FOREACH(PAIRTYPE(const uint256, CHeaderIndex*)& item, mapHeaderIndex)
+        delete item.second;
+    mapHeaderIndex.clear();
+    vHeaderChain.clear();
+    pindexBestHeader = NULL;
+    pindexHeaderRoot = NULL;
+}
+
+// The last block the best header chain has in common with the active chain
+CBlockIndex static * GetHeaderChainFork()
+{
+    for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+    {
+        if (pindex->nHeight >= (int)vHeaderChain.size())
+            continue;
+        CHeaderIndex* pheader = vHeaderChain[pindex->nHeight];
+        if (!pheader)
+        {
+            // Below the listed headers the header chain is the one of its root block
+            CBlockIndex* pindexFork = pindexHeaderRoot;
+            while (pindexFork && !pindexFork->IsInMainChain())
+                pindexFork = pindexFork->pprev;
+            return pindexFork;
+        }
+        if (pheader->GetBlockHash() == pindex->GetBlockHash())
+            return pindex;
+    }
+    return NULL;
+}
+
+bool static AcceptBlockHeader(const CBlock& header)
+{
+    uint256 hash = header.GetHash();
+
+    // A header chain leading to an invalid block stays rejected after the reset
+    if (setFailedHeaders.count(hash))
+        return header.DoS(100, error("AcceptBlockHeader() : header %s is known to be invalid", hash.ToString().substr(0,20).c_str()));
+    if (setFailedHeaders.count(header.hashPrevBlock))
+    {
+        setFailedHeaders.insert(hash);
+        return header.DoS(100, error("AcceptBlockHeader() : header %s builds on an invalid header", hash.ToString().substr(0,20).c_str()));
+    }
+
+    if (mapBlockIndex.count(hash) || mapHeaderIndex.count(hash))
+        return true;
+
+    // Headers must connect to a known header or block
+    CHeaderIndex* pprev = NULL;
+    CBlockIndex* pindexPrev;
+    map<uint256, CHeaderIndex*>::iterator mi = mapHeaderIndex.find(header.hashPrevBlock);
+    if (mi != mapHeaderIndex.end())
+    {
+        pprev = (*mi).second;
+        pindexPrev = &pprev->blockindex;
+    }
+    else
+    {
+        map<uint256, CBlockIndex*>::iterator miBlock = mapBlockIndex.find(header.hashPrevBlock);
+        if (miBlock == mapBlockIndex.end())
+            return error("AcceptBlockHeader() : header %s does not connect", hash.ToString().substr(0,20).c_str());
+        pindexPrev = (*miBlock).second;
+    }
+    int nHeight = pindexPrev->nHeight + 1;
+
+    // Below the last checkpoint only the best chain may be extended; any
+    // branch off it there is bound to fail a checkpoint later on
+    if (nHeight <= Checkpoints::GetTotalBlocksEstimate())
+    {
+        bool fOnBest = pprev ? (pprev->nHeight < (int)vHeaderChain.size() && vHeaderChain[pprev->nHeight] == pprev) : (pindexPrev == pindexBest);
+        if (!fOnBest || (nHeight < (int)vHeaderChain.size() && vHeaderChain[nHeight]))
+            return error("AcceptBlockHeader() : header %s forks below the checkpoints", hash.ToString().substr(0,20).c_str());
+    }
+
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return header.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"));
+
+    if (!CheckProofOfWork(header.GetPoWHash(), header.nBits))
+        return header.DoS(50, error("AcceptBlockHeader() : proof-of-work verification failed"));
+
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return error("AcceptBlockHeader() : header %s has a time stamp too far in the future", hash.ToString().substr(0,20).c_str());
+
+    // Nothing may fork off below the last checkpoint we have
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    if (pcheckpoint && nHeight <= pcheckpoint->nHeight)
+        return header.DoS(100, error("AcceptBlockHeader() : header at height %d forks below the last checkpoint", nHeight));
+
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return header.DoS(100, error("AcceptBlockHeader() : header %d is rejected by a regular checkpoint", nHeight));
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+
+    CHeaderIndex* pindexNew = new CHeaderIndex();
+    mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pprev;
+    pindexNew->hashPrev = header.hashPrevBlock;
+    pindexNew->nHeight = nHeight;
+    pindexNew->nTime = header.nTime;
+    pindexNew->bnChainWork = pindexPrev->bnChainWork + (CBigNum(1)<<256) / (bnTarget+1);
+    pindexNew->blockindex.phashBlock = pindexNew->phashBlock;
+    pindexNew->blockindex.pprev = pindexPrev;
+    pindexNew->blockindex.nHeight = nHeight;
+    pindexNew->blockindex.nTime = header.nTime;
+    pindexNew->blockindex.nBits = header.nBits;
+    pindexNew->blockindex.bnChainWork = pindexNew->bnChainWork;
+
+    if (pindexNew->bnChainWork > (pindexBestHeader ? pindexBestHeader->bnChainWork : bnBestChainWork))
+        SetBestHeader(pindexNew);
+
+    return true;
+}
+
+void static PushGetHeaders(CNode* pnode)
+{
+    // Locator along the best header chain followed by the one of the best block
+    vector<uint256> vHave;
+    int nStep = 1;
+    for (CHeaderIndex* pindex = pindexBestHeader; pindex; )
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    for (CBlockIndex* pindex = pindexBest; pindex; )
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back(hashGenesisBlock);
+
+    pnode->PushMessage("getheaders", CBlockLocator(vHave), uint256(0));
+    pnodeHeadersSync = pnode;
+    nHeadersSyncTime = GetTime();
+}
+
+void static MarkBlockReceived(const uint256& hash)
+{
+    map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi != mapBlocksInFlight.end())
+    {
+        (*mi).second.first->nBlocksInFlight--;
+        mapBlocksInFlight.erase(mi);
+    }
+}
+
+void static FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    if (!pindexBestHeader || pindexBestHeader->bnChainWork <= bnBestChainWork)
+        return;
+
+    // Start above the fork, which is below our best block if the header
+    // chain reorganizes it
+    CBlockIndex* pindexFork = GetHeaderChainFork();
+    int nStart = pindexFork ? pindexFork->nHeight + 1 : 0;
+
+    int64 nNow = GetTime();
+    int nMaxHeight = min(pindexBestHeader->nHeight, nStart - 1 + BLOCK_DOWNLOAD_WINDOW);
+    if (pto->nStartingHeight >= 0)
+        nMaxHeight = min(nMaxHeight, pto->nStartingHeight);
+
+    for (int nHeight = nStart; nHeight <= nMaxHeight; nHeight++)
+    {
+        if (pto->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            break;
+
+        CHeaderIndex* pindex = vHeaderChain[nHeight];
+        if (!pindex)
+            continue;
+        uint256 hash = pindex->GetBlockHash();
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+
+        map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.find(hash);
+        if (mi != mapBlocksInFlight.end())
+        {
+            CNode* pnodeFrom = (*mi).second.first;
+            if (!pnodeFrom->fDisconnect && nNow - (*mi).second.second < BLOCK_DOWNLOAD_TIMEOUT)
+                continue;
+            // The peer in charge is gone or stalling the window, move the request
+            if (fDebugNet)
+                printf("block %s timed out from %s\n", hash.ToString().substr(0,20).c_str(), pnodeFrom->addrName.c_str());
+            pnodeFrom->nBlocksInFlight--;
+            mapBlocksInFlight.erase(mi);
+        }
+
+        mapBlocksInFlight[hash] = make_pair(pto, nNow);
+        pto->nBlocksInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+}
+
+void FinalizeNode(CNode* pnode)
+{
+    for (map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); )
+    {
+        if ((*mi).second.first == pnode)
+            mapBlocksInFlight.erase(mi++);
+        else
+            mi++;
+    }
+    pnode->nBlocksInFlight = 0;
+
+    if (pnodeHeadersSync == pnode)
+        pnodeHeadersSync = NULL;
+
+    EraseOrphansFor(pnode);
+
+    for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
+    {
+        if ((*mi).second.pfrom == pnode)
+            mapPartialBlocks.erase(mi++);
+        else
+            mi++;
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Compact block relay
+//
+
+void static RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+void static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hash = block.GetHash();
+
+    // Short ID collisions with foreign transactions show up as a wrong
+    // merkle root; that is not the peer's fault, so fetch the full block
+    // instead of letting CheckBlock() punish it
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s did not rebuild, requesting it in full\n", hash.ToString().substr(0,20).c_str());
+        RequestFullBlock(pfrom, hash);
+        return;
+    }
+
+    CInv inv(MSG_BLOCK, hash);
+    MarkBlockReceived(hash);
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+}
+
+
+
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Transaction validation
+//
+
+/** A loose transaction waiting for validation, with the peer it came from */
+struct CTxValidationJob
+{
+    CTransaction tx;
+    CNode* pfrom;
+    unsigned int nSize;
+};
+
+static boost::mutex cs_txValidation;
+static boost::condition_variable condTxValidation;
+static deque<CTxValidationJob> queueTxValidation;
+static set<uint256> setTxValidation;
+/* Transactions queued or in validation and their total size, overall and by peer */
+static unsigned int nTxValidationQueued = 0;
+static unsigned int nTxValidationBytes = 0;
+static map<CNode*, pair<unsigned int, unsigned int> > mapTxValidationByPeer;
+
+/* Hands a transaction to the validation threads; the peer is
+ * referenced until its job is done. Transactions are dropped
+ * while the queue is full or shutting down, false is returned then. */
+bool static QueueTxValidation(const CTransaction& tx, CNode* pfrom)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_txValidation);
+        if (fShutdown)
+            return false;
+        CTxValidationJob job;
+        job.nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (nTxValidationQueued >= MAX_TX_VALIDATION_QUEUE || nTxValidationBytes + job.nSize > MAX_TX_VALIDATION_QUEUE_SIZE)
+        {
+            if (fDebug)
+                printf("QueueTxValidation() : queue full, dropping tx %s\n", tx.GetHash().ToString().substr(0,10).c_str());
+            return false;
+        }
+        // Already waiting for validation
+        if (!setTxValidation.insert(tx.GetHash()).second)
+            return true;
+        job.tx = tx;
+        job.pfrom = pfrom;
+        if (pfrom)
+        {
+            {
+                LOCK(cs_vNodes);
+                pfrom->AddRef();
+            }
+            pair<unsigned int, unsigned int>& peer = mapTxValidationByPeer[pfrom];
+            peer.first++;
+            peer.second += job.nSize;
+        }
+        nTxValidationQueued++;
+        nTxValidationBytes += job.nSize;
+        queueTxValidation.push_back(job);
+    }
+    condTxValidation.notify_one();
+    return true;
+}
+
+/* Whether the peer's transactions take more than its share of the queue,
+ * in which case no more messages are read from it for now */
+bool static IsTxQueueFull(CNode* pfrom)
+{
+    boost::unique_lock<boost::mutex> lock(cs_txValidation);
+    map<CNode*, pair<unsigned int, unsigned int> >::iterator mi = mapTxValidationByPeer.find(pfrom);
+    if (mi == mapTxValidationByPeer.end())
+        return false;
+    return (*mi).second.first >= MAX_TX_VALIDATION_QUEUE / TX_VALIDATION_PEER_SHARE ||
+           (*mi).second.second >= MAX_TX_VALIDATION_QUEUE_SIZE / TX_VALIDATION_PEER_SHARE;
+}
+
+bool static IsTxQueued(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(cs_txValidation);
+    return setTxValidation.count(hash) != 0;
+}
+
+/* Forgets the jobs left at shutdown, releasing their peers */
+void static ClearTxValidationQueue()
+{
+    vector<CNode*> vRelease;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_txValidation);
+        BOOST_FOREACH(const CTxValidationJob& job, queueTxValidation)
+        {
+            setTxValidation.erase(job.tx.GetHash());
+            nTxValidationQueued--;
+            nTxValidationBytes -= job.nSize;
+            if (job.pfrom)
+            {
+                pair<unsigned int, unsigned int>& peer = mapTxValidationByPeer[job.pfrom];
+                peer.first--;
+                peer.second -= job.nSize;
+                if (peer.first == 0)
+                    mapTxValidationByPeer.erase(job.pfrom);
+                vRelease.push_back(job.pfrom);
+            }
+        }
+        queueTxValidation.clear();
+    }
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vRelease)
+        pnode->Release();
+}
+
+void static ProcessTxValidationJob(CTxValidationJob& job)
+{
+    CTransaction& tx = job.tx;
+    CNode* pfrom = job.pfrom;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    // The expensive part, without cs_main
+    bool fMissingInputs = false;
+    CTxMemPoolPrepared prepared;
+    bool fPrepared;
+    {
+        CTxDB txdb("r");
+        fPrepared = mempool.prepare(txdb, tx, true, &fMissingInputs, prepared);
+    }
+
+    {
+        LOCK(cs_main);
+        bool fAccepted = false;
+        if (fPrepared && prepared.hashBestChain != hashBestChain)
+        {
+            // The chain moved on meanwhile, check again from scratch;
+            // the signatures are in the cache by now
+            CTxDB txdb("r");
+            fAccepted = mempool.accept(txdb, tx, true, &fMissingInputs);
+        }
+        else if (fPrepared)
+            fAccepted = mempool.commit(tx, prepared, &fMissingInputs);
+
+        if (fAccepted)
+        {
+            SyncWithWallets(tx, NULL, true);
+            RelayMessage(inv, tx);
+            mapAlreadyAskedFor.erase(inv);
+
+            // Orphans spending it go through the queue in turn
+            vector<uint256> vSpenders;
+            for (map<COutPoint, set<uint256> >::iterator mi = mapOrphanTransactionsByPrev.lower_bound(COutPoint(inv.hash, 0));
+                 mi != mapOrphanTransactionsByPrev.end() && (*mi).first.hash == inv.hash;
+                 ++mi)
+                vSpenders.insert(vSpenders.end(), (*mi).second.begin(), (*mi).second.end());
+            BOOST_FOREACH(const uint256& hashOrphan, vSpenders)
+            {
+                map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hashOrphan);
+                if (it == mapOrphanTransactions.end())
+                    continue;
+                // Kept as an orphan if the queue is full, to be
+                // retried once another parent is accepted
+                CTransaction txOrphan = (*it).second.tx;
+                CNode* pfromOrphan = (*it).second.pfrom;
+                if (QueueTxValidation(txOrphan, pfromOrphan))
+                    EraseOrphanTx(hashOrphan);
+            }
+        }
+        else if (fMissingInputs)
+        {
+            AddOrphanTx(tx, pfrom);
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_POOL_SIZE);
+            if (nEvicted > 0)
+                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+        }
+        if (tx.nDoS && pfrom)
+            pfrom->Misbehaving(tx.nDoS);
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs_txValidation);
+        setTxValidation.erase(inv.hash);
+        nTxValidationQueued--;
+        nTxValidationBytes -= job.nSize;
+        if (pfrom)
+        {
+            pair<unsigned int, unsigned int>& peer = mapTxValidationByPeer[pfrom];
+            peer.first--;
+            peer.second -= job.nSize;
+            if (peer.first == 0)
+                mapTxValidationByPeer.erase(pfrom);
+        }
+    }
+    if (pfrom)
+    {
+        LOCK(cs_vNodes);
+        pfrom->Release();
+    }
+}
+
+void static ThreadTxValidation2(void* parg)
+{
+    while (!fShutdown)
+    {
+        CTxValidationJob job;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_txValidation);
+            while (queueTxValidation.empty() && !fShutdown)
+                condTxValidation.timed_wait(lock, boost::posix_time::milliseconds(500));
+            if (fShutdown)
+                break;
+            job = queueTxValidation.front();
+            queueTxValidation.pop_front();
+        }
+        ProcessTxValidationJob(job);
+    }
+    ClearTxValidationQueue();
+}
+
+void ThreadTxValidation(void* parg)
+{
+    // Make this thread recognisable as a transaction validation thread
+    RenameThread("pxc-txval");
+
+    try
+    {
+        vnThreadsRunning[THREAD_TXVALIDATION]++;
+        ThreadTxValidation2(parg);
+        vnThreadsRunning[THREAD_TXVALIDATION]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_TXVALIDATION]--;
+        PrintException(&e, "ThreadTxValidation()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_TXVALIDATION]--;
+        PrintException(NULL, "ThreadTxValidation()");
+    }
+    printf("ThreadTxValidation exited\n");
+}
+
+
+
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Messages
@@ -2517,6 +3870,7 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
             }
         return txInMap ||
                mapOrphanTransactions.count(inv.hash) ||
+               IsTxQueued(inv.hash) ||
                txdb.ContainsTx(inv.hash);
         }
 
@@ -2529,6 +3883,31 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 }
 
 
+/* Sends a block from disk in answer to getdata */
+void static PushBlock(CNode* pfrom, const CInv& inv, CBlockIndex* pindex)
+{
+    CBlock block;
+    block.ReadFromDisk(pindex);
+    // Older blocks are unlikely to be in the peer's memory pool
+    if (inv.type == MSG_CMPCT_BLOCK && pindex->nHeight >= nBestHeight - HISTORICAL_BLOCK_DEPTH)
+        pfrom->PushMessage("cmpctblock", CCompactBlock(block));
+    else
+        pfrom->PushMessage("block", block);
+
+    // Trigger them to send a getblocks request for the next batch of inventory
+    if (inv.hash == pfrom->hashContinue)
+    {
+        // Bypass PushInventory, this must send even if redundant,
+        // and we want it right after the last block so they don't
+        // wait for other stuff first.
+        vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+        pfrom->PushMessage("inv", vInv);
+        pfrom->hashContinue = 0;
+    }
+}
+
+
 /* Relays an address to a limited number of nodes connected */
 void static RelayAddress(CAddress& addr, bool fReachable) {
 
@@ -2676,9 +4055,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return false;
         }
 
-        // Ask the first connected node for block updates
+        // Ask the first connected node for block updates;
+        // in headers-first mode SendMessages() takes care of this
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
+        if (!fHeadersFirst && !pfrom->fClient && !pfrom->fOneShot &&
             (pfrom->nVersion < NOBLKS_VERSION_START ||
              pfrom->nVersion >= NOBLKS_VERSION_END) &&
              (nAskedForBlocks < 1 || vNodes.size() <= 1))
@@ -2888,38 +4268,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebugNet || (vInv.size() == 1))
                 printf("received getdata for: %s\n", inv.ToString().c_str());
 
-            if (inv.type == MSG_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                // Send block from disk
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    // Historical blocks wait while relay uses up the upload rate limit
+                    if (nMaxUploadRate > 0 && (*mi).second->nHeight < nBestHeight - HISTORICAL_BLOCK_DEPTH &&
+                        (!pfrom->vDeferredGetData.empty() || !HasUploadHeadroom()))
                     {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
+                        // Beyond the limit the peer has to ask again
+                        if (pfrom->vDeferredGetData.size() < MAX_DEFERRED_GETDATA)
+                            pfrom->vDeferredGetData.push_back(inv);
                     }
+                    else
+                        PushBlock(pfrom, inv, (*mi).second);
                 }
             }
             else if (inv.IsKnownType())
             {
                 // Send stream from relay memory
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                }
+                CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                if (relayCache.Get(inv, ss))
+                    pfrom->PushMessage(inv.GetCommand(), ss);
             }
 
             // Track requests for our stuff
@@ -2998,81 +4369,55 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
-    else if (strCommand == "tx")
+    else if (strCommand == "headers")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
-        CTxDB txdb("r");
-        CTransaction tx;
-        vRecv >> tx;
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > 2000)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %d", vHeaders.size());
+        }
 
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
+        // Only take headers we asked for
+        if (pfrom != pnodeHeadersSync)
+            return true;
 
-        // Truncate a message to the actual transaction size
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-        unsigned int oldSize = vMsg.size();
-        if(nSize < oldSize) {
-            printf("truncating oversized transaction message %s (%u -> %u)\n",
-              tx.GetHash().ToString().c_str(), oldSize, nSize);
-            vMsg.resize(nSize);
+        bool fAccepted = true;
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+        {
+            if (!AcceptBlockHeader(header))
+            {
+                if (header.nDoS) pfrom->Misbehaving(header.nDoS);
+                fAccepted = false;
+                break;
+            }
         }
 
-        bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs))
+        printf("received %d headers from %s, best header height %d\n", vHeaders.size(),
+          pfrom->addrName.c_str(), pindexBestHeader ? pindexBestHeader->nHeight : nBestHeight);
+
+        // A full batch means there is more to come
+        if (fAccepted && vHeaders.size() == 2000)
+            PushGetHeaders(pfrom);
+        else
         {
-            SyncWithWallets(tx, NULL, true);
-            RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            pfrom->fHeadersSynced = true;
+            pnodeHeadersSync = NULL;
+        }
+    }
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (map<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
-                    CInv inv(MSG_TX, tx.GetHash());
-                    bool fMissingInputs2 = false;
 
-                    if (tx.AcceptToMemoryPool(txdb, true, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
-                        vWorkQueue.push_back(inv.hash);
-                        vEraseQueue.push_back(inv.hash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid orphan
-                        vEraseQueue.push_back(inv.hash);
-                        printf("   removed invalid orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                    }
-                }
-            }
+    else if (strCommand == "tx")
+    {
+        CTransaction tx;
+        vRecv >> tx;
 
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(vMsg);
+        CInv inv(MSG_TX, tx.GetHash());
+        pfrom->AddInventoryKnown(inv);
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+        // Validated by ThreadTxValidation, away from cs_main
+        QueueTxValidation(tx, pfrom);
     }
 
 
@@ -3086,10 +4431,192 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
+        MarkBlockReceived(inv.hash);
 
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
+        else if (block.nDoS && mapHeaderIndex.count(inv.hash))
+        {
+            // The header chain leads to an invalid block, start over
+            printf("block %s of the header chain is invalid, resetting headers-first sync\n", inv.hash.ToString().substr(0,20).c_str());
+            setFailedHeaders.insert(inv.hash);
+            ResetHeaderSync();
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                pnode->fHeadersSynced = false;
+        }
         if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+
+        // Release the header chain once all of it has been connected
+        if (pindexBestHeader && !pnodeHeadersSync && pindexBestHeader->bnChainWork <= bnBestChainWork)
+            ResetHeaderSync();
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        printf("received compact block %s\n", hash.ToString().substr(0,20).c_str());
+
+        CInv inv(MSG_BLOCK, hash);
+        pfrom->AddInventoryKnown(inv);
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapPartialBlocks.count(hash))
+            return true;
+
+        if (!CheckProofOfWork(cmpctblock.header.GetPoWHash(), cmpctblock.header.nBits))
+        {
+            pfrom->Misbehaving(50);
+            return error("message cmpctblock : proof-of-work verification failed");
+        }
+
+        // Only blocks extending a known chain are rebuilt, the rest comes in full
+        map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+        if (miPrev == mapBlockIndex.end())
+        {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+        CBlockIndex* pindexPrev = (*miPrev).second;
+
+        // The header has to carry the difficulty its parent demands, otherwise
+        // an easy target would get a cheap block rebuilt and relayed
+        if (cmpctblock.header.nBits != GetNextWorkRequired(pindexPrev, &cmpctblock.header))
+        {
+            pfrom->Misbehaving(100);
+            return error("message cmpctblock : incorrect proof of work");
+        }
+
+        // Stale forks are not worth a reconstruction
+        if (pindexPrev->nHeight + MAX_COMPACT_BLOCK_DEPTH < nBestHeight)
+        {
+            pfrom->Misbehaving(10);
+            return error("message cmpctblock : block %s forks off at height %d, best is %d",
+              hash.ToString().substr(0,20).c_str(), pindexPrev->nHeight, nBestHeight);
+        }
+
+        CBlock block;
+        vector<unsigned int> vMissing;
+        if (!cmpctblock.FillBlock(block, vMissing))
+        {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+
+        if (vMissing.empty())
+            ProcessCompactBlock(pfrom, block);
+        else
+        {
+            // Forget requests the peers never answered
+            int64 nNow = GetTime();
+            unsigned int nPeerPartial = 0;
+            for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
+            {
+                if (nNow - (*mi).second.nTime > BLOCK_DOWNLOAD_TIMEOUT)
+                    mapPartialBlocks.erase(mi++);
+                else
+                {
+                    if ((*mi).second.pfrom == pfrom)
+                        nPeerPartial++;
+                    mi++;
+                }
+            }
+
+            // Each pending block holds a full set of transactions, so their
+            // number is limited; past that the block is fetched in full
+            if (nPeerPartial >= MAX_PARTIAL_BLOCKS_PER_PEER || mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+            {
+                if (fDebugNet)
+                    printf("too many partial blocks pending, requesting %s in full\n", hash.ToString().substr(0,20).c_str());
+                RequestFullBlock(pfrom, hash);
+                return true;
+            }
+
+            CPartialBlock& partial = mapPartialBlocks[hash];
+            partial.pfrom = pfrom;
+            partial.nTime = nNow;
+            partial.block.vtx.swap(block.vtx);
+            partial.block.nVersion = block.nVersion;
+            partial.block.hashPrevBlock = block.hashPrevBlock;
+            partial.block.hashMerkleRoot = block.hashMerkleRoot;
+            partial.block.nTime = block.nTime;
+            partial.block.nBits = block.nBits;
+            partial.block.nNonce = block.nNonce;
+            partial.vMissing = vMissing;
+
+            CBlockTransactionsRequest req;
+            req.hashBlock = hash;
+            req.vIndexes = vMissing;
+            pfrom->PushMessage("getblocktxn", req);
+            if (fDebugNet)
+                printf("compact block %s misses %d of %d transactions\n", hash.ToString().substr(0,20).c_str(),
+                  vMissing.size(), partial.block.vtx.size());
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return true;
+
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("message getblocktxn : ReadFromDisk failed");
+
+        CBlockTransactions resp;
+        resp.hashBlock = req.hashBlock;
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn : index %u out of range", nIndex);
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.hashBlock);
+        if (mi == mapPartialBlocks.end() || (*mi).second.pfrom != pfrom)
+            return true;
+
+        CBlock block;
+        block.nVersion = (*mi).second.block.nVersion;
+        block.hashPrevBlock = (*mi).second.block.hashPrevBlock;
+        block.hashMerkleRoot = (*mi).second.block.hashMerkleRoot;
+        block.nTime = (*mi).second.block.nTime;
+        block.nBits = (*mi).second.block.nBits;
+        block.nNonce = (*mi).second.block.nNonce;
+        block.vtx.swap((*mi).second.block.vtx);
+        vector<unsigned int> vMissing;
+        vMissing.swap((*mi).second.vMissing);
+        mapPartialBlocks.erase(mi);
+
+        if (resp.vtx.size() != vMissing.size())
+        {
+            printf("blocktxn for %s has %d transactions, %d requested\n", resp.hashBlock.ToString().substr(0,20).c_str(),
+              resp.vtx.size(), vMissing.size());
+            RequestFullBlock(pfrom, resp.hashBlock);
+            return true;
+        }
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            block.vtx[vMissing[i]] = resp.vtx[i];
+
+        ProcessCompactBlock(pfrom, block);
     }
 
 
@@ -3259,6 +4786,10 @@ bool ProcessMessages(CNode* pfrom)
         if (pfrom->vSend.size() >= SendBufferSize())
             break;
 
+        // Leave the peer's messages unread while its transactions fill the validation queue
+        if (IsTxQueueFull(pfrom))
+            break;
+
         // Scan for message start
         CDataStream::iterator pstart;
         int nHeaderSize;
@@ -3338,6 +4869,7 @@ bool ProcessMessages(CNode* pfrom)
         // Copy message to its own buffer
         CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
         vRecv.ignore(nMessageSize);
+        pfrom->RecordMessageRecv(strCommand, nHeaderSize + nMessageSize);
 
         // Process message
         bool fRet = false;
@@ -3400,6 +4932,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("ping");
         }
 
+        // Serve a held back historical block once relay leaves upload headroom
+        if (!pto->vDeferredGetData.empty() && pto->vSend.empty() && HasUploadHeadroom())
+        {
+            CInv inv = pto->vDeferredGetData.front();
+            pto->vDeferredGetData.pop_front();
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+            if (mi != mapBlockIndex.end())
+                PushBlock(pto, inv, (*mi).second);
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         ResendWalletTransactions();
 
@@ -3489,7 +5031,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -3519,15 +5061,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // the filter was checked above, so this inventory is new to the peer
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -3549,7 +5089,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
-                vGetData.push_back(inv);
+                // Newly announced blocks are fetched in compact form where supported
+                if (inv.type == MSG_BLOCK && pto->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload())
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else
+                    vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -3562,6 +5106,31 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
+        //
+        // Message: getheaders, getdata (headers-first sync)
+        //
+        if (fHeadersFirst && !pto->fClient && !pto->fOneShot && !pto->fDisconnect)
+        {
+            // Start the header download or hand it over from an unresponsive peer
+            if (!pto->fHeadersSynced && pnodeHeadersSync != pto &&
+                pto->nStartingHeight > max(nBestHeight, pindexBestHeader ? pindexBestHeader->nHeight : 0))
+            {
+                if (pnodeHeadersSync && (pnodeHeadersSync->fDisconnect || GetTime() - nHeadersSyncTime > HEADERS_DOWNLOAD_TIMEOUT))
+                {
+                    printf("headers download from %s timed out\n", pnodeHeadersSync->addrName.c_str());
+                    pnodeHeadersSync->fHeadersSynced = true;
+                    pnodeHeadersSync = NULL;
+                }
+                if (!pnodeHeadersSync)
+                    PushGetHeaders(pto);
+            }
+
+            vector<CInv> vGetBlocks;
+            FindBlocksToDownload(pto, vGetBlocks);
+            if (!vGetBlocks.empty())
+                pto->PushMessage("getdata", vGetBlocks);
+        }
+
     }
     return true;
 }
@@ -3588,25 +5157,13 @@ static const unsigned int pSHA256InitState[8] =
 {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
 
 
-// Some explaining would be appreciated
-class COrphan
+/* Orders memory pool entries by fee per byte, highest first */
+class CompareTxMemPoolEntryPtrByFeeRateDesc
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = 0;
-    }
-
-    void print() const
+    bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const
     {
-        printf("COrphan(hash=%s, dPriority=%.1f)\n", ptx->GetHash().ToString().substr(0,10).c_str(), dPriority);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
+        return CompareTxMemPoolEntryByFeeRate()(*b, *a);
     }
 };
 
@@ -3640,90 +5197,56 @@ CBlock* CreateNewBlock(CReserveKey& reservekey) {
         pindexPrev = pindexBest;
         CTxDB txdb("r");
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        multimap<double, CTransaction*> mapPriority;
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if(!txPrev.ReadFromDisk(txdb, txin.prevout, txindex)) {
-
-                    /* A safety check as this should never happen */
-                    if(!mempool.mapTx.count(txin.prevout.hash)) {
-                        printf("ERROR: mempool transaction missing input\n");
-                        fMissingInputs = true;
-                        if(porphan) vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    continue;
-                }
-
-                int64 nValueIn = txPrev.vout[txin.prevout.n].nValue;
-
-                int nConf = 1;
-                CBlock block;
-                /* Read the block including transactions */
-                if(block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, true)) {
-                    int nHeight = block.GetBlockHeight();
-                    if(nHeight > 0)
-                      /* Precise calculation */
-                      nConf = pindexPrev->nHeight - nHeight;
-                    else
-                      /* Acceptable approximation */
-                      nConf = (pindexPrev->nTime - block.nTime) / nTargetSpacingZero;
-                }
-
-                dPriority += (double)nValueIn * nConf;
-
-            }
-            if(fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            dPriority /= ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-
-            if (porphan)
-                porphan->dPriority = dPriority;
-            else
-                mapPriority.insert(make_pair(-dPriority, &(*mi).second));
-
-        }
+        // Walk the pool from the highest fee rate down; a transaction spending
+        // another one still in the pool waits until its parent is in the block
+        typedef indexed_transaction_set::index<fee_rate>::type::reverse_iterator feeiter;
+        feeiter fi = mempool.mapTx.get<fee_rate>().rbegin();
+        feeiter fiEnd = mempool.mapTx.get<fee_rate>().rend();
+        set<const CTxMemPoolEntry*, CompareTxMemPoolEntryPtrByFeeRateDesc> setReady;
+        map<uint256, vector<const CTxMemPoolEntry*> > mapDependers;
+        map<const CTxMemPoolEntry*, int> mapWaiting;
+        set<uint256> setInBlock;
 
         // Collect transactions into block
         map<uint256, CTxIndex> mapTestPool;
         uint64 nBlockSize = 1000;
         uint64 nBlockTx = 0;
         int nBlockSigOps = 100;
-        while (!mapPriority.empty())
+        while (fi != fiEnd || !setReady.empty())
         {
-            // Take highest priority transaction off priority queue
-            double dPriority = -(*mapPriority.begin()).first;
-            CTransaction& tx = *(*mapPriority.begin()).second;
-            mapPriority.erase(mapPriority.begin());
+            // Take the better of the next entry and the best dependant released so far
+            const CTxMemPoolEntry* pentry;
+            if (!setReady.empty() && (fi == fiEnd || !CompareTxMemPoolEntryByFeeRate()(**setReady.begin(), *fi)))
+            {
+                pentry = *setReady.begin();
+                setReady.erase(setReady.begin());
+            }
+            else
+            {
+                pentry = &(*fi);
+                ++fi;
+                if (pentry->tx.IsCoinBase() || !pentry->tx.IsFinal())
+                    continue;
+
+                set<uint256> setParents;
+                BOOST_FOREACH(const CTxIn& txin, pentry->tx.vin)
+                {
+                    const uint256& hashParent = txin.prevout.hash;
+                    if (mempool.exists(hashParent) && !setInBlock.count(hashParent) && setParents.insert(hashParent).second)
+                        mapDependers[hashParent].push_back(pentry);
+                }
+                if (!setParents.empty())
+                {
+                    mapWaiting[pentry] = setParents.size();
+                    continue;
+                }
+            }
+
+            CTransaction tx = pentry->tx;
+            double dPriority = pentry->GetPriority(pindexPrev->nHeight);
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pentry->nTxSize;
             if (nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN)
                 continue;
 
@@ -3766,19 +5289,15 @@ CBlock* CreateNewBlock(CReserveKey& reservekey) {
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
 
-            // Add transactions that depend on this one to the priority queue
+            // Release transactions that have all their parents in the block now
             uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            setInBlock.insert(hash);
+            map<uint256, vector<const CTxMemPoolEntry*> >::iterator di = mapDependers.find(hash);
+            if (di != mapDependers.end())
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                            mapPriority.insert(make_pair(-porphan->dPriority, porphan->ptx));
-                    }
-                }
+                BOOST_FOREACH(const CTxMemPoolEntry* pdepender, (*di).second)
+                    if (--mapWaiting[pdepender] == 0)
+                        setReady.insert(pdepender);
             }
         }
 
@@ -3789,6 +5308,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey) {
     }
 
     pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+    pblock->vtx[0].UpdateHash();
 
     // Fill in header
     pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
@@ -3817,6 +5337,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     uint nHeight = pindexPrev->nHeight + 1;
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].UpdateHash();
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
@@ -17,6 +17,11 @@
 
 #include <list>
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/member.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -45,12 +50,52 @@ static const uint MAX_BLOCK_SIZE_GEN = (MAX_BLOCK_SIZE >> 1);
 static const uint MAX_BLOCK_SIGOPS = (MAX_BLOCK_SIZE >> 6);
 // The max. number of orphan transactions kept in memory
 static const uint MAX_ORPHAN_TRANSACTIONS = (MAX_BLOCK_SIZE >> 8);
+// The max. number of orphan transactions a single peer may have stored
+static const uint MAX_ORPHAN_TRANSACTIONS_PER_PEER = (MAX_ORPHAN_TRANSACTIONS >> 3);
+// The max. total size of orphan transactions kept in memory, in bytes
+static const uint MAX_ORPHAN_POOL_SIZE = (MAX_BLOCK_SIZE << 2);
+/* The max. number of transactions TrimToSize rates by package per eviction */
+static const unsigned int MAX_EVICTION_CANDIDATES = 100;
+/* The max. number of threads validating loose transactions */
+static const int MAX_TX_VALIDATION_THREADS = 4;
+/* The max. number of loose transactions waiting for validation */
+static const unsigned int MAX_TX_VALIDATION_QUEUE = (MAX_BLOCK_SIZE >> 8);
+/* The max. total size of loose transactions waiting for validation, in bytes */
+static const unsigned int MAX_TX_VALIDATION_QUEUE_SIZE = (MAX_BLOCK_SIZE << 2);
+/* A single peer stops being read while its transactions take this share (1/x) of the queue */
+static const unsigned int TX_VALIDATION_PEER_SHARE = 8;
+/* The max. number of wallet notifications waiting for ThreadWalletNotify before the producer waits too */
+static const unsigned int MAX_WALLET_QUEUE = 1000;
+/* Orphan transactions are dropped after this many seconds */
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/* Headers-first sync: how far ahead of the best block bodies may be requested */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/* Headers-first sync: the max. number of blocks requested from a single peer at once */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/* Headers-first sync: seconds to wait for a requested block before asking another peer */
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 60;
+/* Headers-first sync: seconds to wait for a headers reply before asking another peer */
+static const int64 HEADERS_DOWNLOAD_TIMEOUT = 120;
+/* Compact blocks forking off deeper than this below the best block are ignored */
+static const int MAX_COMPACT_BLOCK_DEPTH = 10;
+/* The max. number of compact blocks waiting for getblocktxn replies from a single peer */
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 2;
+/* The max. number of compact blocks waiting for getblocktxn replies in total */
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+/* Blocks deeper than this are served in full and give way to relay under -maxuploadrate */
+static const int HISTORICAL_BLOCK_DEPTH = 10;
+/* The max. number of historical block requests held back for a single peer */
+static const unsigned int MAX_DEFERRED_GETDATA = 500;
 /* The current time frame of block limiter */
 static const int64 BLOCK_LIMITER_TIME = 120;
 // The min. transaction fee (0.1 RODENT) if required
 static const int64 MIN_TX_FEE = 10000000;
 // Fees below this value (0.05 RODENT) are considered absent while relaying
 static const int64 MIN_RELAY_TX_FEE = 5000000;
+/* Default cap on the memory pool, in megabytes of transaction data */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/* Default time memory pool transactions are kept for, in hours */
+static const int DEFAULT_MEMPOOL_EXPIRY = 72;
 // The dust threshold (0.01 RODENT)
 static const int64 TX_DUST = 1000000;
 // The max. amount for a single transaction;
@@ -120,10 +165,13 @@ extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 extern std::map<uint256, CBlock*> mapOrphanBlocks;
 extern unsigned char pchMessageStart[4];
+extern bool fHeadersFirst;
 
 // Settings
 extern int64 nTransactionFee;
 extern int64 nMinimumInputValue;
+extern int64 nMaxMempoolSize;
+extern int64 nMempoolExpiry;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64 nMinDiskSpace = 52428800;
@@ -136,6 +184,9 @@ class CTxIndex;
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
+void SyncWithWalletQueue();
+void FlushWalletQueue();
+void ThreadWalletNotify(void* parg);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
@@ -144,7 +195,11 @@ bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+void FinalizeNode(CNode* pnode);
 bool LoadExternalBlockFile(FILE* fileIn);
+bool DumpMempool();
+void ThreadTxValidation(void* parg);
+bool LoadMempool();
 void GenerateCoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CReserveKey& reservekey);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
@@ -224,11 +279,11 @@ public:
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -449,6 +504,13 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // memory only, set on deserialization and by UpdateHash(); never
+    // written by GetHash(), so a shared transaction is only ever read
+    uint256 hashCached;
+    bool fHashCached;
+
+public:
     CTransaction()
     {
         SetNull();
@@ -461,6 +523,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            const_cast<CTransaction*>(this)->UpdateHash();
     )
 
     void SetNull()
@@ -470,6 +534,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -479,9 +544,19 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+    /** Must be called after changing a transaction once its hash has been
+     *  stored, i.e. after deserialization or an earlier UpdateHash() */
+    void UpdateHash()
+    {
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+    }
+
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
     {
         // Time based nLockTime implemented in 0.1.6
@@ -774,6 +849,7 @@ public:
 
 
     int SetMerkleBranch(const CBlock* pblock=NULL);
+    bool SetMerkleBranchFromBlock(const CBlock& block);
     int GetDepthInMainChain(CBlockIndex* &pindexRet) const;
     int GetDepthInMainChain() const { CBlockIndex *pindexRet; return GetDepthInMainChain(pindexRet); }
     bool IsInMainChain() const { return GetDepthInMainChain() > 0; }
@@ -985,12 +1061,15 @@ public:
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
+            // Sibling pairs are adjacent 64-byte blocks, so a whole level
+            // goes through the batched double SHA-256 in one call
+            int nPairs = nSize / 2;
+            vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+            if (nPairs > 0)
+                SHA256D64((unsigned char*)&vMerkleTree[j+nSize], (const unsigned char*)&vMerkleTree[j], nPairs);
+            if (nSize & 1)
+                vMerkleTree[j+nSize+nPairs] = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                                   BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
@@ -1115,6 +1194,73 @@ private:
 
 
 
+/** A block relayed as its header, the coinbase and short IDs of the other
+ * transactions (cmpctblock message). The receiver rebuilds the block from its
+ * memory pool and asks for whatever is missing with getblocktxn.
+ */
+class CCompactBlock
+{
+public:
+    // header only, vtx is empty
+    CBlock header;
+    uint64 nNonce;
+    // short IDs of vtx[1] onwards, in block order
+    std::vector<uint64> vShortTxIDs;
+    // the coinbase, which is never in a memory pool
+    std::vector<CTransaction> vPrefilledTxn;
+
+    CCompactBlock()
+    {
+        nNonce = 0;
+    }
+
+    CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortTxIDs);
+        READWRITE(vPrefilledTxn);
+    )
+
+    bool FillBlock(CBlock& block, std::vector<unsigned int>& vMissing) const;
+
+private:
+    void GetShortIDKeys(uint64& nKey0, uint64& nKey1) const;
+    static uint64 GetShortID(const uint256& hashTx, uint64 nKey0, uint64 nKey1);
+};
+
+/** Request for the transactions of a block at the given positions (getblocktxn message) */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** Reply to getblocktxn (blocktxn message) */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+
+
 
 
 
@@ -1301,6 +1447,49 @@ public:
 
 
 
+/** A block header received ahead of its body during headers-first sync.
+ * Headers are linked, difficulty, proof-of-work and checkpoint checked as
+ * they arrive; the remaining rules are enforced by AcceptBlock() once the
+ * body is fetched. pprev is NULL for a header whose parent is already in
+ * mapBlockIndex.
+ */
+class CHeaderIndex
+{
+public:
+    const uint256* phashBlock;
+    CHeaderIndex* pprev;
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    CBigNum bnChainWork;
+    // The header as a block index entry linked to its parent's, so that
+    // GetNextWorkRequired() can walk back across headers and blocks alike
+    CBlockIndex blockindex;
+
+    CHeaderIndex()
+    {
+        phashBlock = NULL;
+        pprev = NULL;
+        hashPrev = 0;
+        nHeight = 0;
+        nTime = 0;
+        bnChainWork = 0;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        return *phashBlock;
+    }
+
+    std::string ToString() const
+    {
+        return strprintf("CHeaderIndex(pprev=%08x, nHeight=%d, hashBlock=%s)",
+            pprev, nHeight, GetBlockHash().ToString().substr(0,20).c_str());
+    }
+};
+
+
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -1721,33 +1910,151 @@ public:
     static CAlert getAlertByHash(const uint256 &hash);
 };
 
+/** A memory pool transaction with the figures block assembly and
+ * eviction need, worked out once when it enters the pool */
+class CTxMemPoolEntry
+{
+public:
+    CTransaction tx;
+    int64 nFee;            // fee paid, 0 if the inputs were unavailable
+    unsigned int nTxSize;  // serialised size
+    int64 nTime;           // local time of entry
+    int nHeight;           // best chain height at entry
+    double dPriority;      // priority at nHeight
+    int64 nValueInChain;   // value of the inputs already in the chain
+
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction& txIn, int64 nFeeIn, int64 nTimeIn,
+                    int nHeightIn, double dPriorityIn, int64 nValueInChainIn);
+
+    /* Inputs in the chain age by one confirmation per block */
+    double GetPriority(int nCurrentHeight) const
+    {
+        return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+    }
+};
+
+/** Memory pool key extractor for the transaction hash */
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.tx.GetHash();
+    }
+};
+
+/** Orders memory pool entries by fee per byte, lowest first */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.nFee * b.nTxSize;
+        double f2 = (double)b.nFee * a.nTxSize;
+        if (f1 == f2)
+            return a.tx.GetHash() < b.tx.GetHash();
+        return f1 < f2;
+    }
+};
+
+/** What the half of CTxMemPool::accept that runs without cs_main found out
+ * about a transaction, for the half that inserts it */
+struct CTxMemPoolPrepared
+{
+    uint256 hashBestChain;  // chain tip the inputs were looked up against
+    bool fHaveInputs;
+    int64 nFees;
+    unsigned int nTxSize;
+    std::vector<uint256> vPoolParents;                    // inputs from the memory pool
+    std::vector<std::pair<uint256, int64> > vChainInputs; // block and value of inputs in the chain
+
+    CTxMemPoolPrepared() : fHaveInputs(false), nFees(0), nTxSize(0) { }
+};
+
+/* Index tags */
+struct fee_rate {};
+struct entry_time {};
+
+typedef boost::multi_index_container<
+    CTxMemPoolEntry,
+    boost::multi_index::indexed_by<
+        // by transaction hash
+        boost::multi_index::ordered_unique<mempoolentry_txid>,
+        // by fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<fee_rate>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByFeeRate
+        >,
+        // by entry time
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<entry_time>,
+            boost::multi_index::member<CTxMemPoolEntry, int64, &CTxMemPoolEntry::nTime>
+        >
+    >
+> indexed_transaction_set;
+
 class CTxMemPool
 {
 public:
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    uint64 nTotalTxSize;
+
+    CTxMemPool() : nTotalTxSize(0) { }
 
     bool accept(CTxDB& txdb, CTransaction &tx,
-                bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
-    bool remove(CTransaction &tx);
+                bool fCheckInputs, bool* pfMissingInputs, int64 nAcceptTime = 0);
+    /* The two halves of accept(): prepare() does the disk reads and signature
+     * checks and needs no lock held, commit() must be called with cs_main
+     * held and the chain tip still at prepared.hashBestChain */
+    bool prepare(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
+                 bool* pfMissingInputs, CTxMemPoolPrepared& prepared);
+    bool commit(CTransaction &tx, const CTxMemPoolPrepared& prepared,
+                bool* pfMissingInputs, int64 nAcceptTime = 0);
+    bool addUnchecked(const CTxMemPoolEntry& entry);
+    bool remove(const CTransaction &tx);
+    void removeRecursive(const CTransaction &tx, std::list<CTransaction>& removed);
+    /* The transaction and its in-pool descendants, breadth first */
+    void CalculateDescendants(const uint256& hash, std::vector<uint256>& vQueue);
+    /* Total fees and size of a transaction together with its in-pool descendants */
+    void GetDescendantPackage(const uint256& hash, int64& nFeesRet, uint64& nSizeRet);
     void queryHashes(std::vector<uint256>& vtxid);
 
+    /* Evicts the lowest fee rate transactions, along with whatever spends
+     * them, until the pool holds no more than nSizeLimit bytes */
+    void TrimToSize(uint64 nSizeLimit, std::list<CTransaction>* pvRemoved = NULL);
+    /* Drops transactions that entered the pool before nTime */
+    int Expire(int64 nTime);
+
     unsigned long size()
     {
         LOCK(cs);
         return mapTx.size();
     }
 
+    uint64 GetTotalTxSize()
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
     bool exists(uint256 hash)
     {
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    bool lookup(uint256 hash, CTransaction& result) const
     {
-        return mapTx[hash];
+        indexed_transaction_set::const_iterator it = mapTx.find(hash);
+        if (it == mapTx.end())
+            return false;
+        result = it->tx;
+        return true;
     }
 };
 
@@ -39,7 +39,7 @@ void ThreadOpenAddedConnections2(void* parg);
 void ThreadMapPort2(void* parg);
 #endif
 void ThreadDNSAddressSeed2(void* parg);
-bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false, bool fClaimSlot = false);
 
 
 struct LocalServiceInfo {
@@ -53,6 +53,7 @@ struct LocalServiceInfo {
 bool fClient = false;
 bool fDiscover = true;
 bool fUseUPnP = false;
+int64 nMaxUploadRate = 0;
 uint64 nLocalServices = (fClient ? 0 : NODE_NETWORK);
 static CCriticalSection cs_mapLocalHost;
 static map<CNetAddr, LocalServiceInfo> mapLocalHost;
@@ -70,9 +71,7 @@ CCriticalSection cs_vNodes;
 
 map<vector<uchar>, CAddress> mapAddresses;
 CCriticalSection cs_mapAddresses;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CRelayCache relayCache;
 map<CInv, int64> mapAlreadyAskedFor;
 
 static deque<string> vOneShots;
@@ -86,6 +85,38 @@ CCriticalSection cs_vAddedNodes;
 
 static CSemaphore *semOutbound = NULL;
 
+/** An outbound connection attempt, driven to completion by ThreadSocketHandler */
+class CPendingConnect
+{
+public:
+    CAddress addr;
+    std::string strDest;
+    SOCKET hSocket;
+    CSocksHandshake socks;
+    int nSocksWant;
+    bool fConnected;
+    int64 nDeadline;
+    bool fOneShot;
+    bool fClaimSlot;
+    CSemaphoreGrant grant;
+
+    CPendingConnect()
+    {
+        hSocket = INVALID_SOCKET;
+        nSocksWant = CSocksHandshake::SOCKS_WANT_WRITE;
+        fConnected = false;
+        nDeadline = 0;
+        fOneShot = false;
+        fClaimSlot = false;
+    }
+};
+
+static list<CPendingConnect*> lPendingConnects;
+static CCriticalSection cs_lPendingConnects;
+
+// milliseconds a proxy may take for the SOCKS handshake
+static const int SOCKS_HANDSHAKE_TIMEOUT = 20 * 1000;
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -97,6 +128,128 @@ unsigned short GetListenPort()
     return (unsigned short)(GetArg("-port", GetDefaultPort()));
 }
 
+CRelayCache::CRelayCache()
+{
+    nSalt = GetRandHash().Get64();
+    for (int i = 0; i < NUM_SHARDS; i++)
+    {
+        vShards[i].vSlots.resize(MIN_SLOTS);
+        vShards[i].nUsed = 0;
+    }
+}
+
+unsigned int CRelayCache::Slot(const CInv& inv) const
+{
+    // Inventory hashes are attacker-influenced, so mix in a per-process salt
+    // before choosing the home slot.
+    uint64 h = (inv.hash.Get64(0) ^ nSalt) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(h >> 32);
+}
+
+void CRelayCache::Rehash(CShard& shard, int64 nNow)
+{
+    // Drop expired entries and resize so the table is at most a quarter full
+    unsigned int nLive = 0;
+    BOOST_FOREACH(const CEntry& entry, shard.vSlots)
+        if (!entry.IsEmpty() && entry.nExpire >= nNow)
+            nLive++;
+    unsigned int nSlots = MIN_SLOTS;
+    while (nSlots < nLive * 4)
+        nSlots <<= 1;
+
+    std::vector<CEntry> vOld(nSlots);
+    vOld.swap(shard.vSlots);
+    shard.nUsed = 0;
+    unsigned int nMask = nSlots - 1;
+    BOOST_FOREACH(CEntry& entry, vOld)
+    {
+        if (entry.IsEmpty() || entry.nExpire < nNow)
+            continue;
+        unsigned int i = Slot(entry.inv) & nMask;
+        while (!shard.vSlots[i].IsEmpty())
+            i = (i + 1) & nMask;
+        CEntry& slot = shard.vSlots[i];
+        slot.inv = entry.inv;
+        slot.nExpire = entry.nExpire;
+        slot.vData.swap(entry.vData);
+        shard.nUsed++;
+    }
+}
+
+void CRelayCache::Insert(const CInv& inv, const CDataStream& ss, int64 nExpire)
+{
+    int64 nNow = GetTime();
+    unsigned int nHome = Slot(inv);
+    CShard& shard = Shard(inv);
+    LOCK(shard.cs);
+
+    // Keep at least half the slots empty so probe sequences stay short
+    if ((shard.nUsed + 1) * 2 > shard.vSlots.size())
+        Rehash(shard, nNow);
+
+    // Expired entries are not removed, so they double as tombstones: a probe
+    // only ends at a never-used slot, and the first expired slot passed on
+    // the way is reused once the key is known to be absent.
+    unsigned int nMask = shard.vSlots.size() - 1;
+    unsigned int i = nHome & nMask;
+    CEntry* pfree = NULL;
+    while (!shard.vSlots[i].IsEmpty())
+    {
+        CEntry& entry = shard.vSlots[i];
+        if (entry.nExpire < nNow)
+        {
+            if (pfree == NULL)
+                pfree = &entry;
+        }
+        else if (entry.inv.hash == inv.hash && entry.inv.type == inv.type)
+            return;
+        i = (i + 1) & nMask;
+    }
+    if (pfree == NULL)
+    {
+        pfree = &shard.vSlots[i];
+        shard.nUsed++;
+    }
+    pfree->inv = inv;
+    pfree->nExpire = nExpire;
+    pfree->vData.assign(ss.begin(), ss.end());
+}
+
+bool CRelayCache::Get(const CInv& inv, CDataStream& ssRet)
+{
+    int64 nNow = GetTime();
+    unsigned int nHome = Slot(inv);
+    CShard& shard = Shard(inv);
+    LOCK(shard.cs);
+
+    unsigned int nMask = shard.vSlots.size() - 1;
+    for (unsigned int i = nHome & nMask; !shard.vSlots[i].IsEmpty(); i = (i + 1) & nMask)
+    {
+        const CEntry& entry = shard.vSlots[i];
+        if (entry.inv.hash == inv.hash && entry.inv.type == inv.type && entry.nExpire >= nNow)
+        {
+            if (!entry.vData.empty())
+                ssRet.write(&entry.vData[0], entry.vData.size());
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned int CRelayCache::size()
+{
+    int64 nNow = GetTime();
+    unsigned int nSize = 0;
+    for (int i = 0; i < NUM_SHARDS; i++)
+    {
+        LOCK(vShards[i].cs);
+        BOOST_FOREACH(const CEntry& entry, vShards[i].vSlots)
+            if (!entry.IsEmpty() && entry.nExpire >= nNow)
+                nSize++;
+    }
+    return nSize;
+}
+
 void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
 {
     // Filter out duplicate requests
@@ -564,6 +717,41 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+/* Wraps a connected outbound socket into a new node */
+static CNode* AddOutboundNode(SOCKET hSocket, const CAddress& addrConnect, const char *pszDest, int64 nTimeout)
+{
+    if(!fBerkeleyAddrDB)
+      addrman.Attempt(addrConnect);
+
+    /// debug print
+    printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
+
+    // Set to nonblocking
+#ifdef WINDOWS
+    u_long nOne = 1;
+    if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
+        printf("ConnectSocket() : ioctlsocket nonblocking setting failed, error %d\n", WSAGetLastError());
+#else
+    if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+        printf("ConnectSocket() : fcntl nonblocking setting failed, error %d\n", errno);
+#endif
+
+    // Add node
+    CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+    if (nTimeout != 0)
+        pnode->AddRef(nTimeout);
+    else
+        pnode->AddRef();
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+
+    pnode->nTimeConnected = GetTime();
+    return pnode;
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
 {
     if (pszDest == NULL) {
@@ -596,42 +784,78 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
     // Connect
     SOCKET hSocket;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort()) : ConnectSocket(addrConnect, hSocket))
+        return AddOutboundNode(hSocket, addrConnect, pszDest, nTimeout);
+    else
+        return NULL;
+}
+
+bool static IsPendingConnect(const CService& addr, const char *pszDest)
+{
+    LOCK(cs_lPendingConnects);
+    BOOST_FOREACH(CPendingConnect* pconnect, lPendingConnects)
+        if (pszDest ? pconnect->strDest == pszDest : (CService)pconnect->addr == addr)
+            return true;
+    return false;
+}
+
+/* Advances a connection attempt on select() results: -1 failed, 0 in progress, 1 connected */
+int static ProgressPendingConnect(CPendingConnect* pconnect, bool fReadable, bool fWritable, bool fError)
+{
+    if (!pconnect->fConnected)
     {
-        if(!fBerkeleyAddrDB)
-          addrman.Attempt(addrConnect);
+        if (!fWritable && !fError)
+            return 0;
+        if (!FinishConnectSocket(pconnect->hSocket))
+            return -1;
+        pconnect->fConnected = true;
+        if (pconnect->socks.IsNull())
+            return 1;
+        pconnect->nDeadline = GetTimeMillis() + SOCKS_HANDSHAKE_TIMEOUT;
+    }
 
-        /// debug print
-        printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
+    if (!fError && !(pconnect->nSocksWant == CSocksHandshake::SOCKS_WANT_WRITE ? fWritable : fReadable))
+        return 0;
+    pconnect->nSocksWant = pconnect->socks.Step(pconnect->hSocket);
+    if (pconnect->nSocksWant == CSocksHandshake::SOCKS_DONE)
+        return 1;
+    if (pconnect->nSocksWant == CSocksHandshake::SOCKS_FAILED)
+        return -1;
+    return 0;
+}
 
-        // Set to nonblocking
-#ifdef WINDOWS
-        u_long nOne = 1;
-        if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
-            printf("ConnectSocket() : ioctlsocket nonblocking setting failed, error %d\n", WSAGetLastError());
-#else
-        if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
-            printf("ConnectSocket() : fcntl nonblocking setting failed, error %d\n", errno);
-#endif
+/* Turns a finished connection attempt into a node, or closes it */
+void static FinishPendingConnect(CPendingConnect* pconnect, bool fSuccess)
+{
+    const char *pszDest = pconnect->strDest.empty() ? NULL : pconnect->strDest.c_str();
 
-        // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
-        if (nTimeout != 0)
-            pnode->AddRef(nTimeout);
+    // The first attempt to connect takes the free slot, later ones are dropped
+    bool fSlot = true;
+    if (fSuccess && pconnect->fClaimSlot)
+    {
+        CSemaphoreGrant grant(*semOutbound, true);
+        if (grant)
+            grant.MoveTo(pconnect->grant);
         else
-            pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
+            fSlot = false;
+    }
 
-        pnode->nTimeConnected = GetTime();
-        return pnode;
+    if (fSuccess && fSlot && !fShutdown)
+    {
+        CNode* pnode = AddOutboundNode(pconnect->hSocket, pconnect->addr, pszDest, 0);
+        pconnect->grant.MoveTo(pnode->grantOutbound);
+        pnode->fNetworkNode = true;
+        if (pconnect->fOneShot)
+            pnode->fOneShot = true;
     }
     else
     {
-        return NULL;
+        if (fSuccess && !fSlot)
+            printf("connected %s, but no outbound slot is left\n", pszDest ? pszDest : pconnect->addr.ToString().c_str());
+        closesocket(pconnect->hSocket);
+        if (!fSuccess && pconnect->fOneShot)
+            AddOneShot(pconnect->strDest);
     }
+    delete pconnect;
 }
 
 void CNode::CloseSocketDisconnect()
@@ -691,6 +915,22 @@ void CNode::PushVersion() {
 
 std::map<CNetAddr, int64> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
+uint64 CNode::nTotalBytesSent = 0;
+uint64 CNode::nTotalBytesRecv = 0;
+MapMessageCounters CNode::mapTotalSendPerCommand;
+MapMessageCounters CNode::mapTotalRecvPerCommand;
+CCriticalSection CNode::cs_totals;
+
+// Received messages are counted by command for these only and as "*other*"
+// otherwise, so a peer can't grow the counter maps with made up commands
+static const char* ppszCountedCommands[] =
+{
+    "version", "verack", "addr", "getaddr", "inv", "getdata", "getblocks",
+    "getheaders", "headers", "tx", "block", "cmpctblock", "getblocktxn",
+    "blocktxn", "checkorder", "reply", "ping", "pong",
+    "alert", "checkpoint",
+};
+static const std::set<std::string> setCountedCommands(ppszCountedCommands, ppszCountedCommands + ARRAYLEN(ppszCountedCommands));
 
 void CNode::ClearBanned()
 {
@@ -754,9 +994,123 @@ void CNode::copyStats(CNodeStats &stats)
     X(nTxBytes);
     X(nRxBytes);
     X(nMisbehavior);
+    {
+        LOCK(cs_stats);
+        X(mapSendPerCommand);
+        X(mapRecvPerCommand);
+    }
 }
 #undef X
 
+void CNode::RecordMessageSent(const std::string& strCommand, unsigned int nSize)
+{
+    {
+        LOCK(cs_stats);
+        mapSendPerCommand[strCommand].Add(nSize);
+    }
+    {
+        LOCK(cs_totals);
+        mapTotalSendPerCommand[strCommand].Add(nSize);
+    }
+}
+
+void CNode::RecordMessageRecv(const std::string& strCommand, unsigned int nSize)
+{
+    const std::string strCounter = setCountedCommands.count(strCommand) ? strCommand : "*other*";
+    {
+        LOCK(cs_stats);
+        mapRecvPerCommand[strCounter].Add(nSize);
+    }
+    {
+        LOCK(cs_totals);
+        mapTotalRecvPerCommand[strCounter].Add(nSize);
+    }
+}
+
+void CNode::RecordBytesSent(unsigned int nBytes)
+{
+    LOCK(cs_totals);
+    nTotalBytesSent += nBytes;
+}
+
+void CNode::RecordBytesRecv(unsigned int nBytes)
+{
+    LOCK(cs_totals);
+    nTotalBytesRecv += nBytes;
+}
+
+uint64 CNode::GetTotalBytesSent()
+{
+    LOCK(cs_totals);
+    return nTotalBytesSent;
+}
+
+uint64 CNode::GetTotalBytesRecv()
+{
+    LOCK(cs_totals);
+    return nTotalBytesRecv;
+}
+
+void CNode::GetTotalMessageCounters(MapMessageCounters& mapSend, MapMessageCounters& mapRecv)
+{
+    LOCK(cs_totals);
+    mapSend = mapTotalSendPerCommand;
+    mapRecv = mapTotalRecvPerCommand;
+}
+
+
+
+//
+// Upload rate limit, a token bucket holding at most one second of traffic
+//
+static CCriticalSection cs_uploadTokens;
+static int64 nUploadTokens = 0;
+static int64 nUploadRefillTime = 0;
+
+void static RefillUploadTokens()
+{
+    int64 nNow = GetTimeMillis();
+    if (nUploadRefillTime == 0)
+    {
+        nUploadTokens = nMaxUploadRate;
+        nUploadRefillTime = nNow;
+        return;
+    }
+    int64 nRefill = (nNow - nUploadRefillTime) * nMaxUploadRate / 1000;
+    if (nRefill > 0)
+    {
+        nUploadTokens = min(nUploadTokens + nRefill, nMaxUploadRate);
+        nUploadRefillTime = nNow;
+    }
+}
+
+unsigned int GetUploadAllowance()
+{
+    if (nMaxUploadRate <= 0)
+        return std::numeric_limits<unsigned int>::max();
+    LOCK(cs_uploadTokens);
+    RefillUploadTokens();
+    return (unsigned int)max(nUploadTokens, (int64)0);
+}
+
+void ConsumeUploadAllowance(unsigned int nBytes)
+{
+    if (nMaxUploadRate <= 0)
+        return;
+    LOCK(cs_uploadTokens);
+    nUploadTokens -= nBytes;
+}
+
+/* Serving old blocks may only use what relay leaves over */
+bool HasUploadHeadroom()
+{
+    if (nMaxUploadRate <= 0)
+        return true;
+    LOCK(cs_uploadTokens);
+    RefillUploadTokens();
+    return nUploadTokens >= nMaxUploadRate / 2;
+}
+
 
 
 
@@ -847,7 +1201,15 @@ void ThreadSocketHandler2(void* parg)
                                 {
                                     TRY_LOCK(pnode->cs_inventory, lockInv);
                                     if (lockInv)
-                                        fDelete = true;
+                                    {
+                                        // drop block download state referring to this node
+                                        TRY_LOCK(cs_main, lockMain);
+                                        if (lockMain)
+                                        {
+                                            FinalizeNode(pnode);
+                                            fDelete = true;
+                                        }
+                                    }
                                 }
                             }
                         }
@@ -886,6 +1248,8 @@ void ThreadSocketHandler2(void* parg)
             FD_SET(hListenSocket, &fdsetRecv);
             hSocketMax = max(hSocketMax, hListenSocket);
         }
+        // Don't spin on writable sockets while the upload rate limit is exhausted
+        bool fCanSend = GetUploadAllowance() > 0;
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
@@ -897,11 +1261,23 @@ void ThreadSocketHandler2(void* parg)
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
+                    if (lockSend && fCanSend && !pnode->vSend.empty())
                         FD_SET(pnode->hSocket, &fdsetSend);
                 }
             }
         }
+        {
+            LOCK(cs_lPendingConnects);
+            BOOST_FOREACH(CPendingConnect* pconnect, lPendingConnects)
+            {
+                if (!pconnect->fConnected || pconnect->nSocksWant == CSocksHandshake::SOCKS_WANT_WRITE)
+                    FD_SET(pconnect->hSocket, &fdsetSend);
+                else
+                    FD_SET(pconnect->hSocket, &fdsetRecv);
+                FD_SET(pconnect->hSocket, &fdsetError);
+                hSocketMax = max(hSocketMax, pconnect->hSocket);
+            }
+        }
 
         vnThreadsRunning[THREAD_SOCKETHANDLER]--;
         int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
@@ -981,6 +1357,38 @@ void ThreadSocketHandler2(void* parg)
         }
 
 
+        //
+        // Outbound connection attempts
+        //
+        {
+            list<pair<CPendingConnect*, bool> > lFinished;
+            {
+                LOCK(cs_lPendingConnects);
+                int64 nNow = GetTimeMillis();
+                for (list<CPendingConnect*>::iterator it = lPendingConnects.begin(); it != lPendingConnects.end(); )
+                {
+                    CPendingConnect* pconnect = *it;
+                    int nResult = ProgressPendingConnect(pconnect, FD_ISSET(pconnect->hSocket, &fdsetRecv),
+                      FD_ISSET(pconnect->hSocket, &fdsetSend), FD_ISSET(pconnect->hSocket, &fdsetError));
+                    if (nResult == 0 && nNow > pconnect->nDeadline)
+                    {
+                        printf("connection timeout %s\n", pconnect->strDest.empty() ? pconnect->addr.ToString().c_str() : pconnect->strDest.c_str());
+                        nResult = -1;
+                    }
+                    if (nResult == 0)
+                    {
+                        it++;
+                        continue;
+                    }
+                    lFinished.push_back(make_pair(pconnect, nResult > 0));
+                    it = lPendingConnects.erase(it);
+                }
+            }
+            for (list<pair<CPendingConnect*, bool> >::iterator it = lFinished.begin(); it != lFinished.end(); it++)
+                FinishPendingConnect((*it).first, (*it).second);
+        }
+
+
         //
         // Service each socket
         //
@@ -1024,6 +1432,7 @@ void ThreadSocketHandler2(void* parg)
                             memcpy(&vRecv[nPos], pchBuf, nBytes);
                             pnode->nLastRecv = GetTime();
                             pnode->nRxBytes += nBytes;
+                            CNode::RecordBytesRecv(nBytes);
                         }
                         else if (nBytes == 0)
                         {
@@ -1058,14 +1467,17 @@ void ThreadSocketHandler2(void* parg)
                 if (lockSend)
                 {
                     CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    unsigned int nAllowance = GetUploadAllowance();
+                    if (!vSend.empty() && nAllowance > 0)
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                        int nBytes = send(pnode->hSocket, &vSend[0], min((unsigned int)vSend.size(), nAllowance), MSG_NOSIGNAL | MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
                             vSend.erase(vSend.begin(), vSend.begin() + nBytes);
                             pnode->nLastSend = GetTime();
                             pnode->nTxBytes += nBytes;
+                            CNode::RecordBytesSent(nBytes);
+                            ConsumeUploadAllowance(nBytes);
                         }
                         else if (nBytes < 0)
                         {
@@ -1460,16 +1872,25 @@ void ThreadOpenConnections2(void* parg)
         ProcessOneShot();
 
         vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
-        Sleep(500);
+        Sleep(100);
         vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
         if (fShutdown)
             return;
 
-        vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
-        CSemaphoreGrant grant(*semOutbound);
-        vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
+        // Wait for a free outbound slot, but don't hold it: several attempts
+        // run in parallel and whichever connects first takes the slot
+        {
+            vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
+            CSemaphoreGrant grant(*semOutbound);
+            vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
+        }
         if (fShutdown)
             return;
+        {
+            LOCK(cs_lPendingConnects);
+            if (lPendingConnects.size() >= MAX_PENDING_CONNECTS)
+                continue;
+        }
 
         //
         // Choose an address to connect to based on most recently seen
@@ -1489,6 +1910,11 @@ void ThreadOpenConnections2(void* parg)
                 }
             }
         }
+        {
+            LOCK(cs_lPendingConnects);
+            BOOST_FOREACH(CPendingConnect* pconnect, lPendingConnects)
+                setConnected.insert(pconnect->addr.GetGroup());
+        }
 
         int64 nANow = GetAdjustedTime();
 
@@ -1590,7 +2016,7 @@ void ThreadOpenConnections2(void* parg)
         }
 
         if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+            OpenNetworkConnection(addrConnect, NULL, NULL, false, true);
     }
 }
 
@@ -1705,8 +2131,9 @@ void ThreadOpenAddedConnections2(void* parg)
     }
 }
 
-// if succesful, this moves the passed grant to the constructed node
-bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, const char *strDest, bool fOneShot)
+// if succesful, this moves the passed grant to the connection attempt and then to the
+// constructed node; with fClaimSlot the attempt takes a free outbound slot once connected
+bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, const char *strDest, bool fOneShot, bool fClaimSlot)
 {
     //
     // Initiate outbound network connection
@@ -1720,19 +2147,46 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
             return false;
     if (strDest && FindNode(strDest))
         return false;
+    if (IsPendingConnect(addrConnect, strDest))
+        return false;
+
+    if(fBerkeleyAddrDB) {
+        LOCK(cs_mapAddresses);
+        mapAddresses[addrConnect.GetKey()].nLastTry = GetAdjustedTime();
+    }
 
+    /// debug print
+    printf("trying connection %s  last seen=%.1fhrs  last try=%.1fhrs\n",
+      strDest ? strDest : addrConnect.ToString().c_str(),
+      strDest ? 0 : (double)(addrConnect.nTime - GetAdjustedTime())/3600.0,
+      strDest ? 0 : (double)(addrConnect.nLastTry - GetAdjustedTime())/3600.0);
+
+    // The socket handler thread completes the connect and any proxy handshake
+    CPendingConnect* pconnect = new CPendingConnect();
+    pconnect->addr = addrConnect;
     vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
-    CNode* pnode = ConnectNode(addrConnect, strDest);
+    bool fStarted = strDest ? StartConnectSocketByName(pconnect->addr, pconnect->hSocket, pconnect->socks, strDest, GetDefaultPort()) :
+                              StartConnectSocket(addrConnect, pconnect->hSocket, pconnect->socks);
     vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
-    if (fShutdown)
-        return false;
-    if (!pnode)
+    if (!fStarted || fShutdown)
+    {
+        if (pconnect->hSocket != INVALID_SOCKET)
+            closesocket(pconnect->hSocket);
+        delete pconnect;
         return false;
+    }
+
+    if (strDest)
+        pconnect->strDest = strDest;
+    pconnect->nDeadline = GetTimeMillis() + nConnectTimeout;
+    pconnect->fOneShot = fOneShot;
+    pconnect->fClaimSlot = fClaimSlot;
     if (grantOutbound)
-        grantOutbound->MoveTo(pnode->grantOutbound);
-    pnode->fNetworkNode = true;
-    if (fOneShot)
-        pnode->fOneShot = true;
+        grantOutbound->MoveTo(pconnect->grant);
+    {
+        LOCK(cs_lPendingConnects);
+        lPendingConnects.push_back(pconnect);
+    }
 
     return true;
 }
@@ -2041,6 +2495,16 @@ void StartNode(void* parg)
     if (!CreateThread(ThreadMessageHandler, NULL))
         printf("Error: CreateThread(ThreadMessageHandler) failed\n");
 
+    // Validate loose transactions
+    int nTxThreads = max(1, min(MAX_TX_VALIDATION_THREADS, (int)boost::thread::hardware_concurrency()));
+    for (int i = 0; i < nTxThreads; i++)
+        if (!CreateThread(ThreadTxValidation, NULL))
+            printf("Error: CreateThread(ThreadTxValidation) failed\n");
+
+    // Apply wallet notifications off the block connection path
+    if (!CreateThread(ThreadWalletNotify, NULL))
+        printf("Error: CreateThread(ThreadWalletNotify) failed\n");
+
     // Dump network addresses
     if(!fBerkeleyAddrDB)
       if(!CreateThread(ThreadDumpAddress, NULL))
@@ -2082,7 +2546,10 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    if (vnThreadsRunning[THREAD_TXVALIDATION] > 0) printf("ThreadTxValidation still running\n");
+    if (vnThreadsRunning[THREAD_WALLETNOTIFY] > 0) printf("ThreadWalletNotify still running\n");
+    if (vnThreadsRunning[THREAD_TOPUPKEYPOOL] > 0) printf("ThreadTopUpKeyPool still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_TOPUPKEYPOOL] > 0)
         Sleep(20);
     Sleep(50);
     if(!fBerkeleyAddrDB) DumpAddresses();
@@ -2101,6 +2568,8 @@ public:
         BOOST_FOREACH(CNode* pnode, vNodes)
             if (pnode->hSocket != INVALID_SOCKET)
                 closesocket(pnode->hSocket);
+        BOOST_FOREACH(CPendingConnect* pconnect, lPendingConnects)
+            closesocket(pconnect->hSocket);
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
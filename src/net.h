@@ -17,7 +17,7 @@
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
@@ -30,10 +30,16 @@ extern int nBestHeight;
 
 static const uint MAX_CONNECTIONS  = 150;
 static const uint MAX_OUTBOUND_CONNECTIONS = 16;
+/* The max. number of outbound connection attempts in progress at once */
+static const uint MAX_PENDING_CONNECTS = 8;
 
 inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+unsigned int GetUploadAllowance();
+void ConsumeUploadAllowance(unsigned int nBytes);
+bool HasUploadHeadroom();
+
 void AddOneShot(std::string strDest);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
@@ -78,6 +84,52 @@ enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    MSG_CMPCT_BLOCK,
+};
+
+/** Serialized copies of recently relayed messages, kept for 15 minutes so that
+ *  getdata requests can be answered after the item has left the memory pool.
+ *  Entries are spread over independently locked shards, each an open-addressing
+ *  table with linear probing, so peers fetching different items rarely contend
+ *  and no per-entry tree node or stream object has to be allocated.
+ */
+class CRelayCache
+{
+public:
+    CRelayCache();
+
+    // Store a serialized message; an unexpired entry for the same inventory is kept as is
+    void Insert(const CInv& inv, const CDataStream& ss, int64 nExpire);
+    // Append the stored message to ssRet; returns false if unknown or expired
+    bool Get(const CInv& inv, CDataStream& ssRet);
+    unsigned int size();
+
+private:
+    enum { NUM_SHARDS = 16, MIN_SLOTS = 64 };
+
+    struct CEntry
+    {
+        CInv inv;
+        int64 nExpire;
+        std::vector<char, zero_after_free_allocator<char> > vData;
+
+        CEntry() : nExpire(0) { }
+        bool IsEmpty() const { return inv.type == 0; }
+    };
+
+    struct CShard
+    {
+        CCriticalSection cs;
+        std::vector<CEntry> vSlots;
+        unsigned int nUsed;
+    };
+
+    CShard vShards[NUM_SHARDS];
+    uint64 nSalt;
+
+    unsigned int Slot(const CInv& inv) const;
+    CShard& Shard(const CInv& inv) { return vShards[inv.hash.Get64(1) % NUM_SHARDS]; }
+    void Rehash(CShard& shard, int64 nNow);
 };
 
 class CRequestTracker
@@ -112,6 +164,9 @@ enum threadId
     THREAD_ADDEDCONNECTIONS,
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
+    THREAD_TXVALIDATION,
+    THREAD_WALLETNOTIFY,
+    THREAD_TOPUPKEYPOOL,
 
     THREAD_MAX
 };
@@ -119,6 +174,7 @@ enum threadId
 extern bool fClient;
 extern bool fDiscover;
 extern bool fUseUPnP;
+extern int64 nMaxUploadRate;
 extern uint64 nLocalServices;
 extern uint64 nLocalHostNonce;
 extern CAddress addrExternal;
@@ -130,15 +186,36 @@ extern CCriticalSection cs_vNodes;
 
 extern std::map<std::vector<uchar>, CAddress> mapAddresses;
 extern CCriticalSection cs_mapAddresses;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
+extern CRelayCache relayCache;
 extern std::map<CInv, int64> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
 
 
+/** Message and byte counts of a single message command */
+class CMessageCounter
+{
+public:
+    uint64 nMessages;
+    uint64 nBytes;
+
+    CMessageCounter()
+    {
+        nMessages = 0;
+        nBytes = 0;
+    }
+
+    void Add(uint64 nSize)
+    {
+        nMessages++;
+        nBytes += nSize;
+    }
+};
+
+typedef std::map<std::string, CMessageCounter> MapMessageCounters;
+
+
 class CNodeStats
 {
 public:
@@ -155,6 +232,8 @@ public:
     uint64 nTxBytes;
     uint64 nRxBytes;
     int nMisbehavior;
+    MapMessageCounters mapSendPerCommand;
+    MapMessageCounters mapRecvPerCommand;
 };
 
 
@@ -201,6 +280,19 @@ protected:
     static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
+    // Traffic accounting, whole messages including the header
+    std::string strSendCommand;
+    MapMessageCounters mapSendPerCommand;
+    MapMessageCounters mapRecvPerCommand;
+    CCriticalSection cs_stats;
+
+    // Totals over all peers ever connected
+    static uint64 nTotalBytesSent;
+    static uint64 nTotalBytesRecv;
+    static MapMessageCounters mapTotalSendPerCommand;
+    static MapMessageCounters mapTotalRecvPerCommand;
+    static CCriticalSection cs_totals;
+
 public:
     int64 nReleaseTime;
     std::map<uint256, CRequestTracker> mapRequests;
@@ -210,6 +302,10 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
 
+    // headers-first synchronization
+    int nBlocksInFlight;
+    bool fHeadersSynced;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
@@ -218,12 +314,15 @@ public:
     uint256 hashCheckpointKnown; // known sent advanced checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    // historical blocks held back while the upload rate limit is reached
+    std::deque<CInv> vDeferredGetData;
+
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION), filterInventoryKnown(SendBufferSize() / 1000, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -251,10 +350,11 @@ public:
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        nBlocksInFlight = 0;
+        fHeadersSynced = false;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
 
         // Be shy and don't send version until we hear
         if (!fInbound)
@@ -316,7 +416,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -324,7 +424,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -365,6 +465,7 @@ public:
         if (nHeaderStart != -1)
             AbortMessage();
         nHeaderStart = vSend.size();
+        strSendCommand = pszCommand;
         vSend << CMessageHeader(pszCommand, 0, fMagic);
         nMessageStart = vSend.size();
         if(fDebug)
@@ -376,6 +477,7 @@ public:
         if (nHeaderStart != -1)
             AbortMessage();
         nHeaderStart = vSend.size();
+        strSendCommand = "version";
         vSend << CMessageHeader("version", 0, fMagic);
         nMessageStart = vSend.size();
         if(fDebug)
@@ -422,6 +524,8 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
+        RecordMessageSent(strSendCommand, vSend.size() - nHeaderStart);
+
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -689,6 +793,14 @@ public:
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
     void copyStats(CNodeStats &stats);
+
+    void RecordMessageSent(const std::string& strCommand, unsigned int nSize);
+    void RecordMessageRecv(const std::string& strCommand, unsigned int nSize);
+    static void RecordBytesSent(unsigned int nBytes);
+    static void RecordBytesRecv(unsigned int nBytes);
+    static uint64 GetTotalBytesSent();
+    static uint64 GetTotalBytesRecv();
+    static void GetTotalMessageCounters(MapMessageCounters& mapSend, MapMessageCounters& mapRecv);
 };
 
 
@@ -722,19 +834,8 @@ void RelayMessage(const CInv& inv, const T& a)
 template<>
 inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
 {
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
+    // Save original serialized message so newer versions are preserved
+    relayCache.Insert(inv, ss, GetTime() + 15 * 60);
 
     RelayInventory(inv);
 }
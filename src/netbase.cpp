@@ -172,107 +172,137 @@ bool LookupNumeric(const char *pszName, CService& addr, int portDefault)
     return Lookup(pszName, addr, portDefault, false);
 }
 
-bool static Socks4(const CService &addrDest, SOCKET& hSocket)
+CSocksHandshake::CSocksHandshake()
+{
+    nState = STATE_NONE;
+    nPort = 0;
+    nSendPos = 0;
+    nRecvWant = 0;
+}
+
+bool CSocksHandshake::Init4(const CService &addrDest)
 {
     printf("SOCKS4 connecting %s\n", addrDest.ToString().c_str());
     if (!addrDest.IsIPv4())
-    {
-        closesocket(hSocket);
         return error("Proxy destination is not IPv4");
-    }
     char pszSocks4IP[] = "\4\1\0\0\0\0\0\0user";
     struct sockaddr_in addr;
     socklen_t len = sizeof(addr);
     if (!addrDest.GetSockAddr((struct sockaddr*)&addr, &len) || addr.sin_family != AF_INET)
-    {
-        closesocket(hSocket);
         return error("Cannot get proxy destination address");
-    }
     memcpy(pszSocks4IP + 2, &addr.sin_port, 2);
     memcpy(pszSocks4IP + 4, &addr.sin_addr, 4);
-    char* pszSocks4 = pszSocks4IP;
-    int nSize = sizeof(pszSocks4IP);
 
-    int ret = send(hSocket, pszSocks4, nSize, MSG_NOSIGNAL);
-    if (ret != nSize)
-    {
-        closesocket(hSocket);
-        return error("Error sending to proxy");
-    }
-    char pchRet[8];
-    if (recv(hSocket, pchRet, 8, 0) != 8)
-    {
-        closesocket(hSocket);
-        return error("Error reading proxy response");
-    }
-    if (pchRet[1] != 0x5a)
-    {
-        closesocket(hSocket);
-        if (pchRet[1] != 0x5b)
-            printf("ERROR: Proxy returned error %d\n", pchRet[1]);
-        return false;
-    }
-    printf("SOCKS4 connected %s\n", addrDest.ToString().c_str());
+    strDest = addrDest.ToString();
+    strSend.assign(pszSocks4IP, sizeof(pszSocks4IP));
+    nSendPos = 0;
+    Expect(STATE_SOCKS4_REPLY, 8);
     return true;
 }
 
-bool static Socks5(string strDest, int port, SOCKET& hSocket)
+bool CSocksHandshake::Init5(const std::string &strDestIn, int port)
 {
-    printf("SOCKS5 connecting %s\n", strDest.c_str());
-    if (strDest.size() > 255)
-    {
-        closesocket(hSocket);
+    printf("SOCKS5 connecting %s\n", strDestIn.c_str());
+    if (strDestIn.size() > 255)
         return error("Hostname too long");
-    }
-    char pszSocks5Init[] = "\5\1\0";
-    char *pszSocks5 = pszSocks5Init;
-    ssize_t nSize = sizeof(pszSocks5Init) - 1;
 
-    ssize_t ret = send(hSocket, pszSocks5, nSize, MSG_NOSIGNAL);
-    if (ret != nSize)
-    {
-        closesocket(hSocket);
-        return error("Error sending to proxy");
-    }
-    char pchRet1[2];
-    if (recv(hSocket, pchRet1, 2, 0) != 2)
-    {
-        closesocket(hSocket);
-        return error("Error reading proxy response");
-    }
-    if (pchRet1[0] != 0x05 || pchRet1[1] != 0x00)
-    {
-        closesocket(hSocket);
-        return error("Proxy failed to initialize");
-    }
-    string strSocks5("\5\1");
-    strSocks5 += '\000'; strSocks5 += '\003';
-    strSocks5 += static_cast<char>(std::min((int)strDest.size(), 255));
-    strSocks5 += strDest; 
-    strSocks5 += static_cast<char>((port >> 8) & 0xFF);
-    strSocks5 += static_cast<char>((port >> 0) & 0xFF);
-    ret = send(hSocket, strSocks5.c_str(), strSocks5.size(), MSG_NOSIGNAL);
-    if (ret != (ssize_t)strSocks5.size())
-    {
-        closesocket(hSocket);
-        return error("Error sending to proxy");
-    }
-    char pchRet2[4];
-    if (recv(hSocket, pchRet2, 4, 0) != 4)
-    {
-        closesocket(hSocket);
-        return error("Error reading proxy response");
-    }
-    if (pchRet2[0] != 0x05)
+    strDest = strDestIn;
+    nPort = port;
+    strSend.assign("\5\1\0", 3);
+    nSendPos = 0;
+    Expect(STATE_SOCKS5_METHOD, 2);
+    return true;
+}
+
+void CSocksHandshake::Expect(int nStateIn, unsigned int nBytes)
+{
+    nState = nStateIn;
+    strRecv.clear();
+    nRecvWant = nBytes;
+}
+
+int CSocksHandshake::Step(SOCKET hSocket)
+{
+    while (nState != STATE_DONE)
     {
-        closesocket(hSocket);
-        return error("Proxy failed to accept request");
+        if (nState == STATE_NONE)
+            return SOCKS_FAILED;
+
+        if (nSendPos < strSend.size())
+        {
+            int nBytes = send(hSocket, strSend.data() + nSendPos, strSend.size() - nSendPos, MSG_NOSIGNAL);
+            if (nBytes <= 0)
+            {
+                int nErr = WSAGetLastError();
+                if (nBytes < 0 && (nErr == WSAEWOULDBLOCK || nErr == WSAEINTR || nErr == WSAEINPROGRESS))
+                    return SOCKS_WANT_WRITE;
+                error("Error sending to proxy");
+                return SOCKS_FAILED;
+            }
+            nSendPos += nBytes;
+            continue;
+        }
+
+        if (strRecv.size() < nRecvWant)
+        {
+            char pchBuf[256];
+            int nBytes = recv(hSocket, pchBuf, min((unsigned int)sizeof(pchBuf), (unsigned int)(nRecvWant - strRecv.size())), 0);
+            if (nBytes <= 0)
+            {
+                int nErr = WSAGetLastError();
+                if (nBytes < 0 && (nErr == WSAEWOULDBLOCK || nErr == WSAEINTR || nErr == WSAEINPROGRESS))
+                    return SOCKS_WANT_READ;
+                error("Error reading proxy response");
+                return SOCKS_FAILED;
+            }
+            strRecv.append(pchBuf, nBytes);
+            continue;
+        }
+
+        if (!Advance())
+        {
+            nState = STATE_NONE;
+            return SOCKS_FAILED;
+        }
     }
-    if (pchRet2[1] != 0x00)
+    return SOCKS_DONE;
+}
+
+/* Acts on a complete reply and moves on to the next one */
+bool CSocksHandshake::Advance()
+{
+    switch (nState)
     {
-        closesocket(hSocket);
-        switch (pchRet2[1])
+    case STATE_SOCKS4_REPLY:
+        if (strRecv[1] != 0x5a)
         {
+            if (strRecv[1] != 0x5b)
+                printf("ERROR: Proxy returned error %d\n", strRecv[1]);
+            return false;
+        }
+        printf("SOCKS4 connected %s\n", strDest.c_str());
+        nState = STATE_DONE;
+        return true;
+
+    case STATE_SOCKS5_METHOD:
+        if (strRecv[0] != 0x05 || strRecv[1] != 0x00)
+            return error("Proxy failed to initialize");
+        strSend = "\5\1";
+        strSend += '\000'; strSend += '\003';
+        strSend += static_cast<char>(std::min((int)strDest.size(), 255));
+        strSend += strDest;
+        strSend += static_cast<char>((nPort >> 8) & 0xFF);
+        strSend += static_cast<char>((nPort >> 0) & 0xFF);
+        nSendPos = 0;
+        Expect(STATE_SOCKS5_REPLY, 4);
+        return true;
+
+    case STATE_SOCKS5_REPLY:
+        if (strRecv[0] != 0x05)
+            return error("Proxy failed to accept request");
+        switch (strRecv[1])
+        {
+            case 0x00: break;
             case 0x01: return error("Proxy error: general failure");
             case 0x02: return error("Proxy error: connection not allowed");
             case 0x03: return error("Proxy error: network unreachable");
@@ -283,43 +313,48 @@ bool static Socks5(string strDest, int port, SOCKET& hSocket)
             case 0x08: return error("Proxy error: address type not supported");
             default:   return error("Proxy error: unknown");
         }
-    }
-    if (pchRet2[2] != 0x00)
-    {
-        closesocket(hSocket);
-        return error("Error: malformed proxy response");
-    }
-    char pchRet3[256];
-    switch (pchRet2[3])
-    {
-        case 0x01: ret = recv(hSocket, pchRet3, 4, 0) != 4; break;
-        case 0x04: ret = recv(hSocket, pchRet3, 16, 0) != 16; break;
-        case 0x03:
+        if (strRecv[2] != 0x00)
+            return error("Error: malformed proxy response");
+        // The bound address and port follow
+        switch (strRecv[3])
         {
-            ret = recv(hSocket, pchRet3, 1, 0) != 1;
-            if (ret)
-                return error("Error reading from proxy");
-            int nRecv = pchRet3[0];
-            ret = recv(hSocket, pchRet3, nRecv, 0) != nRecv;
-            break;
+            case 0x01: Expect(STATE_SOCKS5_BOUNDADDR, 4 + 2); break;
+            case 0x04: Expect(STATE_SOCKS5_BOUNDADDR, 16 + 2); break;
+            case 0x03: Expect(STATE_SOCKS5_NAMELEN, 1); break;
+            default:   return error("Error: malformed proxy response");
         }
-        default: closesocket(hSocket); return error("Error: malformed proxy response");
-    }
-    if (ret)
-    {
-        closesocket(hSocket);
-        return error("Error reading from proxy");
+        return true;
+
+    case STATE_SOCKS5_NAMELEN:
+        Expect(STATE_SOCKS5_BOUNDADDR, (unsigned char)strRecv[0] + 2);
+        return true;
+
+    case STATE_SOCKS5_BOUNDADDR:
+        printf("SOCKS5 connected %s\n", strDest.c_str());
+        nState = STATE_DONE;
+        return true;
     }
-    if (recv(hSocket, pchRet3, 2, 0) != 2)
+    return false;
+}
+
+/* Runs a handshake on a blocking socket, closes the socket on failure */
+bool static SocksHandshake(CSocksHandshake& socks, SOCKET& hSocket)
+{
+    int nRet;
+    do
+        nRet = socks.Step(hSocket);
+    while (nRet == CSocksHandshake::SOCKS_WANT_READ || nRet == CSocksHandshake::SOCKS_WANT_WRITE);
+
+    if (nRet != CSocksHandshake::SOCKS_DONE)
     {
         closesocket(hSocket);
-        return error("Error reading from proxy");
+        return false;
     }
-    printf("SOCKS5 connected %s\n", strDest.c_str());
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+/* Starts a non-blocking connect, the socket becomes writable once it completed */
+bool static StartConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet)
 {
     hSocketRet = INVALID_SOCKET;
 
@@ -359,43 +394,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
         {
-            struct timeval timeout;
-            timeout.tv_sec  = nTimeout / 1000;
-            timeout.tv_usec = (nTimeout % 1000) * 1000;
-
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0)
-            {
-                printf("connection timeout\n");
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR)
-            {
-                printf("select() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
-#ifdef WINDOWS
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
-#else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
-#endif
-            {
-                printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet != 0)
-            {
-                printf("connect() failed after select(): %s\n",strerror(nRet));
-                closesocket(hSocket);
-                return false;
-            }
+            // completes in the background
         }
 #ifdef WINDOWS
         else if (WSAGetLastError() != WSAEISCONN)
@@ -409,22 +408,74 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         }
     }
 
+    hSocketRet = hSocket;
+    return true;
+}
+
+bool FinishConnectSocket(SOCKET hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
+#ifdef WINDOWS
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+#else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+#endif
+    {
+        printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
+        return false;
+    }
+    if (nRet != 0)
+    {
+        printf("connect() failed after select(): %s\n",strerror(nRet));
+        return false;
+    }
+    return true;
+}
+
+/* Waits for a started connect and switches the socket to blocking, closes it on failure */
+bool static WaitConnectSocket(SOCKET hSocket, int nTimeout)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+    if (nRet == 0)
+    {
+        printf("connection timeout\n");
+        closesocket(hSocket);
+        return false;
+    }
+    if (nRet == SOCKET_ERROR)
+    {
+        printf("select() for connection failed: %i\n",WSAGetLastError());
+        closesocket(hSocket);
+        return false;
+    }
+    if (!FinishConnectSocket(hSocket))
+    {
+        closesocket(hSocket);
+        return false;
+    }
+
     // this isn't even strictly necessary
     // CNode::ConnectNode immediately turns the socket back to non-blocking
     // but we'll turn it back to blocking just in case
 #ifdef WINDOWS
-    fNonblock = 0;
+    u_long fNonblock = 0;
     if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
 #else
-    fFlags = fcntl(hSocket, F_GETFL, 0);
-    if (fcntl(hSocket, F_SETFL, fFlags & !O_NONBLOCK) == SOCKET_ERROR)
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
+    if (fcntl(hSocket, F_SETFL, fFlags & ~O_NONBLOCK) == SOCKET_ERROR)
 #endif
     {
         closesocket(hSocket);
         return false;
     }
-
-    hSocketRet = hSocket;
     return true;
 }
 
@@ -467,65 +518,80 @@ bool IsProxy(const CNetAddr &addr) {
     return false;
 }
 
-bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
+bool StartConnectSocket(const CService &addrDest, SOCKET& hSocketRet, CSocksHandshake& socks)
 {
     const proxyType &proxy = proxyInfo[addrDest.GetNetwork()];
+    socks = CSocksHandshake();
 
     // no proxy needed
     if (!proxy.second)
-        return ConnectSocketDirectly(addrDest, hSocketRet, nTimeout);
-
-    SOCKET hSocket = INVALID_SOCKET;
+        return StartConnectSocketDirectly(addrDest, hSocketRet);
 
-    // first connect to proxy server
-    if (!ConnectSocketDirectly(proxy.first, hSocket, nTimeout))
-        return false;
- 
-    // do socks negotiation
+    // socks negotiation follows the connect to the proxy server
     switch (proxy.second) {
     case 4:
-        if (!Socks4(addrDest, hSocket))
+        if (!socks.Init4(addrDest))
             return false;
         break;
     case 5:
-        if (!Socks5(addrDest.ToStringIP(), addrDest.GetPort(), hSocket))
+        if (!socks.Init5(addrDest.ToStringIP(), addrDest.GetPort()))
             return false;
         break;
     default:
         return false;
     }
 
-    hSocketRet = hSocket;
-    return true;
+    return StartConnectSocketDirectly(proxy.first, hSocketRet);
 }
 
-bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault, int nTimeout)
+bool StartConnectSocketByName(CService &addr, SOCKET& hSocketRet, CSocksHandshake& socks, const char *pszDest, int portDefault)
 {
     string strDest;
     int port = portDefault;
     SplitHostPort(string(pszDest), port, strDest);
 
-    SOCKET hSocket = INVALID_SOCKET;
     CService addrResolved(CNetAddr(strDest, fNameLookup && !nameproxyInfo.second), port);
     if (addrResolved.IsValid()) {
         addr = addrResolved;
-        return ConnectSocket(addr, hSocketRet, nTimeout);
+        return StartConnectSocket(addr, hSocketRet, socks);
     }
     addr = CService("0.0.0.0:0");
-    if (!nameproxyInfo.second)
+    socks = CSocksHandshake();
+
+    // only SOCKS5 resolves names
+    if (nameproxyInfo.second != 5)
         return false;
-    if (!ConnectSocketDirectly(nameproxyInfo.first, hSocket, nTimeout))
+    if (!socks.Init5(strDest, port))
         return false;
 
-    switch(nameproxyInfo.second)
-    {
-        default:
-        case 4: return false;
-        case 5:
-            if (!Socks5(strDest, port, hSocket))
-                return false;
-            break;
-    }
+    return StartConnectSocketDirectly(nameproxyInfo.first, hSocketRet);
+}
+
+bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
+{
+    SOCKET hSocket = INVALID_SOCKET;
+    CSocksHandshake socks;
+    if (!StartConnectSocket(addrDest, hSocket, socks))
+        return false;
+    if (!WaitConnectSocket(hSocket, nTimeout))
+        return false;
+    if (!socks.IsNull() && !SocksHandshake(socks, hSocket))
+        return false;
+
+    hSocketRet = hSocket;
+    return true;
+}
+
+bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault, int nTimeout)
+{
+    SOCKET hSocket = INVALID_SOCKET;
+    CSocksHandshake socks;
+    if (!StartConnectSocketByName(addr, hSocket, socks, pszDest, portDefault))
+        return false;
+    if (!WaitConnectSocket(hSocket, nTimeout))
+        return false;
+    if (!socks.IsNull() && !SocksHandshake(socks, hSocket))
+        return false;
 
     hSocketRet = hSocket;
     return true;
@@ -136,6 +136,51 @@ class CService : public CNetAddr
             )
 };
 
+/** Client side of a SOCKS4 or SOCKS5 CONNECT handshake, driven step by step
+ *  so that it can run on a non-blocking socket from a select() loop */
+class CSocksHandshake
+{
+public:
+    enum
+    {
+        SOCKS_DONE,
+        SOCKS_WANT_READ,
+        SOCKS_WANT_WRITE,
+        SOCKS_FAILED,
+    };
+
+    CSocksHandshake();
+    bool Init4(const CService &addrDest);
+    bool Init5(const std::string &strDest, int port);
+    bool IsNull() const { return nState == STATE_NONE; }
+
+    /** Sends and receives what the socket allows, returns one of the SOCKS_ codes */
+    int Step(SOCKET hSocket);
+
+private:
+    enum
+    {
+        STATE_NONE,
+        STATE_SOCKS4_REPLY,
+        STATE_SOCKS5_METHOD,
+        STATE_SOCKS5_REPLY,
+        STATE_SOCKS5_NAMELEN,
+        STATE_SOCKS5_BOUNDADDR,
+        STATE_DONE,
+    };
+
+    int nState;
+    std::string strDest;
+    int nPort;
+    std::string strSend;
+    unsigned int nSendPos;
+    std::string strRecv;
+    unsigned int nRecvWant;
+
+    void Expect(int nStateIn, unsigned int nBytes);
+    bool Advance();
+};
+
 enum Network ParseNetwork(std::string net);
 void SplitHostPort(std::string in, int &portOut, std::string &hostOut);
 bool SetProxy(enum Network net, CService addrProxy, int nSocksVersion = 5);
@@ -150,5 +195,8 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
+bool StartConnectSocket(const CService &addrDest, SOCKET& hSocketRet, CSocksHandshake& socks);
+bool StartConnectSocketByName(CService &addr, SOCKET& hSocketRet, CSocksHandshake& socks, const char *pszDest, int portDefault = 0);
+bool FinishConnectSocket(SOCKET hSocket);
 
 #endif
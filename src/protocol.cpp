@@ -18,6 +18,7 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
+    "cmpctblock",
 };
 
 CMessageHeader::CMessageHeader(bool fMagic) {
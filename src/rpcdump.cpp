@@ -58,19 +58,55 @@ Value importprivkey(const Array& params, bool fHelp)
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        pwalletMain->MarkDirty();
         pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(-4,"Error adding key to wallet");
 
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+        pwalletMain->MarkDirty();
+    }
+
+    // Runs without the RPC locks, taking cs_main and cs_wallet one batch
+    // at a time, so getrescaninfo and abortrescan can be answered while it goes
+    pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
         pwalletMain->ReacceptWalletTransactions();
     }
 
     return Value::null;
 }
 
+Value getrescaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns how far a running wallet rescan has got.");
+
+    int nHeight = pwalletMain->GetRescanHeight();
+    Object obj;
+    obj.push_back(Pair("rescanning", nHeight >= 0));
+    if (nHeight >= 0)
+    {
+        obj.push_back(Pair("height", nHeight));
+        obj.push_back(Pair("blocks", nBestHeight));
+    }
+    return obj;
+}
+
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stops a running wallet rescan after the blocks it is working on.\n"
+            "Returns false if no rescan was running.");
+
+    return pwalletMain->AbortRescan();
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -21,6 +21,19 @@ Value getconnectioncount(const Array& params, bool fHelp)
     return (int)vNodes.size();
 }
 
+static Object MessageCountersToJSON(const MapMessageCounters& mapCounters)
+{
+    Object ret;
+    for (MapMessageCounters::const_iterator it = mapCounters.begin(); it != mapCounters.end(); ++it)
+    {
+        Object obj;
+        obj.push_back(Pair("msgs", (boost::int64_t)(*it).second.nMessages));
+        obj.push_back(Pair("bytes", (boost::int64_t)(*it).second.nBytes));
+        ret.push_back(Pair((*it).first, obj));
+    }
+    return ret;
+}
+
 static void CopyNodeStats(std::vector<CNodeStats>& vstats)
 {
     vstats.clear();
@@ -62,6 +75,8 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("txbytes", (boost::int64_t)stats.nTxBytes));
         obj.push_back(Pair("rxbytes", (boost::int64_t)stats.nRxBytes));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("sentpercmd", MessageCountersToJSON(stats.mapSendPerCommand)));
+        obj.push_back(Pair("recvpercmd", MessageCountersToJSON(stats.mapRecvPerCommand)));
 
         ret.push_back(obj);
     }
@@ -69,6 +84,27 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getnettotals(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getnettotals\n"
+            "Returns network traffic totals over all peers since startup,\n"
+            "in bytes on the wire and in messages and bytes by command.");
+
+    MapMessageCounters mapSend, mapRecv;
+    CNode::GetTotalMessageCounters(mapSend, mapRecv);
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", (boost::int64_t)CNode::GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", (boost::int64_t)CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("timemillis", (boost::int64_t)GetTimeMillis()));
+    obj.push_back(Pair("maxuploadrate", (boost::int64_t)nMaxUploadRate));
+    obj.push_back(Pair("sentpercmd", MessageCountersToJSON(mapSend)));
+    obj.push_back(Pair("recvpercmd", MessageCountersToJSON(mapRecv)));
+    return obj;
+}
+
 Value addnode(const Array& params, bool fHelp)
 {
     string strCommand;
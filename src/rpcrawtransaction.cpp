@@ -425,6 +425,15 @@ Value signrawtransaction(const Array& params, bool fHelp)
     }
 
     // Sign what we can:
+    if (!fGivenKeys)
+    {
+        vector<CScript> vScriptPubKey;
+        BOOST_FOREACH(const CTxIn& txin, mergedTx.vin)
+            if (mapPrevOut.count(txin.prevout))
+                vScriptPubKey.push_back(mapPrevOut[txin.prevout]);
+        pwalletMain->PrewarmSigningKeys(vScriptPubKey);
+    }
+    const CSignatureHashData txdata(mergedTx);
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
     {
         CTxIn& txin = mergedTx.vin[i];
@@ -436,14 +445,15 @@ Value signrawtransaction(const Array& params, bool fHelp)
         const CScript& prevPubKey = mapPrevOut[txin.prevout];
 
         txin.scriptSig.clear();
-        SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+        SignSignature(keystore, prevPubKey, mergedTx, i, nHashType, &txdata);
 
         // ... and merge in other signatures:
         BOOST_FOREACH(const CTransaction& txv, txVariants)
         {
             txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
         }
-        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, true, 0))
+        mergedTx.UpdateHash();
+        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, true, 0, &txdata))
             fComplete = false;
     }
 
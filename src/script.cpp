@@ -6,7 +6,6 @@
 // file LICENCE or http://www.opensource.org/licenses/mit-license.php
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
@@ -19,7 +18,8 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char>& vchPubKey, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn,
+              int nHashType, const CSignatureHashData* pdata=NULL);
 
 
 
@@ -27,19 +27,44 @@ typedef vector<unsigned char> valtype;
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
 static const size_t nMaxNumSize = 4;
 
 
-CBigNum CastToBigNum(const valtype& vch)
+// Script numbers are little-endian with the sign in the top bit of the last
+// byte. Operands are at most nMaxNumSize bytes, so they and the results of
+// the arithmetic the interpreter allows fit in an int64, no CBigNum needed.
+int64 CastToInt64(const valtype& vch)
 {
     if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
+        throw runtime_error("CastToInt64() : overflow");
+    if (vch.empty())
+        return 0;
+    int64 n = 0;
+    for (unsigned int i = 0; i < vch.size(); i++)
+        n |= (int64)vch[i] << (8 * i);
+    if (vch.back() & 0x80)
+        return -(n & ~((int64)0x80 << (8 * (vch.size() - 1))));
+    return n;
+}
+
+// Shortest encoding of n, the same bytes CBigNum::getvch() gives
+valtype Int64ToScriptNum(int64 n)
+{
+    valtype vch;
+    if (n == 0)
+        return vch;
+    bool fNegative = (n < 0);
+    uint64 nAbs = fNegative ? -(uint64)n : (uint64)n;
+    while (nAbs)
+    {
+        vch.push_back(nAbs & 0xff);
+        nAbs >>= 8;
+    }
+    if (vch.back() & 0x80)
+        vch.push_back(fNegative ? 0x80 : 0);
+    else if (fNegative)
+        vch.back() |= 0x80;
+    return vch;
 }
 
 bool CastToBool(const valtype& vch)
@@ -239,9 +264,9 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashData* pdata)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
@@ -314,8 +339,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    stack.push_back(Int64ToScriptNum((int)opcode - (int)(OP_1 - 1)));
                 }
                 break;
 
@@ -490,8 +514,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(Int64ToScriptNum(stack.size()));
                 }
                 break;
 
@@ -540,7 +563,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = (int)CastToInt64(stacktop(-1));
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
@@ -606,8 +629,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 3)
                         return false;
                     valtype& vch = stacktop(-3);
-                    int nBegin = CastToBigNum(stacktop(-2)).getint();
-                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
+                    int nBegin = (int)CastToInt64(stacktop(-2));
+                    int nEnd = nBegin + (int)CastToInt64(stacktop(-1));
                     if (nBegin < 0 || nEnd < nBegin)
                         return false;
                     if (nBegin > (int)vch.size())
@@ -628,7 +651,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
                     valtype& vch = stacktop(-2);
-                    int nSize = CastToBigNum(stacktop(-1)).getint();
+                    int nSize = (int)CastToInt64(stacktop(-1));
                     if (nSize < 0)
                         return false;
                     if (nSize > (int)vch.size())
@@ -646,8 +669,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(Int64ToScriptNum(stacktop(-1).size()));
                 }
                 break;
 
@@ -729,8 +751,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 case OP_1ADD:
                 case OP_1SUB:
-                case OP_2MUL:
-                case OP_2DIV:
                 case OP_NEGATE:
                 case OP_ABS:
                 case OP_NOT:
@@ -739,31 +759,24 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    int64 n = CastToInt64(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
-                    case OP_2MUL:       bn <<= 1; break;
-                    case OP_2DIV:       bn >>= 1; break;
-                    case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_1ADD:       n += 1; break;
+                    case OP_1SUB:       n -= 1; break;
+                    case OP_NEGATE:     n = -n; break;
+                    case OP_ABS:        if (n < 0) n = -n; break;
+                    case OP_NOT:        n = (n == 0); break;
+                    case OP_0NOTEQUAL:  n = (n != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(Int64ToScriptNum(n));
                 }
                 break;
 
                 case OP_ADD:
                 case OP_SUB:
-                case OP_MUL:
-                case OP_DIV:
-                case OP_MOD:
-                case OP_LSHIFT:
-                case OP_RSHIFT:
                 case OP_BOOLAND:
                 case OP_BOOLOR:
                 case OP_NUMEQUAL:
@@ -779,62 +792,29 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    int64 n1 = CastToInt64(stacktop(-2));
+                    int64 n2 = CastToInt64(stacktop(-1));
+                    int64 n;
                     switch (opcode)
                     {
-                    case OP_ADD:
-                        bn = bn1 + bn2;
-                        break;
-
-                    case OP_SUB:
-                        bn = bn1 - bn2;
-                        break;
-
-                    case OP_MUL:
-                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_DIV:
-                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_MOD:
-                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_LSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 << bn2.getulong();
-                        break;
-
-                    case OP_RSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 >> bn2.getulong();
-                        break;
-
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
-                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
-                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
-                    default:                     assert(!"invalid opcode"); break;
+                    case OP_ADD:                 n = n1 + n2; break;
+                    case OP_SUB:                 n = n1 - n2; break;
+                    case OP_BOOLAND:             n = (n1 != 0 && n2 != 0); break;
+                    case OP_BOOLOR:              n = (n1 != 0 || n2 != 0); break;
+                    case OP_NUMEQUAL:            n = (n1 == n2); break;
+                    case OP_NUMEQUALVERIFY:      n = (n1 == n2); break;
+                    case OP_NUMNOTEQUAL:         n = (n1 != n2); break;
+                    case OP_LESSTHAN:            n = (n1 < n2); break;
+                    case OP_GREATERTHAN:         n = (n1 > n2); break;
+                    case OP_LESSTHANOREQUAL:     n = (n1 <= n2); break;
+                    case OP_GREATERTHANOREQUAL:  n = (n1 >= n2); break;
+                    case OP_MIN:                 n = (n1 < n2 ? n1 : n2); break;
+                    case OP_MAX:                 n = (n1 > n2 ? n1 : n2); break;
+                    default:                     assert(!"invalid opcode"); n = 0; break;
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(Int64ToScriptNum(n));
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -851,10 +831,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
-                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                    int64 n1 = CastToInt64(stacktop(-3));
+                    int64 n2 = CastToInt64(stacktop(-2));
+                    int64 n3 = CastToInt64(stacktop(-1));
+                    bool fValue = (n2 <= n1 && n1 < n3);
                     popstack(stack);
                     popstack(stack);
                     popstack(stack);
@@ -882,7 +862,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     else if (opcode == OP_SHA1)
                         SHA1(&vch[0], vch.size(), &vchHash[0]);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        CSHA256().Write(&vch[0], vch.size()).Finalize(&vchHash[0]);
                     else if (opcode == OP_HASH160)
                     {
                         uint160 hash160 = Hash160(vch);
@@ -925,7 +905,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signature, since there's no way for a signature to sign itself
                     scriptCode.FindAndDelete(CScript(vchSig));
 
-                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, pdata);
 
                     popstack(stack);
                     popstack(stack);
@@ -949,7 +929,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = (int)CastToInt64(stacktop(-i));
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -960,7 +940,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = (int)CastToInt64(stacktop(-i));
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -985,7 +965,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         valtype& vchPubKey = stacktop(-ikey);
 
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, pdata))
                         {
                             isig++;
                             nSigsCount--;
@@ -1042,66 +1022,109 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+CSignatureHashData::CSignatureHashData(const CTransaction& txTo)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    vInputPos.reserve(txTo.vin.size() + 1);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        vInputPos.push_back(ss.size());
+        ss << txin.prevout << CScript() << txin.nSequence;
+    }
+    vInputPos.push_back(ss.size());
+    vchInputs.assign(ss.begin(), ss.end());
+
+    ss.clear();
+    ss << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ss.begin(), ss.end());
+}
+
+/* Hashes the transaction as the old copy-and-blank code would have
+ * serialized it, streaming it into the hasher instead of copying it */
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashData* pdata)
 {
     if (nIn >= txTo.vin.size())
     {
         printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY);
+    bool fHashNone = ((nHashType & 0x1f) == SIGHASH_NONE);
+    bool fHashSingle = ((nHashType & 0x1f) == SIGHASH_SINGLE);
+    if (fHashSingle && nIn >= txTo.vout.size())
+    {
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
+    if (pdata && pdata->vInputPos.size() != txTo.vin.size() + 1)
+        pdata = NULL;
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
     scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
 
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    // Other inputs' signatures are blanked, and with SIGHASH_NONE and
+    // SIGHASH_SINGLE their sequence numbers too, to let the others update at will.
+    // SIGHASH_ANYONECANPAY leaves out the other inputs completely.
+    const CTxIn& txinThis = txTo.vin[nIn];
+    if (fAnyoneCanPay)
     {
-        // Wildcard payee
-        txTmp.vout.clear();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        WriteCompactSize(ss, 1);
+        ss << txinThis.prevout << scriptCode << txinThis.nSequence;
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    else if (pdata && !fHashNone && !fHashSingle)
+    {
+        const vector<unsigned char>& vch = pdata->vchInputs;
+        unsigned int nPos = pdata->vInputPos[nIn];
+        unsigned int nNext = pdata->vInputPos[nIn + 1];
+        WriteCompactSize(ss, txTo.vin.size());
+        if (nPos > 0)
+            ss.write((const char*)&vch[0], nPos);
+        ss << txinThis.prevout << scriptCode << txinThis.nSequence;
+        if (nNext < vch.size())
+            ss.write((const char*)&vch[nNext], vch.size() - nNext);
+    }
+    else
     {
-        // Only lockin the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
+        static const CScript scriptEmpty;
+        WriteCompactSize(ss, txTo.vin.size());
+        for (unsigned int i = 0; i < txTo.vin.size(); i++)
         {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
+            const CTxIn& txin = txTo.vin[i];
+            if (i == nIn)
+                ss << txin.prevout << scriptCode << txin.nSequence;
+            else if (fHashNone || fHashSingle)
+                ss << txin.prevout << scriptEmpty << (unsigned int)0;
+            else
+                ss << txin.prevout << scriptEmpty << txin.nSequence;
         }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
     }
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+    // SIGHASH_NONE is a wildcard payee, SIGHASH_SINGLE only locks in the
+    // txout at the same index as the txin and blanks the ones before it
+    if (fHashNone)
+    {
+        WriteCompactSize(ss, 0);
+        ss << txTo.nLockTime;
+    }
+    else if (fHashSingle)
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        static const CTxOut txoutNull;
+        WriteCompactSize(ss, nIn + 1);
+        for (unsigned int i = 0; i < nIn; i++)
+            ss << txoutNull;
+        ss << txTo.vout[nIn] << txTo.nLockTime;
     }
+    else if (pdata)
+        ss.write((const char*)&pdata->vchOutputs[0], pdata->vchOutputs.size());
+    else
+        ss << txTo.vout << txTo.nLockTime;
 
-    // Serialize and hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss.reserve(10000);
-    ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
+    ss << nHashType;
+    return ss.GetHash();
 }
 
 
@@ -1109,64 +1132,118 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
+/** Fixed-size cache of valid signatures.
+ *  An entry is a salted hash of (signature hash, public key, signature), so
+ *  nothing is allocated per entry and an attacker can't aim at particular
+ *  slots. Entries live in buckets of four, a bucket is guarded by one of a
+ *  fixed number of striped locks, and a full bucket overwrites a slot picked
+ *  by the key itself. */
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    enum
+    {
+        BUCKET_ENTRIES = 4,
+        LOCK_STRIPES = 64,
+    };
+
+    uint256 salt;
+    std::vector<uint256> vEntries;
+    uint64 nBuckets;
+    boost::mutex csStripe[LOCK_STRIPES];
+
+    uint256 GetKey(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    {
+        unsigned char pchSize[4];
+        unsigned int nSize = pubKey.size();
+        for (int i = 0; i < 4; i++)
+            pchSize[i] = (nSize >> (8 * i)) & 0xff;
+
+        uint256 key;
+        CSHA256 hasher;
+        hasher.Write(salt.begin(), 32).Write((const unsigned char*)&hash, 32).Write(pchSize, 4);
+        if (!pubKey.empty())
+            hasher.Write(&pubKey[0], pubKey.size());
+        if (!vchSig.empty())
+            hasher.Write(&vchSig[0], vchSig.size());
+        hasher.Finalize(key.begin());
+        return key;
+    }
 
 public:
+    CSignatureCache() : nBuckets(0)
+    {
+    }
+
+    void
+    Init(int64 nBytes)
+    {
+        salt = GetRandHash();
+        nBuckets = nBytes / (sizeof(uint256) * BUCKET_ENTRIES);
+        vEntries.assign(nBuckets * BUCKET_ENTRIES, 0);
+    }
+
+    uint64
+    GetEntries() const
+    {
+        return vEntries.size();
+    }
+
     bool
     Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        LOCK(cs_sigcache);
+        if (nBuckets == 0)
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 key = GetKey(hash, vchSig, pubKey);
+        uint64 nBucket = key.Get64(0) % nBuckets;
+        const uint256* pentry = &vEntries[nBucket * BUCKET_ENTRIES];
+
+        boost::mutex::scoped_lock lock(csStripe[nBucket % LOCK_STRIPES]);
+        for (int i = 0; i < BUCKET_ENTRIES; i++)
+            if (pentry[i] == key)
+                return true;
         return false;
     }
 
     void
     Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nBuckets == 0)
+            return;
 
-        LOCK(cs_sigcache);
+        uint256 key = GetKey(hash, vchSig, pubKey);
+        uint64 nBucket = key.Get64(0) % nBuckets;
+        uint256* pentry = &vEntries[nBucket * BUCKET_ENTRIES];
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+        boost::mutex::scoped_lock lock(csStripe[nBucket % LOCK_STRIPES]);
+        for (int i = 0; i < BUCKET_ENTRIES; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pentry[i] == key)
+                return;
+            if (pentry[i] == 0)
+            {
+                pentry[i] = key;
+                return;
+            }
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Bucket is full; the salted key makes the victim unpredictable
+        pentry[key.Get64(1) % BUCKET_ENTRIES] = key;
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+static CSignatureCache signatureCache;
+
+uint64 InitSignatureCache(int64 nMegabytes)
 {
-    static CSignatureCache signatureCache;
+    nMegabytes = std::max((int64)0, std::min(nMegabytes, MAX_SIGCACHE_SIZE));
+    signatureCache.Init(nMegabytes << 20);
+    return signatureCache.GetEntries();
+}
 
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char>& vchPubKey, const CScript& scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashData* pdata)
+{
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -1176,16 +1253,12 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, pdata);
 
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
-    if (!key.Verify(sighash, vchSig))
+    if (!CKey::Verify(vchPubKey, sighash, vchSig))
         return false;
 
     signatureCache.Set(sighash, vchSig, vchPubKey);
@@ -1553,15 +1626,75 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
     return true;
 }
 
+// Collects what a scriptSig made only of data pushes leaves on the stack.
+// Returns false for anything else, which then goes through EvalScript.
+static bool EvalPushOnly(const CScript& script, vector<valtype>& stack)
+{
+    if (script.size() > 10000)
+        return false;
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    valtype vchPushValue;
+    while (pc < script.end())
+    {
+        if (!script.GetOp(pc, opcode, vchPushValue))
+            return false;
+        if (opcode > OP_PUSHDATA4 || vchPushValue.size() > 520 || stack.size() >= 999)
+            return false;
+        stack.push_back(valtype());
+        stack.back().swap(vchPushValue);
+    }
+    return true;
+}
+
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType)
+                  bool fValidatePayToScriptHash, int nHashType, const CSignatureHashData* pdata)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+
+    // The standard templates with a plain pushed scriptSig don't need the
+    // interpreter: the results are exactly those EvalScript would reach
+    if (scriptPubKey.IsPayToPubKeyHash())
+    {
+        if (EvalPushOnly(scriptSig, stack) && stack.size() == 2)
+        {
+            // OP_DUP OP_HASH160 <hash> OP_EQUALVERIFY OP_CHECKSIG
+            uint160 hash = Hash160(stack[1]);
+            if (memcmp(&hash, &scriptPubKey[3], 20) != 0)
+                return false;
+            CScript scriptCode(scriptPubKey);
+            scriptCode.FindAndDelete(CScript(stack[0]));
+            return CheckSig(stack[0], stack[1], scriptCode, txTo, nIn, nHashType, pdata);
+        }
+        stack.clear();
+    }
+    else if (scriptPubKey.IsPayToScriptHash())
+    {
+        if (EvalPushOnly(scriptSig, stack) && !stack.empty())
+        {
+            // OP_HASH160 <hash> OP_EQUAL
+            uint160 hash = Hash160(stack.back());
+            if (memcmp(&hash, &scriptPubKey[2], 20) != 0)
+                return false;
+            if (!fValidatePayToScriptHash)
+                return true;
+
+            CScript pubKey2(stack.back().begin(), stack.back().end());
+            popstack(stack);
+            if (!EvalScript(stack, pubKey2, txTo, nIn, nHashType, pdata))
+                return false;
+            if (stack.empty())
+                return false;
+            return CastToBool(stack.back());
+        }
+        stack.clear();
+    }
+
+    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType, pdata))
         return false;
     if (fValidatePayToScriptHash)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType, pdata))
         return false;
     if (stack.empty())
         return false;
@@ -1579,7 +1712,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType, pdata))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1590,14 +1723,15 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashData* pdata)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType, pdata);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1611,7 +1745,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType, pdata);
 
         txnouttype subType;
         bool fSolved =
@@ -1620,22 +1754,25 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         txin.scriptSig << static_cast<valtype>(subscript);
         if (!fSolved) return false;
     }
+    txTo.UpdateHash();
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, true, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, true, 0, pdata);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashData* pdata)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
     assert(txin.prevout.n < txFrom.vout.size());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, pdata);
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     const CSignatureHashData* pdata)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1646,7 +1783,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, pdata);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -1819,6 +1956,17 @@ unsigned int CScript::GetSigOpCount(const CScript& scriptSig) const
     return subscript.GetSigOpCount(true);
 }
 
+bool CScript::IsPayToPubKeyHash() const
+{
+    // Extra-fast test for pay-to-pubkey-hash CScripts:
+    return (this->size() == 25 &&
+            this->at(0) == OP_DUP &&
+            this->at(1) == OP_HASH160 &&
+            this->at(2) == 0x14 &&
+            this->at(23) == OP_EQUALVERIFY &&
+            this->at(24) == OP_CHECKSIG);
+}
+
 bool CScript::IsPayToScriptHash() const
 {
     // Extra-fast test for pay-to-script-hash CScripts:
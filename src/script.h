@@ -19,6 +19,10 @@
 
 class CTransaction;
 
+/** Default and maximum for -sigcachesize, in megabytes */
+static const int64 DEFAULT_SIGCACHE_SIZE = 32;
+static const int64 MAX_SIGCACHE_SIZE = 16384;
+
 /** Signature hash types/flags */
 enum
 {
@@ -521,6 +525,7 @@ public:
     // pay-to-script-hash transactions:
     unsigned int GetSigOpCount(const CScript& scriptSig) const;
 
+    bool IsPayToPubKeyHash() const;
     bool IsPayToScriptHash() const;
 
     // Called by CTransaction::IsStandard
@@ -586,7 +591,24 @@ public:
 
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/** Serialized parts of a transaction that are the same in the SIGHASH_ALL
+ *  signature hash of each of its inputs, computed once per transaction so
+ *  checking or signing all inputs doesn't reserialize it every time. Only
+ *  the scriptSigs of txTo may change while this is in use. */
+class CSignatureHashData
+{
+public:
+    // every input with an empty scriptSig, input i at vInputPos[i]
+    std::vector<unsigned char> vchInputs;
+    std::vector<unsigned int> vInputPos;
+    // output count, outputs and nLockTime
+    std::vector<unsigned char> vchOutputs;
+
+    CSignatureHashData(const CTransaction& txTo);
+};
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashData* pdata=NULL);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashData* pdata=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -594,11 +616,14 @@ bool IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashData* pdata=NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashData* pdata=NULL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
+                  bool fValidatePayToScriptHash, int nHashType, const CSignatureHashData* pdata=NULL);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType, const CSignatureHashData* pdata=NULL);
+
+// Allocate the signature cache, returning how many entries it holds; call before validating anything
+uint64 InitSignatureCache(int64 nMegabytes);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -0,0 +1,890 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "secp256k1.h"
+
+/* ECDSA verification on secp256k1 without OpenSSL.
+ *
+ * Field elements and scalars are four 64-bit limbs, least significant
+ * first, kept fully reduced. Points are Jacobian. Verification computes
+ * u1*G + u2*Q by splitting both scalars with the curve's endomorphism
+ * (lambda*(x, y) = (beta*x, y)) into halves of at most 128 bits, and walks
+ * the four half scalars together in wNAF form: a precomputed affine table
+ * of odd multiples of G, and a small table of odd multiples of Q built per
+ * signature. */
+
+namespace
+{
+
+//
+// 64x64->128 bit multiplication
+//
+#if defined(__SIZEOF_INT128__)
+inline void Mul64(uint64_t a, uint64_t b, uint64_t& lo, uint64_t& hi)
+{
+    unsigned __int128 r = (unsigned __int128)a * b;
+    lo = (uint64_t)r;
+    hi = (uint64_t)(r >> 64);
+}
+#else
+inline void Mul64(uint64_t a, uint64_t b, uint64_t& lo, uint64_t& hi)
+{
+    uint64_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t mid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    lo = (mid << 32) | (uint32_t)p00;
+    hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
+#endif
+
+/* (c0, c1, c2) is a 192-bit accumulator for product scanning */
+inline void MulAdd(uint64_t a, uint64_t b, uint64_t& c0, uint64_t& c1, uint64_t& c2)
+{
+    uint64_t lo, hi;
+    Mul64(a, b, lo, hi);
+    c0 += lo;
+    hi += (c0 < lo);
+    c1 += hi;
+    c2 += (c1 < hi);
+}
+
+inline void AddTo(uint64_t a, uint64_t& c0, uint64_t& c1, uint64_t& c2)
+{
+    c0 += a;
+    uint64_t carry = (c0 < a);
+    c1 += carry;
+    c2 += (c1 < carry);
+}
+
+/* r = a * b, 256x256->512 bits */
+void Mul512(uint64_t r[8], const uint64_t a[4], const uint64_t b[4])
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0;
+    for (int k = 0; k < 7; k++)
+    {
+        for (int i = (k > 3 ? k - 3 : 0); i <= (k < 3 ? k : 3); i++)
+            MulAdd(a[i], b[k - i], c0, c1, c2);
+        r[k] = c0;
+        c0 = c1;
+        c1 = c2;
+        c2 = 0;
+    }
+    r[7] = c0;
+}
+
+/* r = a + b mod 2^256, returning the carry */
+inline uint64_t Add256(uint64_t r[4], const uint64_t a[4], const uint64_t b[4])
+{
+    uint64_t carry = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t t = a[i] + carry;
+        carry = (t < carry);
+        r[i] = t + b[i];
+        carry += (r[i] < t);
+    }
+    return carry;
+}
+
+/* r = a - b mod 2^256, returning the borrow */
+inline uint64_t Sub256(uint64_t r[4], const uint64_t a[4], const uint64_t b[4])
+{
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t t = a[i] - b[i];
+        uint64_t borrow1 = (a[i] < b[i]);
+        r[i] = t - borrow;
+        borrow = borrow1 | (t < borrow);
+    }
+    return borrow;
+}
+
+/* a >= b, as 256-bit numbers */
+inline bool GreaterOrEqual256(const uint64_t a[4], const uint64_t b[4])
+{
+    for (int i = 3; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] > b[i];
+    return true;
+}
+
+void Set256(uint64_t r[4], const unsigned char* p)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        r[3 - i] = 0;
+        for (int j = 0; j < 8; j++)
+            r[3 - i] = (r[3 - i] << 8) | p[8 * i + j];
+    }
+}
+
+
+//
+// Field elements mod p = 2^256 - 2^32 - 977
+//
+const uint64_t pFieldP[4] = { 0xFFFFFFFEFFFFFC2FULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL };
+const uint64_t pFieldC[4] = { 0x1000003D1ULL, 0, 0, 0 }; // 2^256 - p
+
+struct FieldElem
+{
+    uint64_t d[4];
+};
+
+inline void FieldSetInt(FieldElem& r, uint64_t n)
+{
+    r.d[0] = n;
+    r.d[1] = r.d[2] = r.d[3] = 0;
+}
+
+inline bool FieldIsZero(const FieldElem& a)
+{
+    return (a.d[0] | a.d[1] | a.d[2] | a.d[3]) == 0;
+}
+
+inline bool FieldEqual(const FieldElem& a, const FieldElem& b)
+{
+    return memcmp(a.d, b.d, sizeof(a.d)) == 0;
+}
+
+/* Fails for values >= p */
+inline bool FieldSetB32(FieldElem& r, const unsigned char* p)
+{
+    Set256(r.d, p);
+    return !GreaterOrEqual256(r.d, pFieldP);
+}
+
+inline void FieldAdd(FieldElem& r, const FieldElem& a, const FieldElem& b)
+{
+    // when the sum passes 2^256 or p, subtracting p is adding C mod 2^256
+    if (Add256(r.d, a.d, b.d) || GreaterOrEqual256(r.d, pFieldP))
+        Add256(r.d, r.d, pFieldC);
+}
+
+inline void FieldSub(FieldElem& r, const FieldElem& a, const FieldElem& b)
+{
+    if (Sub256(r.d, a.d, b.d))
+        Sub256(r.d, r.d, pFieldC);
+}
+
+inline void FieldNegate(FieldElem& r, const FieldElem& a)
+{
+    FieldElem zero;
+    FieldSetInt(zero, 0);
+    FieldSub(r, zero, a);
+}
+
+/* Reduces a 512-bit product, using 2^256 = C (mod p) twice */
+void FieldReduce(FieldElem& r, const uint64_t t[8])
+{
+    uint64_t s[5];
+    uint64_t c0 = 0, c1 = 0, c2 = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        AddTo(t[i], c0, c1, c2);
+        MulAdd(t[4 + i], pFieldC[0], c0, c1, c2);
+        s[i] = c0;
+        c0 = c1;
+        c1 = c2;
+        c2 = 0;
+    }
+    s[4] = c0;
+
+    uint64_t lo, hi;
+    Mul64(s[4], pFieldC[0], lo, hi);
+    uint64_t h[4] = { lo, hi, 0, 0 };
+    if (Add256(r.d, s, h))
+        Add256(r.d, r.d, pFieldC); // tiny after the wrap, can't carry again
+    if (GreaterOrEqual256(r.d, pFieldP))
+        Add256(r.d, r.d, pFieldC);
+}
+
+inline void FieldMul(FieldElem& r, const FieldElem& a, const FieldElem& b)
+{
+    uint64_t t[8];
+    Mul512(t, a.d, b.d);
+    FieldReduce(r, t);
+}
+
+inline void FieldSqr(FieldElem& r, const FieldElem& a)
+{
+    FieldMul(r, a, a);
+}
+
+inline void FieldSqrN(FieldElem& r, const FieldElem& a, int n)
+{
+    r = a;
+    for (int i = 0; i < n; i++)
+        FieldSqr(r, r);
+}
+
+/* Powers a^(2^k - 1) shared by the inverse and square root chains */
+void FieldChain223(const FieldElem& a, FieldElem& x2, FieldElem& x3, FieldElem& x22, FieldElem& x223)
+{
+    FieldElem x6, x9, x11, x44, x88, x176, x220, t;
+    FieldSqr(t, a);           FieldMul(x2, t, a);
+    FieldSqr(t, x2);          FieldMul(x3, t, a);
+    FieldSqrN(t, x3, 3);      FieldMul(x6, t, x3);
+    FieldSqrN(t, x6, 3);      FieldMul(x9, t, x3);
+    FieldSqrN(t, x9, 2);      FieldMul(x11, t, x2);
+    FieldSqrN(t, x11, 11);    FieldMul(x22, t, x11);
+    FieldSqrN(t, x22, 22);    FieldMul(x44, t, x22);
+    FieldSqrN(t, x44, 44);    FieldMul(x88, t, x44);
+    FieldSqrN(t, x88, 88);    FieldMul(x176, t, x88);
+    FieldSqrN(t, x176, 44);   FieldMul(x220, t, x44);
+    FieldSqrN(t, x220, 3);    FieldMul(x223, t, x3);
+}
+
+/* r = a^(p-2) */
+void FieldInverse(FieldElem& r, const FieldElem& a)
+{
+    FieldElem x2, x3, x22, x223, t;
+    FieldChain223(a, x2, x3, x22, x223);
+    FieldSqrN(t, x223, 23);   FieldMul(t, t, x22);
+    FieldSqrN(t, t, 5);       FieldMul(t, t, a);
+    FieldSqrN(t, t, 3);       FieldMul(t, t, x2);
+    FieldSqrN(t, t, 2);       FieldMul(r, t, a);
+}
+
+/* r = a^((p+1)/4), a square root if there is one */
+bool FieldSqrt(FieldElem& r, const FieldElem& a)
+{
+    FieldElem x2, x3, x22, x223, t, check;
+    FieldChain223(a, x2, x3, x22, x223);
+    FieldSqrN(t, x223, 23);   FieldMul(t, t, x22);
+    FieldSqrN(t, t, 6);       FieldMul(t, t, x2);
+    FieldSqrN(r, t, 2);
+    FieldSqr(check, r);
+    return FieldEqual(check, a);
+}
+
+
+//
+// Scalars mod the group order n
+//
+const uint64_t pScalarN[4] = { 0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL };
+const uint64_t pScalarNC[4] = { 0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 0x1ULL, 0 }; // 2^256 - n
+const uint64_t pScalarNHalf[4] = { 0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL, 0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL };
+
+struct Scalar
+{
+    uint64_t d[4];
+};
+
+inline bool ScalarIsZero(const Scalar& a)
+{
+    return (a.d[0] | a.d[1] | a.d[2] | a.d[3]) == 0;
+}
+
+/* Above n/2, i.e. better handled negated */
+inline bool ScalarIsHigh(const Scalar& a)
+{
+    return !GreaterOrEqual256(pScalarNHalf, a.d);
+}
+
+/* Reduces mod n, reporting whether the value was n or more */
+inline bool ScalarSetB32(Scalar& r, const unsigned char* p)
+{
+    Set256(r.d, p);
+    if (!GreaterOrEqual256(r.d, pScalarN))
+        return false;
+    Add256(r.d, r.d, pScalarNC);
+    return true;
+}
+
+inline void ScalarAdd(Scalar& r, const Scalar& a, const Scalar& b)
+{
+    if (Add256(r.d, a.d, b.d) || GreaterOrEqual256(r.d, pScalarN))
+        Add256(r.d, r.d, pScalarNC);
+}
+
+inline void ScalarNegate(Scalar& r, const Scalar& a)
+{
+    if (ScalarIsZero(a))
+        r = a;
+    else
+        Sub256(r.d, pScalarN, a.d);
+}
+
+/* r[0..nOut) = a[0..4) + b[0..nB) * NC, returning what carries out */
+uint64_t ScalarFold(uint64_t* r, int nOut, const uint64_t* a, const uint64_t* b, int nB)
+{
+    uint64_t c0 = 0, c1 = 0, c2 = 0;
+    for (int k = 0; k < nOut; k++)
+    {
+        if (k < 4)
+            AddTo(a[k], c0, c1, c2);
+        for (int j = 0; j < 3; j++)
+            if (k - j >= 0 && k - j < nB)
+                MulAdd(b[k - j], pScalarNC[j], c0, c1, c2);
+        r[k] = c0;
+        c0 = c1;
+        c1 = c2;
+        c2 = 0;
+    }
+    return c0;
+}
+
+/* Reduces a 512-bit product mod n, folding 512 -> 385 -> 258 -> 256 bits */
+void ScalarReduce(Scalar& r, const uint64_t t[8])
+{
+    uint64_t m[7], p[5];
+    ScalarFold(m, 7, t, t + 4, 4);
+    ScalarFold(p, 5, m, m + 4, 3);
+    if (ScalarFold(r.d, 4, p, p + 4, 1))
+        Add256(r.d, r.d, pScalarNC);
+    if (GreaterOrEqual256(r.d, pScalarN))
+        Add256(r.d, r.d, pScalarNC);
+}
+
+inline void ScalarMul(Scalar& r, const Scalar& a, const Scalar& b)
+{
+    uint64_t t[8];
+    Mul512(t, a.d, b.d);
+    ScalarReduce(r, t);
+}
+
+/* r = a^(n-2) */
+void ScalarInverse(Scalar& r, const Scalar& a)
+{
+    uint64_t e[4];
+    const uint64_t two[4] = { 2, 0, 0, 0 };
+    Sub256(e, pScalarN, two);
+
+    Scalar x = a;
+    bool fFirst = true;
+    for (int i = 255; i >= 0; i--)
+    {
+        if (!fFirst)
+            ScalarMul(r, r, r);
+        if ((e[i >> 6] >> (i & 63)) & 1)
+        {
+            if (fFirst)
+                r = x;
+            else
+                ScalarMul(r, r, x);
+            fFirst = false;
+        }
+    }
+}
+
+/* r = round(a * b / 2^384) */
+void ScalarMulShift384(Scalar& r, const Scalar& a, const Scalar& b)
+{
+    uint64_t t[8];
+    Mul512(t, a.d, b.d);
+    const uint64_t round[4] = { t[5] >> 63, 0, 0, 0 };
+    const uint64_t high[4] = { t[6], t[7], 0, 0 };
+    Add256(r.d, high, round);
+}
+
+const Scalar scalarMinusLambda = {{ 0xE0CFC810B51283CFULL, 0xA880B9FC8EC739C2ULL, 0x5AD9E3FD77ED9BA4ULL, 0xAC9C52B33FA3CF1FULL }};
+const Scalar scalarMinusB1 = {{ 0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0, 0 }};
+const Scalar scalarMinusB2 = {{ 0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL }};
+const Scalar scalarG1 = {{ 0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL, 0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL }};
+const Scalar scalarG2 = {{ 0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL, 0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL }};
+
+/* Finds r1, r2 of at most 128 bits, up to sign, with r1 + r2*lambda = k */
+void ScalarSplitLambda(Scalar& r1, Scalar& r2, const Scalar& k)
+{
+    Scalar c1, c2;
+    ScalarMulShift384(c1, k, scalarG1);
+    ScalarMulShift384(c2, k, scalarG2);
+    ScalarMul(c1, c1, scalarMinusB1);
+    ScalarMul(c2, c2, scalarMinusB2);
+    ScalarAdd(r2, c1, c2);
+    ScalarMul(r1, r2, scalarMinusLambda);
+    ScalarAdd(r1, r1, k);
+}
+
+inline int ScalarGetBits(const Scalar& a, int nBit, int nCount)
+{
+    int nLimb = nBit >> 6, nShift = nBit & 63;
+    uint64_t v = a.d[nLimb] >> nShift;
+    if (nShift + nCount > 64 && nLimb < 3)
+        v |= a.d[nLimb + 1] << (64 - nShift);
+    return (int)(v & ((1ULL << nCount) - 1));
+}
+
+/* Windowed non-adjacent form of a: nonzero digits are odd, below 2^(w-1)
+ * in absolute value and at least w apart; negated if fNegate */
+void ScalarWNAF(int* pwnaf, int nLen, const Scalar& a, int w, bool fNegate)
+{
+    memset(pwnaf, 0, nLen * sizeof(int));
+    int nCarry = 0;
+    int nBit = 0;
+    while (nBit < nLen)
+    {
+        if (ScalarGetBits(a, nBit, 1) == nCarry)
+        {
+            nBit++;
+            continue;
+        }
+        int nNow = w;
+        if (nNow > nLen - nBit)
+            nNow = nLen - nBit;
+        int nWord = ScalarGetBits(a, nBit, nNow) + nCarry;
+        nCarry = (nWord >> (w - 1)) & 1;
+        nWord -= nCarry << w;
+        pwnaf[nBit] = fNegate ? -nWord : nWord;
+        nBit += nNow;
+    }
+}
+
+
+//
+// Points on y^2 = x^3 + 7
+//
+struct GroupElem
+{
+    FieldElem x, y;
+    bool fInfinity;
+};
+
+struct GroupElemJ
+{
+    FieldElem x, y, z;
+    bool fInfinity;
+};
+
+inline void GroupSetJ(GroupElemJ& r, const GroupElem& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FieldSetInt(r.z, 1);
+    r.fInfinity = a.fInfinity;
+}
+
+inline void GroupNegate(GroupElem& r, const GroupElem& a)
+{
+    r = a;
+    FieldNegate(r.y, a.y);
+}
+
+inline void GroupNegateJ(GroupElemJ& r, const GroupElemJ& a)
+{
+    r = a;
+    FieldNegate(r.y, a.y);
+}
+
+bool GroupIsValid(const GroupElem& a)
+{
+    FieldElem y2, x3, seven;
+    FieldSqr(y2, a.y);
+    FieldSqr(x3, a.x);
+    FieldMul(x3, x3, a.x);
+    FieldSetInt(seven, 7);
+    FieldAdd(x3, x3, seven);
+    return FieldEqual(y2, x3);
+}
+
+void GroupDouble(GroupElemJ& r, const GroupElemJ& a)
+{
+    if (a.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    FieldElem A, B, C, D, E, F, t;
+    FieldSqr(A, a.x);
+    FieldSqr(B, a.y);
+    FieldSqr(C, B);
+    FieldAdd(t, a.x, B);
+    FieldSqr(t, t);
+    FieldSub(t, t, A);
+    FieldSub(t, t, C);
+    FieldAdd(D, t, t);
+    FieldAdd(E, A, A);
+    FieldAdd(E, E, A);
+    FieldSqr(F, E);
+
+    FieldElem z;
+    FieldMul(z, a.y, a.z);
+    FieldAdd(r.z, z, z);
+    FieldSub(r.x, F, D);
+    FieldSub(r.x, r.x, D);
+    FieldSub(t, D, r.x);
+    FieldMul(t, E, t);
+    FieldAdd(C, C, C);
+    FieldAdd(C, C, C);
+    FieldAdd(C, C, C);
+    FieldSub(r.y, t, C);
+    r.fInfinity = false;
+}
+
+/* The common part of the full and mixed additions: both points scaled to
+ * the same Z (u = x, s = y), and zProduct the Z of the sum before H */
+void GroupAddTail(GroupElemJ& r, const GroupElemJ& a, const FieldElem& u1, const FieldElem& u2,
+                  const FieldElem& s1, const FieldElem& s2, const FieldElem& zProduct)
+{
+    FieldElem h, rr;
+    FieldSub(h, u2, u1);
+    FieldSub(rr, s2, s1);
+    if (FieldIsZero(h))
+    {
+        if (FieldIsZero(rr))
+            GroupDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FieldElem hh, hhh, v, t;
+    FieldSqr(hh, h);
+    FieldMul(hhh, h, hh);
+    FieldMul(v, u1, hh);
+    FieldSqr(t, rr);
+    FieldSub(t, t, hhh);
+    FieldSub(t, t, v);
+    FieldSub(r.x, t, v);
+    FieldSub(t, v, r.x);
+    FieldMul(t, rr, t);
+    FieldMul(hhh, s1, hhh);
+    FieldSub(r.y, t, hhh);
+    FieldMul(r.z, zProduct, h);
+    r.fInfinity = false;
+}
+
+void GroupAddJ(GroupElemJ& r, const GroupElemJ& a, const GroupElemJ& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    FieldElem z1z1, z2z2, u1, u2, s1, s2, zProduct;
+    FieldSqr(z1z1, a.z);
+    FieldSqr(z2z2, b.z);
+    FieldMul(u1, a.x, z2z2);
+    FieldMul(u2, b.x, z1z1);
+    FieldMul(s1, a.y, b.z);
+    FieldMul(s1, s1, z2z2);
+    FieldMul(s2, b.y, a.z);
+    FieldMul(s2, s2, z1z1);
+    FieldMul(zProduct, a.z, b.z);
+    GroupElemJ aCopy = a;
+    GroupAddTail(r, aCopy, u1, u2, s1, s2, zProduct);
+}
+
+void GroupAddAffine(GroupElemJ& r, const GroupElemJ& a, const GroupElem& b)
+{
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    if (a.fInfinity)
+    {
+        GroupSetJ(r, b);
+        return;
+    }
+    FieldElem z1z1, u2, s2;
+    FieldSqr(z1z1, a.z);
+    FieldMul(u2, b.x, z1z1);
+    FieldMul(s2, b.y, a.z);
+    FieldMul(s2, s2, z1z1);
+    GroupElemJ aCopy = a;
+    GroupAddTail(r, aCopy, aCopy.x, u2, aCopy.y, s2, aCopy.z);
+}
+
+const unsigned char pchGeneratorX[32] = {
+    0x79, 0xBE, 0x66, 0x7E, 0xF9, 0xDC, 0xBB, 0xAC, 0x55, 0xA0, 0x62, 0x95, 0xCE, 0x87, 0x0B, 0x07,
+    0x02, 0x9B, 0xFC, 0xDB, 0x2D, 0xCE, 0x28, 0xD9, 0x59, 0xF2, 0x81, 0x5B, 0x16, 0xF8, 0x17, 0x98
+};
+const unsigned char pchGeneratorY[32] = {
+    0x48, 0x3A, 0xDA, 0x77, 0x26, 0xA3, 0xC4, 0x65, 0x5D, 0xA4, 0xFB, 0xFC, 0x0E, 0x11, 0x08, 0xA8,
+    0xFD, 0x17, 0xB4, 0x48, 0xA6, 0x85, 0x54, 0x19, 0x9C, 0x47, 0xD0, 0x8F, 0xFB, 0x10, 0xD4, 0xB8
+};
+const FieldElem fieldBeta = {{ 0xC1396C28719501EEULL, 0x9CF0497512F58995ULL, 0x6E64479EAC3434E9ULL, 0x7AE96A2B657C0710ULL }};
+
+
+//
+// Verification
+//
+
+// wNAF widths and the digits needed for the 128-bit split scalars
+const int WINDOW_A = 5;
+const int WINDOW_G = 12;
+const int TABLE_SIZE_A = 1 << (WINDOW_A - 2);
+const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+const int WNAF_BITS = 130;
+
+bool fStarted = false;
+std::vector<GroupElem> vTableG;       // odd multiples 1*G, 3*G, ...
+std::vector<GroupElem> vTableLambdaG; // the same times lambda
+
+/* Odd multiples a, 3a, ... of a point, Jacobian */
+void OddMultiples(GroupElemJ* pTable, int nSize, const GroupElemJ& a)
+{
+    GroupElemJ a2;
+    GroupDouble(a2, a);
+    pTable[0] = a;
+    for (int i = 1; i < nSize; i++)
+        GroupAddJ(pTable[i], pTable[i - 1], a2);
+}
+
+inline const GroupElem& TableEntry(const std::vector<GroupElem>& vTable, int n, GroupElem& tmp)
+{
+    if (n > 0)
+        return vTable[(n - 1) / 2];
+    GroupNegate(tmp, vTable[(-n - 1) / 2]);
+    return tmp;
+}
+
+inline const GroupElemJ& TableEntryJ(const GroupElemJ* pTable, int n, GroupElemJ& tmp)
+{
+    if (n > 0)
+        return pTable[(n - 1) / 2];
+    GroupNegateJ(tmp, pTable[(-n - 1) / 2]);
+    return tmp;
+}
+
+/* r = na*a + ng*G */
+void MulDouble(GroupElemJ& r, const GroupElem& a, const Scalar& na, const Scalar& ng)
+{
+    // Split both scalars in two halves of at most 128 bits, negated to
+    // make them small where needed
+    Scalar na1, na2, ng1, ng2;
+    ScalarSplitLambda(na1, na2, na);
+    ScalarSplitLambda(ng1, ng2, ng);
+    bool fNegA1 = ScalarIsHigh(na1), fNegA2 = ScalarIsHigh(na2);
+    bool fNegG1 = ScalarIsHigh(ng1), fNegG2 = ScalarIsHigh(ng2);
+    if (fNegA1) ScalarNegate(na1, na1);
+    if (fNegA2) ScalarNegate(na2, na2);
+    if (fNegG1) ScalarNegate(ng1, ng1);
+    if (fNegG2) ScalarNegate(ng2, ng2);
+
+    int wnafA1[WNAF_BITS], wnafA2[WNAF_BITS], wnafG1[WNAF_BITS], wnafG2[WNAF_BITS];
+    ScalarWNAF(wnafA1, WNAF_BITS, na1, WINDOW_A, fNegA1);
+    ScalarWNAF(wnafA2, WNAF_BITS, na2, WINDOW_A, fNegA2);
+    ScalarWNAF(wnafG1, WNAF_BITS, ng1, WINDOW_G, fNegG1);
+    ScalarWNAF(wnafG2, WNAF_BITS, ng2, WINDOW_G, fNegG2);
+
+    GroupElemJ aj, tableA[TABLE_SIZE_A], tableLambdaA[TABLE_SIZE_A];
+    GroupSetJ(aj, a);
+    OddMultiples(tableA, TABLE_SIZE_A, aj);
+    for (int i = 0; i < TABLE_SIZE_A; i++)
+    {
+        tableLambdaA[i] = tableA[i];
+        FieldMul(tableLambdaA[i].x, tableA[i].x, fieldBeta);
+    }
+
+    r.fInfinity = true;
+    GroupElemJ tmpJ;
+    GroupElem tmp;
+    for (int i = WNAF_BITS - 1; i >= 0; i--)
+    {
+        GroupDouble(r, r);
+        if (wnafA1[i])
+            GroupAddJ(r, r, TableEntryJ(tableA, wnafA1[i], tmpJ));
+        if (wnafA2[i])
+            GroupAddJ(r, r, TableEntryJ(tableLambdaA, wnafA2[i], tmpJ));
+        if (wnafG1[i])
+            GroupAddAffine(r, r, TableEntry(vTableG, wnafG1[i], tmp));
+        if (wnafG2[i])
+            GroupAddAffine(r, r, TableEntry(vTableLambdaG, wnafG2[i], tmp));
+    }
+}
+
+/* Parses a plain 33 or 65 byte public key; anything else is left to OpenSSL */
+bool ParsePubKey(GroupElem& r, const unsigned char* pch, size_t nSize)
+{
+    r.fInfinity = false;
+    if (nSize == 33 && (pch[0] == 0x02 || pch[0] == 0x03))
+    {
+        if (!FieldSetB32(r.x, pch + 1))
+            return false;
+        FieldElem x3, seven;
+        FieldSqr(x3, r.x);
+        FieldMul(x3, x3, r.x);
+        FieldSetInt(seven, 7);
+        FieldAdd(x3, x3, seven);
+        if (!FieldSqrt(r.y, x3))
+            return false;
+        if ((r.y.d[0] & 1) != (pch[0] & 1))
+            FieldNegate(r.y, r.y);
+        return true;
+    }
+    if (nSize == 65 && pch[0] == 0x04)
+    {
+        if (!FieldSetB32(r.x, pch + 1) || !FieldSetB32(r.y, pch + 33))
+            return false;
+        return GroupIsValid(r);
+    }
+    return false;
+}
+
+/* Reads one DER INTEGER of a signature as a scalar in [1, n) */
+bool ParseDERInteger(Scalar& r, const unsigned char*& pch, const unsigned char* pend)
+{
+    if (pend - pch < 3 || pch[0] != 0x02)
+        return false;
+    size_t nLen = pch[1];
+    pch += 2;
+    if (nLen == 0 || nLen > 33 || (size_t)(pend - pch) < nLen)
+        return false;
+    // no negative numbers and no needless leading zeros
+    if (pch[0] & 0x80)
+        return false;
+    if (nLen > 1 && pch[0] == 0 && !(pch[1] & 0x80))
+        return false;
+    if (nLen == 33)
+    {
+        // only a sign byte may precede the 32 value bytes
+        if (pch[0] != 0)
+            return false;
+        pch++;
+        nLen--;
+    }
+    unsigned char pchValue[32];
+    memset(pchValue, 0, sizeof(pchValue));
+    memcpy(pchValue + 32 - nLen, pch, nLen);
+    pch += nLen;
+    return !ScalarSetB32(r, pchValue) && !ScalarIsZero(r);
+}
+
+/* Strict DER: 0x30 len 0x02 rlen r 0x02 slen s and nothing after it */
+bool ParseSignature(Scalar& r, Scalar& s, const unsigned char* pch, size_t nSize)
+{
+    if (nSize < 8 || nSize > 72 || pch[0] != 0x30 || pch[1] != nSize - 2)
+        return false;
+    const unsigned char* pend = pch + nSize;
+    pch += 2;
+    if (!ParseDERInteger(r, pch, pend) || !ParseDERInteger(s, pch, pend))
+        return false;
+    return pch == pend;
+}
+
+}
+
+
+bool Secp256k1Start()
+{
+    if (fStarted)
+        return true;
+
+    GroupElem g;
+    g.fInfinity = false;
+    FieldSetB32(g.x, pchGeneratorX);
+    FieldSetB32(g.y, pchGeneratorY);
+    if (!GroupIsValid(g))
+        return false;
+
+    // Odd multiples of G, made affine with a single inversion
+    std::vector<GroupElemJ> vTableJ(TABLE_SIZE_G);
+    GroupElemJ gj;
+    GroupSetJ(gj, g);
+    OddMultiples(&vTableJ[0], TABLE_SIZE_G, gj);
+    std::vector<FieldElem> vProduct(TABLE_SIZE_G);
+    vProduct[0] = vTableJ[0].z;
+    for (int i = 1; i < TABLE_SIZE_G; i++)
+        FieldMul(vProduct[i], vProduct[i - 1], vTableJ[i].z);
+    FieldElem zInv;
+    FieldInverse(zInv, vProduct[TABLE_SIZE_G - 1]);
+    vTableG.resize(TABLE_SIZE_G);
+    vTableLambdaG.resize(TABLE_SIZE_G);
+    for (int i = TABLE_SIZE_G - 1; i >= 0; i--)
+    {
+        FieldElem zi, zi2, zi3;
+        if (i > 0)
+        {
+            FieldMul(zi, zInv, vProduct[i - 1]);
+            FieldMul(zInv, zInv, vTableJ[i].z);
+        }
+        else
+            zi = zInv;
+        FieldSqr(zi2, zi);
+        FieldMul(zi3, zi2, zi);
+        FieldMul(vTableG[i].x, vTableJ[i].x, zi2);
+        FieldMul(vTableG[i].y, vTableJ[i].y, zi3);
+        vTableG[i].fInfinity = false;
+        vTableLambdaG[i] = vTableG[i];
+        FieldMul(vTableLambdaG[i].x, vTableG[i].x, fieldBeta);
+        if (!GroupIsValid(vTableG[i]))
+            return false;
+    }
+    fStarted = true;
+
+    // Known answers: a signature made with OpenSSL, and the same with
+    // the hash changed in one bit
+    static const unsigned char pchPubKey[33] = {
+        0x02, 0xC3, 0x20, 0xC2, 0xC6, 0x30, 0xFD, 0x1F, 0x62, 0x73, 0xBF, 0xF2, 0xBC, 0x51, 0xF5, 0xEB,
+        0x24, 0xCF, 0x0D, 0x97, 0x88, 0x00, 0xA5, 0x98, 0x7E, 0x44, 0x19, 0x06, 0xB8, 0xCD, 0xA4, 0x73,
+        0xA1
+    };
+    static const unsigned char pchHash[32] = {
+        0xBB, 0xF5, 0x0C, 0xD8, 0x7A, 0x20, 0xBE, 0x67, 0xA9, 0x94, 0xAF, 0x51, 0x2D, 0x4E, 0x9F, 0x4D,
+        0x53, 0x1B, 0xE3, 0x9A, 0x09, 0xA5, 0xEE, 0xEA, 0x8E, 0xD1, 0x88, 0x40, 0xC4, 0x8A, 0xFF, 0x7D
+    };
+    static const unsigned char pchSig[] = {
+        0x30, 0x45, 0x02, 0x21, 0x00, 0x94, 0x8B, 0x6E, 0x95, 0x1E, 0xD2, 0x8F, 0xA5, 0x02, 0x51, 0xB9,
+        0x02, 0x92, 0x7E, 0x03, 0x19, 0xA7, 0xD0, 0x1D, 0x52, 0x39, 0x1F, 0x0E, 0x7A, 0xA6, 0xDF, 0xA4,
+        0xC4, 0xA4, 0x04, 0x6B, 0x32, 0x02, 0x20, 0x6F, 0x39, 0xC5, 0x3C, 0xA6, 0xC1, 0xC7, 0x04, 0xC5,
+        0x1B, 0xCE, 0xFB, 0x95, 0xB4, 0x37, 0xB8, 0x9F, 0x4E, 0x9D, 0xFA, 0x00, 0xAC, 0x93, 0x41, 0x66,
+        0x50, 0xBE, 0x72, 0x49, 0x9C, 0x3D, 0xCB
+    };
+    unsigned char pchBadHash[32];
+    memcpy(pchBadHash, pchHash, 32);
+    pchBadHash[31] ^= 1;
+    if (Secp256k1Verify(pchPubKey, sizeof(pchPubKey), pchHash, pchSig, sizeof(pchSig)) != 1 ||
+        Secp256k1Verify(pchPubKey, sizeof(pchPubKey), pchBadHash, pchSig, sizeof(pchSig)) != 0)
+    {
+        fStarted = false;
+        return false;
+    }
+    return true;
+}
+
+void Secp256k1Stop()
+{
+    fStarted = false;
+}
+
+int Secp256k1Verify(const unsigned char* pchPubKey, size_t nPubKeySize, const unsigned char* pchHash,
+                    const unsigned char* pchSig, size_t nSigSize)
+{
+    if (!fStarted)
+        return -1;
+
+    GroupElem q;
+    Scalar r, s;
+    if (!ParsePubKey(q, pchPubKey, nPubKeySize) || !ParseSignature(r, s, pchSig, nSigSize))
+        return -1;
+
+    Scalar e, w, u1, u2;
+    ScalarSetB32(e, pchHash);
+    ScalarInverse(w, s);
+    ScalarMul(u1, e, w);
+    ScalarMul(u2, r, w);
+
+    GroupElemJ pt;
+    MulDouble(pt, q, u2, u1);
+    if (pt.fInfinity)
+        return 0;
+
+    // Compare x mod n with r without leaving Jacobian coordinates: x is
+    // X/Z^2 and below p, so it's r or, if that is still below p, r + n
+    FieldElem z2, xr;
+    FieldSqr(z2, pt.z);
+    FieldElem fr;
+    memcpy(fr.d, r.d, sizeof(fr.d));
+    FieldMul(xr, fr, z2);
+    if (FieldEqual(xr, pt.x))
+        return 1;
+    uint64_t rn[4];
+    if (Add256(rn, r.d, pScalarN) || GreaterOrEqual256(rn, pFieldP))
+        return 0;
+    memcpy(fr.d, rn, sizeof(fr.d));
+    FieldMul(xr, fr, z2);
+    return FieldEqual(xr, pt.x) ? 1 : 0;
+}
@@ -0,0 +1,27 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <stddef.h>
+
+/** Builds the generator tables of the native secp256k1 verifier and checks
+ *  it against known answers; until this succeeds Secp256k1Verify declines
+ *  every signature. Call once at startup, before any thread verifies. */
+bool Secp256k1Start();
+
+/** Stops using the native verifier, leaving everything to OpenSSL */
+void Secp256k1Stop();
+
+/** Verifies an ECDSA signature over a 32-byte hash with the native
+ *  secp256k1 code. Returns 1 for a valid signature and 0 for an invalid one.
+ *  Returns -1 when the verifier isn't running or the encoding is anything
+ *  but a strict DER signature and a plain compressed or uncompressed public
+ *  key, so the caller can let OpenSSL decide exactly as it always has. */
+int Secp256k1Verify(const unsigned char* pchPubKey, size_t nPubKeySize, const unsigned char* pchHash,
+                    const unsigned char* pchSig, size_t nSigSize);
+
+#endif
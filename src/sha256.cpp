@@ -0,0 +1,439 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#include <string.h>
+
+#include "sha256.h"
+
+/* The x86 kernels are selected at run time and built with per function
+ * target attributes, so the rest of the program keeps the baseline ISA */
+#if (defined(__x86_64__) || defined(__amd64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+inline void WriteBE64(unsigned char* p, uint64_t x)
+{
+    WriteBE32(p, x >> 32);
+    WriteBE32(p + 4, (uint32_t)x);
+}
+
+const uint32_t pInit[8] = {
+    0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul,
+    0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul
+};
+
+const uint32_t K[64] = {
+    0x428a2f98ul, 0x71374491ul, 0xb5c0fbcful, 0xe9b5dba5ul, 0x3956c25bul, 0x59f111f1ul, 0x923f82a4ul, 0xab1c5ed5ul,
+    0xd807aa98ul, 0x12835b01ul, 0x243185beul, 0x550c7dc3ul, 0x72be5d74ul, 0x80deb1feul, 0x9bdc06a7ul, 0xc19bf174ul,
+    0xe49b69c1ul, 0xefbe4786ul, 0x0fc19dc6ul, 0x240ca1ccul, 0x2de92c6ful, 0x4a7484aaul, 0x5cb0a9dcul, 0x76f988daul,
+    0x983e5152ul, 0xa831c66dul, 0xb00327c8ul, 0xbf597fc7ul, 0xc6e00bf3ul, 0xd5a79147ul, 0x06ca6351ul, 0x14292967ul,
+    0x27b70a85ul, 0x2e1b2138ul, 0x4d2c6dfcul, 0x53380d13ul, 0x650a7354ul, 0x766a0abbul, 0x81c2c92eul, 0x92722c85ul,
+    0xa2bfe8a1ul, 0xa81a664bul, 0xc24b8b70ul, 0xc76c51a3ul, 0xd192e819ul, 0xd6990624ul, 0xf40e3585ul, 0x106aa070ul,
+    0x19a4c116ul, 0x1e376c08ul, 0x2748774cul, 0x34b0bcb5ul, 0x391c0cb3ul, 0x4ed8aa4aul, 0x5b9cca4ful, 0x682e6ff3ul,
+    0x748f82eeul, 0x78a5636ful, 0x84c87814ul, 0x8cc70208ul, 0x90befffaul, 0xa4506cebul, 0xbef9a3f7ul, 0xc67178f2ul
+};
+
+/* Padding of a 64 byte message, and of the 32 byte first round of a double hash */
+const unsigned char pPad64[64] = {
+    0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00
+};
+const unsigned char pPad32[32] = {
+    0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x00
+};
+
+//
+// Portable implementation
+//
+inline uint32_t Ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+inline uint32_t Ch(uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); }
+inline uint32_t Maj(uint32_t x, uint32_t y, uint32_t z) { return (x & y) | (z & (x | y)); }
+inline uint32_t Sigma0(uint32_t x) { return Ror(x, 2) ^ Ror(x, 13) ^ Ror(x, 22); }
+inline uint32_t Sigma1(uint32_t x) { return Ror(x, 6) ^ Ror(x, 11) ^ Ror(x, 25); }
+inline uint32_t sigma0(uint32_t x) { return Ror(x, 7) ^ Ror(x, 18) ^ (x >> 3); }
+inline uint32_t sigma1(uint32_t x) { return Ror(x, 17) ^ Ror(x, 19) ^ (x >> 10); }
+
+void TransformGeneric(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    while (nBlocks--)
+    {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++)
+            w[i] = ReadBE32(chunk + 4 * i);
+
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; i++)
+        {
+            if (i >= 16)
+                w[i & 15] += sigma1(w[(i + 14) & 15]) + w[(i + 9) & 15] + sigma0(w[(i + 1) & 15]);
+            uint32_t t1 = h + Sigma1(e) + Ch(e, f, g) + K[i] + w[i & 15];
+            uint32_t t2 = Sigma0(a) + Maj(a, b, c);
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+        s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+        chunk += 64;
+    }
+}
+
+typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
+typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+
+/* Double SHA-256 of one 64 byte input in terms of a single block transform */
+template<TransformType tr>
+void TransformD64Wrapper(unsigned char* out, const unsigned char* in)
+{
+    uint32_t s[8];
+    memcpy(s, pInit, sizeof(s));
+    tr(s, in, 1);
+    tr(s, pPad64, 1);
+
+    unsigned char buffer[64];
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buffer + 4 * i, s[i]);
+    memcpy(buffer + 32, pPad32, 32);
+
+    memcpy(s, pInit, sizeof(s));
+    tr(s, buffer, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+#ifdef USE_SHA256_X86
+//
+// SHA-NI, one block at a time
+//
+__attribute__((target("sha,sse4.1")))
+void TransformSHANI(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128((const __m128i*)&s[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i*)&s[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (nBlocks--)
+    {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+        for (int i = 0; i < 4; i++)
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16 * i)), MASK);
+
+        for (int i = 0; i < 16; i++)
+        {
+            __m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*)&K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+            // message words 4 groups ahead, in place of the ones just used
+            if (i < 12)
+            {
+                __m128i x = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(x, w[(i + 3) & 3]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        chunk += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i*)&s[0], state0);
+    _mm_storeu_si128((__m128i*)&s[4], state1);
+}
+
+//
+// SSE4, four independent messages side by side
+//
+#define SHA256_SSE4 __attribute__((target("sse4.1")))
+SHA256_SSE4 inline __m128i Ror4(__m128i x, int n) { return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+SHA256_SSE4 inline __m128i Ch4(__m128i x, __m128i y, __m128i z) { return _mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y, z))); }
+SHA256_SSE4 inline __m128i Maj4(__m128i x, __m128i y, __m128i z) { return _mm_or_si128(_mm_and_si128(x, y), _mm_and_si128(z, _mm_or_si128(x, y))); }
+SHA256_SSE4 inline __m128i Sigma04(__m128i x) { return _mm_xor_si128(_mm_xor_si128(Ror4(x, 2), Ror4(x, 13)), Ror4(x, 22)); }
+SHA256_SSE4 inline __m128i Sigma14(__m128i x) { return _mm_xor_si128(_mm_xor_si128(Ror4(x, 6), Ror4(x, 11)), Ror4(x, 25)); }
+SHA256_SSE4 inline __m128i sigma04(__m128i x) { return _mm_xor_si128(_mm_xor_si128(Ror4(x, 7), Ror4(x, 18)), _mm_srli_epi32(x, 3)); }
+SHA256_SSE4 inline __m128i sigma14(__m128i x) { return _mm_xor_si128(_mm_xor_si128(Ror4(x, 17), Ror4(x, 19)), _mm_srli_epi32(x, 10)); }
+
+SHA256_SSE4 void Compress4(__m128i* s, __m128i* w)
+{
+    __m128i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+            w[i & 15] = _mm_add_epi32(_mm_add_epi32(w[i & 15], sigma14(w[(i + 14) & 15])),
+                                      _mm_add_epi32(w[(i + 9) & 15], sigma04(w[(i + 1) & 15])));
+        __m128i t1 = _mm_add_epi32(_mm_add_epi32(h, Sigma14(e)), _mm_add_epi32(Ch4(e, f, g), _mm_add_epi32(_mm_set1_epi32(K[i]), w[i & 15])));
+        __m128i t2 = _mm_add_epi32(Sigma04(a), Maj4(a, b, c));
+        h = g; g = f; f = e; e = _mm_add_epi32(d, t1);
+        d = c; c = b; b = a; a = _mm_add_epi32(t1, t2);
+    }
+    s[0] = _mm_add_epi32(s[0], a); s[1] = _mm_add_epi32(s[1], b);
+    s[2] = _mm_add_epi32(s[2], c); s[3] = _mm_add_epi32(s[3], d);
+    s[4] = _mm_add_epi32(s[4], e); s[5] = _mm_add_epi32(s[5], f);
+    s[6] = _mm_add_epi32(s[6], g); s[7] = _mm_add_epi32(s[7], h);
+}
+
+SHA256_SSE4 void TransformD64SSE4(unsigned char* out, const unsigned char* in)
+{
+    __m128i s[8], w[16];
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm_set1_epi32(pInit[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm_set_epi32(ReadBE32(in + 192 + 4 * i), ReadBE32(in + 128 + 4 * i), ReadBE32(in + 64 + 4 * i), ReadBE32(in + 4 * i));
+    Compress4(s, w);
+
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm_set1_epi32(ReadBE32(pPad64 + 4 * i));
+    Compress4(s, w);
+
+    for (int i = 0; i < 8; i++)
+    {
+        w[i] = s[i];
+        w[i + 8] = _mm_set1_epi32(ReadBE32(pPad32 + 4 * i));
+        s[i] = _mm_set1_epi32(pInit[i]);
+    }
+    Compress4(s, w);
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t v[4];
+        _mm_storeu_si128((__m128i*)v, s[i]);
+        for (int j = 0; j < 4; j++)
+            WriteBE32(out + 32 * j + 4 * i, v[j]);
+    }
+}
+
+//
+// AVX2, eight independent messages side by side
+//
+#define SHA256_AVX2 __attribute__((target("avx2")))
+SHA256_AVX2 inline __m256i Ror8(__m256i x, int n) { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+SHA256_AVX2 inline __m256i Ch8(__m256i x, __m256i y, __m256i z) { return _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z))); }
+SHA256_AVX2 inline __m256i Maj8(__m256i x, __m256i y, __m256i z) { return _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y))); }
+SHA256_AVX2 inline __m256i Sigma08(__m256i x) { return _mm256_xor_si256(_mm256_xor_si256(Ror8(x, 2), Ror8(x, 13)), Ror8(x, 22)); }
+SHA256_AVX2 inline __m256i Sigma18(__m256i x) { return _mm256_xor_si256(_mm256_xor_si256(Ror8(x, 6), Ror8(x, 11)), Ror8(x, 25)); }
+SHA256_AVX2 inline __m256i sigma08(__m256i x) { return _mm256_xor_si256(_mm256_xor_si256(Ror8(x, 7), Ror8(x, 18)), _mm256_srli_epi32(x, 3)); }
+SHA256_AVX2 inline __m256i sigma18(__m256i x) { return _mm256_xor_si256(_mm256_xor_si256(Ror8(x, 17), Ror8(x, 19)), _mm256_srli_epi32(x, 10)); }
+
+SHA256_AVX2 void Compress8(__m256i* s, __m256i* w)
+{
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+            w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], sigma18(w[(i + 14) & 15])),
+                                         _mm256_add_epi32(w[(i + 9) & 15], sigma08(w[(i + 1) & 15])));
+        __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, Sigma18(e)), _mm256_add_epi32(Ch8(e, f, g), _mm256_add_epi32(_mm256_set1_epi32(K[i]), w[i & 15])));
+        __m256i t2 = _mm256_add_epi32(Sigma08(a), Maj8(a, b, c));
+        h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+        d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+    }
+    s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+    s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+    s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+    s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+}
+
+SHA256_AVX2 void TransformD64AVX2(unsigned char* out, const unsigned char* in)
+{
+    __m256i s[8], w[16];
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm256_set1_epi32(pInit[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm256_set_epi32(ReadBE32(in + 448 + 4 * i), ReadBE32(in + 384 + 4 * i), ReadBE32(in + 320 + 4 * i), ReadBE32(in + 256 + 4 * i),
+                                ReadBE32(in + 192 + 4 * i), ReadBE32(in + 128 + 4 * i), ReadBE32(in + 64 + 4 * i), ReadBE32(in + 4 * i));
+    Compress8(s, w);
+
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm256_set1_epi32(ReadBE32(pPad64 + 4 * i));
+    Compress8(s, w);
+
+    for (int i = 0; i < 8; i++)
+    {
+        w[i] = s[i];
+        w[i + 8] = _mm256_set1_epi32(ReadBE32(pPad32 + 4 * i));
+        s[i] = _mm256_set1_epi32(pInit[i]);
+    }
+    Compress8(s, w);
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t v[8];
+        _mm256_storeu_si256((__m256i*)v, s[i]);
+        for (int j = 0; j < 8; j++)
+            WriteBE32(out + 32 * j + 4 * i, v[j]);
+    }
+}
+
+bool HaveOSAVX()
+{
+    uint32_t a, d;
+    __asm__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    // XMM and YMM state enabled by the OS
+    return (a & 6) == 6;
+}
+#endif // USE_SHA256_X86
+
+TransformType Transform = TransformGeneric;
+TransformD64Type TransformD64 = TransformD64Wrapper<TransformGeneric>;
+TransformD64Type TransformD64_4way = NULL;
+TransformD64Type TransformD64_8way = NULL;
+
+} // namespace
+
+
+std::string SHA256AutoDetect()
+{
+    std::string strRet = "generic";
+#ifdef USE_SHA256_X86
+    uint32_t eax, ebx, ecx, edx;
+    bool fSSE41 = false, fAVX2 = false, fSHANI = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        fSSE41 = (ecx >> 19) & 1;
+        bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && HaveOSAVX();
+        if (__get_cpuid_max(0, NULL) >= 7)
+        {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            fAVX2 = fAVX && ((ebx >> 5) & 1);
+            fSHANI = fSSE41 && ((ebx >> 29) & 1);
+        }
+    }
+
+    // SHA-NI beats the multi-message kernels on its own
+    if (fSHANI)
+    {
+        Transform = TransformSHANI;
+        TransformD64 = TransformD64Wrapper<TransformSHANI>;
+        return "shani(1way)";
+    }
+    if (fSSE41)
+    {
+        TransformD64_4way = TransformD64SSE4;
+        strRet += ",sse41(4way)";
+    }
+    if (fAVX2)
+    {
+        TransformD64_8way = TransformD64AVX2;
+        strRet += ",avx2(8way)";
+    }
+#endif
+    return strRet;
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks)
+{
+    if (TransformD64_8way)
+    {
+        while (nBlocks >= 8)
+        {
+            TransformD64_8way(out, in);
+            out += 256;
+            in += 512;
+            nBlocks -= 8;
+        }
+    }
+    if (TransformD64_4way)
+    {
+        while (nBlocks >= 4)
+        {
+            TransformD64_4way(out, in);
+            out += 128;
+            in += 256;
+            nBlocks -= 4;
+        }
+    }
+    while (nBlocks)
+    {
+        TransformD64(out, in);
+        out += 32;
+        in += 64;
+        nBlocks--;
+    }
+}
+
+
+CSHA256::CSHA256() : bytes(0)
+{
+    memcpy(s, pInit, sizeof(s));
+}
+
+CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
+{
+    const unsigned char* end = data + len;
+    size_t bufsize = bytes % 64;
+    if (bufsize && bufsize + len >= 64)
+    {
+        // Fill the buffer, and process it
+        memcpy(buf + bufsize, data, 64 - bufsize);
+        bytes += 64 - bufsize;
+        data += 64 - bufsize;
+        Transform(s, buf, 1);
+        bufsize = 0;
+    }
+    if (end - data >= 64)
+    {
+        size_t nBlocks = (end - data) / 64;
+        Transform(s, data, nBlocks);
+        data += 64 * nBlocks;
+        bytes += 64 * nBlocks;
+    }
+    if (end > data)
+    {
+        // Keep the remainder for later
+        memcpy(buf + bufsize, data, end - data);
+        bytes += end - data;
+    }
+    return *this;
+}
+
+void CSHA256::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    static const unsigned char pad[64] = {0x80};
+    unsigned char sizedesc[8];
+    WriteBE64(sizedesc, bytes << 3);
+    Write(pad, 1 + ((119 - (bytes % 64)) % 64));
+    Write(sizedesc, 8);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(hash + 4 * i, s[i]);
+}
+
+CSHA256& CSHA256::Reset()
+{
+    bytes = 0;
+    memcpy(s, pInit, sizeof(s));
+    return *this;
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/** A hasher class for SHA-256 */
+class CSHA256
+{
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    CSHA256();
+    CSHA256& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+    CSHA256& Reset();
+
+private:
+    uint32_t s[8];
+    unsigned char buf[64];
+    uint64_t bytes;
+};
+
+/** Selects the fastest SHA-256 implementation the CPU supports
+ *  and returns a description of it; call once at startup */
+std::string SHA256AutoDetect();
+
+/** Computes the double SHA-256 of nBlocks independent 64-byte inputs,
+ *  writing a 32-byte result for each; used for merkle tree nodes */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t nBlocks);
+
+#endif
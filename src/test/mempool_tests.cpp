@@ -0,0 +1,74 @@
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// A transaction spending output n of hashPrev to a single output
+static CTransaction MakeTx(const uint256& hashPrev, unsigned int n, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+static void AddTx(CTxMemPool& pool, const CTransaction& tx, int64 nFee)
+{
+    pool.addUnchecked(CTxMemPoolEntry(tx, nFee, GetTime(), 0, 0.0, 0));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_child_pays_for_parent)
+{
+    CTxMemPool pool;
+
+    // A parent paying nothing, its child paying well for both, and an
+    // unrelated transaction paying better than the parent alone but worse
+    // than the two together
+    CTransaction txParent = MakeTx(GetRandHash(), 0, 10 * COIN);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 0, 9 * COIN);
+    CTransaction txOther = MakeTx(GetRandHash(), 0, 10 * COIN);
+    AddTx(pool, txParent, 0);
+    AddTx(pool, txChild, 100000);
+    AddTx(pool, txOther, 10000);
+
+    // Room for all but one of them
+    std::list<CTransaction> removed;
+    pool.TrimToSize(pool.GetTotalTxSize() - 1, &removed);
+
+    BOOST_CHECK_EQUAL(removed.size(), 1U);
+    BOOST_CHECK(!pool.exists(txOther.GetHash()));
+    BOOST_CHECK(pool.exists(txParent.GetHash()));
+    BOOST_CHECK(pool.exists(txChild.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_cheap_package)
+{
+    CTxMemPool pool;
+
+    // Without a child paying for it the cheap parent goes, with its child
+    CTransaction txParent = MakeTx(GetRandHash(), 0, 10 * COIN);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 0, 9 * COIN);
+    CTransaction txOther = MakeTx(GetRandHash(), 0, 10 * COIN);
+    AddTx(pool, txParent, 0);
+    AddTx(pool, txChild, 1000);
+    AddTx(pool, txOther, 10000);
+
+    std::list<CTransaction> removed;
+    pool.TrimToSize(pool.GetTotalTxSize() - 1, &removed);
+
+    BOOST_CHECK_EQUAL(removed.size(), 2U);
+    BOOST_CHECK(!pool.exists(txParent.GetHash()));
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.exists(txOther.GetHash()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
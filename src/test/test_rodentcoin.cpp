@@ -0,0 +1,35 @@
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#define BOOST_TEST_MODULE Rodentcoin Test Suite
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+// What init.cpp provides to the rest of the daemon, which the tests link without
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+uint nMsgSleep = 20;
+
+extern void noui_connect();
+
+struct TestingSetup {
+    TestingSetup() {
+        fPrintToDebugger = true; // don't want to write to debug.log file
+        noui_connect();
+    }
+};
+
+BOOST_GLOBAL_FIXTURE(TestingSetup);
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
@@ -0,0 +1,147 @@
+// Copyright (c) 2013-2014 Rodentcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file LICENCE or http://www.opensource.org/licenses/mit-license.php
+
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+using namespace std;
+
+typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
+
+BOOST_AUTO_TEST_SUITE(wallet_tests)
+
+static CWallet wallet;
+static vector<CWalletTx*> vpwtx;
+static unsigned int nNextLockTime = 0;
+
+// A confirmed coin of nValue paid to the wallet by someone else
+static void AddCoin(vector<COutput>& vCoins, int64 nValue)
+{
+    CTransaction tx;
+    tx.nLockTime = nNextLockTime++; // a unique hash for each coin
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    CWalletTx* pwtx = new CWalletTx(&wallet, tx);
+    vpwtx.push_back(pwtx);
+    vCoins.push_back(COutput(pwtx, 0, 6 * 24));
+}
+
+static void ClearCoins(vector<COutput>& vCoins)
+{
+    BOOST_FOREACH(CWalletTx* pwtx, vpwtx)
+        delete pwtx;
+    vpwtx.clear();
+    vCoins.clear();
+}
+
+// The coins sorted largest first, the way CreateTransaction hands them over
+static void SortCoins(vector<COutput>& vCoins)
+{
+    vector<pair<int64, unsigned int> > vOrder;
+    for (unsigned int i = 0; i < vCoins.size(); i++)
+        vOrder.push_back(make_pair(vCoins[i].tx->vout[vCoins[i].i].nValue, i));
+    sort(vOrder.rbegin(), vOrder.rend());
+    vector<COutput> vSorted;
+    for (unsigned int i = 0; i < vOrder.size(); i++)
+        vSorted.push_back(vCoins[vOrder[i].second]);
+    vCoins.swap(vSorted);
+}
+
+static int64 GetCoinSetValue(const CoinSet& setCoins)
+{
+    int64 nTotal = 0;
+    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& coin, setCoins)
+        nTotal += coin.first->vout[coin.second].nValue;
+    return nTotal;
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_exact_match)
+{
+    vector<COutput> vCoins;
+    CoinSet setCoinsRet;
+    int64 nValueRet;
+
+    // 1 to 40 cents, none of them the target by itself
+    for (int n = 1; n <= 40; n++)
+        AddCoin(vCoins, n * CENT);
+    SortCoins(vCoins);
+
+    BOOST_CHECK(wallet.SelectCoinsMinConf(100 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 100 * CENT);
+    BOOST_CHECK_EQUAL(GetCoinSetValue(setCoinsRet), 100 * CENT);
+
+    // Nothing adds up to more than the total
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(821 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+
+    ClearCoins(vCoins);
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_lowest_larger)
+{
+    vector<COutput> vCoins;
+    CoinSet setCoinsRet;
+    int64 nValueRet;
+
+    // The small coins fall short, so the smallest coin above the target is taken
+    AddCoin(vCoins, 5 * COIN);
+    AddCoin(vCoins, 3 * COIN);
+    AddCoin(vCoins, 10 * CENT);
+    AddCoin(vCoins, 20 * CENT);
+    SortCoins(vCoins);
+
+    BOOST_CHECK(wallet.SelectCoinsMinConf(1 * COIN, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 3 * COIN);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    ClearCoins(vCoins);
+}
+
+// Times the selection over random pools of growing size; the figures go to
+// the test log (run with --log_level=message to see them)
+BOOST_AUTO_TEST_CASE(coin_selection_timing)
+{
+    const int nPools = 20;
+    const unsigned int vnSize[] = { 100, 1000, 10000 };
+
+    for (unsigned int s = 0; s < sizeof(vnSize) / sizeof(vnSize[0]); s++)
+    {
+        int64 nTime = 0;
+        int64 nExcess = 0;
+        int nExact = 0;
+        for (int nPool = 0; nPool < nPools; nPool++)
+        {
+            vector<COutput> vCoins;
+            int64 nTotal = 0;
+            for (unsigned int i = 0; i < vnSize[s]; i++)
+            {
+                // Every other pool has coarse values, with many of the same value
+                int64 nValue = (nPool % 2) ? (CENT / 100) * (GetRand(500) + 1) : (CENT / 10) * (GetRand(100) + 1);
+                AddCoin(vCoins, nValue);
+                nTotal += nValue;
+            }
+            SortCoins(vCoins);
+            int64 nTargetValue = (nTotal / 3 / (CENT / 100)) * (CENT / 100) + (CENT / 100) * GetRand(100);
+
+            CoinSet setCoinsRet;
+            int64 nValueRet;
+            int64 nStart = GetTimeMillis();
+            BOOST_CHECK(wallet.SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet));
+            nTime += GetTimeMillis() - nStart;
+
+            BOOST_CHECK(nValueRet >= nTargetValue);
+            BOOST_CHECK_EQUAL(GetCoinSetValue(setCoinsRet), nValueRet);
+            nExcess += nValueRet - nTargetValue;
+            if (nValueRet == nTargetValue)
+                nExact++;
+
+            ClearCoins(vCoins);
+        }
+        BOOST_TEST_MESSAGE(strprintf("SelectCoinsMinConf() over %u coins: %.2f ms, excess %s, %d of %d exact",
+          vnSize[s], (double)nTime / nPools, FormatMoney(nExcess / nPools).c_str(), nExact, nPools));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -33,7 +33,7 @@ extern const std::string CLIENT_DATE;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 60004;
+static const int PROTOCOL_VERSION = 60005;
 static const int MAX_PROTOCOL_VERSION = 70000;
 static const int MIN_PROTOCOL_VERSION = 60002;
 
@@ -49,4 +49,7 @@ static const int NOBLKS_VERSION_END = 32400;
 // BIP 0031, pong message, is enabled for all versions AFTER this one
 static const int BIP0031_VERSION = 60000;
 
+// cmpctblock, getblocktxn and blocktxn messages are supported from this version on
+static const int COMPACT_BLOCKS_VERSION = 60005;
+
 #endif
@@ -20,12 +20,11 @@ using namespace std;
 // mapWallet
 //
 
-struct CompareValueOnly
+struct CompareOutputValue
 {
-    bool operator()(const pair<int64, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<int64, pair<const CWalletTx*, unsigned int> >& t2) const
+    bool operator()(const COutput& o1, const COutput& o2) const
     {
-        return t1.first < t2.first;
+        return o1.tx->vout[o1.i].nValue > o2.tx->vout[o2.i].nValue;
     }
 };
 
@@ -46,10 +45,220 @@ CPubKey CWallet::GenerateNewKey()
     return key.GetPubKey();
 }
 
+// Key pool entries written to the wallet per database transaction
+static const unsigned int KEYPOOL_WRITE_BATCH = 1000;
+
+// Makes every nStep'th of the new keys; a key that fails is left null
+void static ThreadMakeNewKeys(vector<CKey>* pvKey, bool fCompressed, unsigned int nFirst, unsigned int nStep)
+{
+    for (unsigned int i = nFirst; i < pvKey->size() && !fShutdown; i += nStep)
+    {
+        try
+        {
+            (*pvKey)[i].MakeNewKey(fCompressed);
+        }
+        catch (key_error& e)
+        {
+            (*pvKey)[i].Reset();
+        }
+    }
+}
+
+// Makes nKeys new keys on all cores; nothing of the wallet is touched, so
+// no lock is needed
+void static MakeNewKeys(unsigned int nKeys, bool fCompressed, vector<CKey>& vKeyRet)
+{
+    RandAddSeedPerfmon();
+    vKeyRet.resize(nKeys);
+    unsigned int nThreads = min(nKeys, (unsigned int)max(1, (int)boost::thread::hardware_concurrency()));
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ThreadMakeNewKeys, &vKeyRet, fCompressed, i, nThreads));
+    threads.join_all();
+    if (fShutdown)
+        throw std::runtime_error("MakeNewKeys() : shutting down");
+
+    BOOST_FOREACH(const CKey& key, vKeyRet)
+        if (key.IsNull())
+            throw std::runtime_error("MakeNewKeys() : MakeNewKey failed");
+}
+
+// Adds new keys to the store and to the end of the key pool, writing keys and
+// pool entries KEYPOOL_WRITE_BATCH at a time in one database transaction.
+// A batch goes into memory only once committed, so a failed one leaves
+// nothing behind. Called with cs_wallet held.
+void CWallet::AddKeysToPool(const vector<CKey>& vKey)
+{
+    if (vKey.empty())
+        return;
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (vKey[0].IsCompressed())
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    CWalletDB walletdb(strWalletFile);
+    bool fCrypted = IsCrypted();
+    vector<vector<unsigned char> > vchCryptedSecret;
+    for (unsigned int nBegin = 0; nBegin < vKey.size(); nBegin += KEYPOOL_WRITE_BATCH)
+    {
+        unsigned int nEnd = min((unsigned int)vKey.size(), nBegin + KEYPOOL_WRITE_BATCH);
+        int64 nIndex = setKeyPool.empty() ? 1 : *(--setKeyPool.end()) + 1;
+        vchCryptedSecret.assign(fCrypted ? nEnd - nBegin : 0, vector<unsigned char>());
+        if (!walletdb.TxnBegin())
+            throw runtime_error("AddKeysToPool() : TxnBegin failed");
+        try
+        {
+            for (unsigned int i = nBegin; i < nEnd; i++)
+            {
+                const CKey& key = vKey[i];
+                CPubKey vchPubKey = key.GetPubKey();
+                if (fCrypted)
+                {
+                    if (!EncryptKey(key, vchCryptedSecret[i - nBegin]))
+                        throw runtime_error("AddKeysToPool() : encrypting generated key failed");
+                    if (fFileBacked && !walletdb.WriteCryptedKey(vchPubKey, vchCryptedSecret[i - nBegin]))
+                        throw runtime_error("AddKeysToPool() : writing generated key failed");
+                }
+                else if (fFileBacked && !walletdb.WriteKey(vchPubKey, key.GetPrivKey()))
+                    throw runtime_error("AddKeysToPool() : writing generated key failed");
+                if (!walletdb.WritePool(nIndex + i - nBegin, CKeyPool(vchPubKey)))
+                    throw runtime_error("AddKeysToPool() : writing generated key failed");
+            }
+            if (!walletdb.TxnCommit())
+                throw runtime_error("AddKeysToPool() : TxnCommit failed");
+        }
+        catch (...)
+        {
+            walletdb.TxnAbort();
+            throw;
+        }
+
+        for (unsigned int i = nBegin; i < nEnd; i++)
+        {
+            const CKey& key = vKey[i];
+            bool fAdded = fCrypted ? CCryptoKeyStore::AddCryptedKey(key.GetPubKey(), vchCryptedSecret[i - nBegin]) : CCryptoKeyStore::AddKey(key);
+            if (!fAdded)
+                throw runtime_error("AddKeysToPool() : AddKey failed");
+            CacheKeyScripts(key.GetPubKey());
+            setKeyPool.insert(nIndex + i - nBegin);
+        }
+    }
+    printf("keypool added %d keys, size=%d\n", (int)vKey.size(), (int)setKeyPool.size());
+}
+
+void CWallet::PrewarmSigningKeys(const vector<CScript>& vScriptPubKey) const
+{
+    vector<CKeyID> vAddress;
+    BOOST_FOREACH(const CScript& scriptPubKey, vScriptPubKey)
+    {
+        txnouttype type;
+        vector<CTxDestination> vDest;
+        int nRequired;
+        if (!ExtractDestinations(scriptPubKey, type, vDest, nRequired))
+            continue;
+        BOOST_FOREACH(const CTxDestination& dest, vDest)
+        {
+            const CKeyID* pkeyID = boost::get<CKeyID>(&dest);
+            if (pkeyID)
+                vAddress.push_back(*pkeyID);
+        }
+    }
+    PrewarmKeyCache(vAddress);
+}
+
+// Adds the pay-to-pubkey and pay-to-pubkey-hash scripts of a new key to
+// setMyScripts, along with any redeem scripts it completes
+void CWallet::CacheKeyScripts(const CPubKey& vchPubKey, bool fDependents)
+{
+    CScript scriptPubKey;
+    scriptPubKey << vchPubKey << OP_CHECKSIG;
+    CScript scriptKeyHash;
+    scriptKeyHash.SetDestination(vchPubKey.GetID());
+    {
+        LOCK(cs_KeyStore);
+        setMyScripts.insert(scriptPubKey);
+        setMyScripts.insert(scriptKeyHash);
+    }
+    if (fDependents)
+        CacheDependentScripts(vchPubKey.GetID());
+}
+
+// Records the keys and scripts a redeem script refers to in mapScriptRefs
+void CWallet::IndexRedeemScript(const CScript& redeemScript)
+{
+    CScriptID scriptID = redeemScript.GetID();
+    txnouttype whichType;
+    vector<CTxDestination> vDest;
+    int nRequired;
+    if (!ExtractDestinations(redeemScript, whichType, vDest, nRequired))
+        return;
+    LOCK(cs_KeyStore);
+    BOOST_FOREACH(const CTxDestination& dest, vDest)
+    {
+        if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
+            mapScriptRefs.insert(make_pair((uint160)*pkeyID, scriptID));
+        else if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest))
+            mapScriptRefs.insert(make_pair((uint160)*pscriptID, scriptID));
+    }
+}
+
+// Adds the pay-to-script-hash script of the redeem script if it has become
+// ours, then checks the redeem scripts that refer to it in turn
+void CWallet::CacheRedeemScript(const CScriptID& scriptID)
+{
+    LOCK(cs_KeyStore);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(scriptID);
+    if (setMyScripts.count(scriptPubKey))
+        return;
+    CScript redeemScript;
+    if (!GetCScript(scriptID, redeemScript) || !::IsMine(*this, redeemScript))
+        return;
+    setMyScripts.insert(scriptPubKey);
+    CacheDependentScripts(scriptID);
+}
+
+// Checks the redeem scripts that refer to the given key or script
+void CWallet::CacheDependentScripts(const uint160& id)
+{
+    LOCK(cs_KeyStore);
+    vector<CScriptID> vScriptID;
+    for (multimap<uint160, CScriptID>::const_iterator mi = mapScriptRefs.lower_bound(id); mi != mapScriptRefs.end() && (*mi).first == id; ++mi)
+        vScriptID.push_back((*mi).second);
+    BOOST_FOREACH(const CScriptID& scriptID, vScriptID)
+        CacheRedeemScript(scriptID);
+}
+
+// Adds the pay-to-script-hash script of every redeem script that has become
+// ours. A script never stops being ours, so those already cached are skipped.
+// Run once after loading; keys and scripts added later go through
+// CacheKeyScripts and CacheRedeemScript.
+void CWallet::CacheRedeemScripts()
+{
+    LOCK(cs_KeyStore);
+    bool fChanged = true;
+    while (fChanged)
+    {
+        // a redeem script may itself pay to another script hash
+        fChanged = false;
+        for (ScriptMap::const_iterator mi = mapScripts.begin(); mi != mapScripts.end(); ++mi)
+        {
+            CScript scriptPubKey;
+            scriptPubKey.SetDestination((*mi).first);
+            if (!setMyScripts.count(scriptPubKey) && ::IsMine(*this, (*mi).second))
+            {
+                setMyScripts.insert(scriptPubKey);
+                fChanged = true;
+            }
+        }
+    }
+}
+
 bool CWallet::AddKey(const CKey& key)
 {
     if (!CCryptoKeyStore::AddKey(key))
         return false;
+    CacheKeyScripts(key.GetPubKey());
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
@@ -61,6 +270,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    CacheKeyScripts(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -77,11 +287,39 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    IndexRedeemScript(redeemScript);
+    CacheRedeemScript(redeemScript.GetID());
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
+bool CWallet::LoadKey(const CKey& key)
+{
+    if (!CCryptoKeyStore::AddKey(key))
+        return false;
+    CacheKeyScripts(key.GetPubKey(), false);
+    return true;
+}
+
+bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char> &vchCryptedSecret)
+{
+    SetMinVersion(FEATURE_WALLETCRYPT);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    CacheKeyScripts(vchPubKey, false);
+    return true;
+}
+
+// Redeem scripts are only indexed here; LoadWallet checks them all once loaded
+bool CWallet::LoadCScript(const CScript& redeemScript)
+{
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    IndexRedeemScript(redeemScript);
+    return true;
+}
+
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
 {
     if (!IsLocked())
@@ -312,6 +550,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateUnspent(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -325,9 +564,143 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // ownership of outputs may have changed along with the keys
+        ReindexWallet();
     }
 }
 
+void CWallet::IndexWalletTx(const uint256& hash, const CWalletTx& wtx)
+{
+    if (wtx.IsCoinBase())
+        setCoinBaseTx.insert(hash);
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+        {
+            setUnspentTx.insert(hash);
+            return;
+        }
+    }
+    setUnspentTx.erase(hash);
+}
+
+// Brings the unspent index up to date after a wallet transaction has been
+// added, erased or had its outputs marked spent; called with cs_wallet held
+void CWallet::UpdateUnspent(const uint256& hash)
+{
+    fBalanceCached = false;
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+    {
+        setUnspentTx.erase(hash);
+        setCoinBaseTx.erase(hash);
+        return;
+    }
+    IndexWalletTx(hash, (*mi).second);
+}
+
+// Files a new wallet transaction under its time, the destinations of ours
+// it pays and the account it was sent from
+void CWallet::IndexTxHistory(const uint256& hash, CWalletTx& wtx)
+{
+    wtxOrdered.insert(make_pair(wtx.GetTxTime(), TxPair(&wtx, (CAccountingEntry*)0)));
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination address;
+        if (ExtractDestination(txout.scriptPubKey, address) && ::IsMine(*this, address))
+            mapAddressTx[address].insert(hash);
+    }
+    if (!wtx.strFromAccount.empty())
+        mapFromAccountTx[wtx.strFromAccount].insert(hash);
+}
+
+// Drops a wallet transaction that is about to be erased from every index
+void CWallet::UnindexWalletTx(const uint256& hash, const CWalletTx& wtx)
+{
+    fBalanceCached = false;
+    setUnspentTx.erase(hash);
+    setCoinBaseTx.erase(hash);
+    pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(wtx.GetTxTime());
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
+    {
+        if ((*it).second.first == &wtx)
+        {
+            wtxOrdered.erase(it);
+            break;
+        }
+    }
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination address;
+        if (ExtractDestination(txout.scriptPubKey, address))
+        {
+            map<CTxDestination, set<uint256> >::iterator mi = mapAddressTx.find(address);
+            if (mi != mapAddressTx.end())
+            {
+                (*mi).second.erase(hash);
+                if ((*mi).second.empty())
+                    mapAddressTx.erase(mi);
+            }
+        }
+    }
+    if (!wtx.strFromAccount.empty())
+        mapFromAccountTx[wtx.strFromAccount].erase(hash);
+}
+
+void CWallet::ReindexWallet()
+{
+    {
+        LOCK(cs_wallet);
+        fBalanceCached = false;
+        setUnspentTx.clear();
+        setCoinBaseTx.clear();
+        wtxOrdered.clear();
+        mapAddressTx.clear();
+        mapFromAccountTx.clear();
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            IndexWalletTx((*it).first, (*it).second);
+            IndexTxHistory((*it).first, (*it).second);
+        }
+        for (list<CAccountingEntry>::iterator it = laccentries.begin(); it != laccentries.end(); ++it)
+            wtxOrdered.insert(make_pair((*it).nTime, TxPair((CWalletTx*)0, &(*it))));
+    }
+}
+
+// Keeps an accounting entry that has been written to wallet.dat, or loaded from it
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
+{
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
+}
+
+// Collects the wallet transactions that can count towards an account: those
+// paying its addresses and those sent from it. Anything may count towards the
+// default account, which also takes generated coins and unlabelled addresses.
+void CWallet::GetAccountTransactions(const string& strAccount, set<uint256>& setTx) const
+{
+    LOCK(cs_wallet);
+    if (strAccount.empty())
+    {
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setTx.insert((*it).first);
+        return;
+    }
+    BOOST_FOREACH(const PAIRTYPE(CTxDestination, string)& item, mapAddressBook)
+    {
+        if (item.second != strAccount)
+            continue;
+        map<CTxDestination, set<uint256> >::const_iterator mi = mapAddressTx.find(item.first);
+        if (mi != mapAddressTx.end())
+            setTx.insert((*mi).second.begin(), (*mi).second.end());
+    }
+    map<string, set<uint256> >::const_iterator mi = mapFromAccountTx.find(strAccount);
+    if (mi != mapFromAccountTx.end())
+        setTx.insert((*mi).second.begin(), (*mi).second.end());
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -339,7 +712,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         wtx.BindWallet(this);
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
+        {
             wtx.nTimeReceived = GetAdjustedTime();
+            IndexTxHistory(hash, wtx);
+        }
 
         bool fUpdated = false;
         if (!fInsertedNew)
@@ -363,6 +739,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        UpdateUnspent(hash);
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,10).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -412,7 +789,7 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
             CWalletTx wtx(this,tx);
             // Get merkle branch if transaction was found in a block
             if (pblock)
-                wtx.SetMerkleBranch(pblock);
+                wtx.SetMerkleBranchFromBlock(*pblock);
             return AddToWallet(wtx);
         }
         else
@@ -427,8 +804,13 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            UnindexWalletTx(hash, (*mi).second);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -450,6 +832,28 @@ bool CWallet::IsMine(const CTxIn &txin) const
     return false;
 }
 
+// The standard output types we hold keys or scripts for are all in
+// setMyScripts, so for those a single lookup decides. Anything else, bare
+// multisig included, still goes through ::IsMine.
+bool CWallet::IsMine(const CTxOut& txout) const
+{
+    const CScript& script = txout.scriptPubKey;
+    {
+        LOCK(cs_KeyStore);
+        if (setMyScripts.count(script))
+            return true;
+    }
+    unsigned int nSize = script.size();
+    if (nSize == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+        return false;
+    if (((nSize == 35 && script[0] == 33) || (nSize == 67 && script[0] == 65)) && script[nSize - 1] == OP_CHECKSIG)
+        return false;
+    if (script.IsPayToScriptHash())
+        return false;
+    return ::IsMine(*this, script);
+}
+
 int64 CWallet::GetDebit(const CTxIn &txin) const
 {
     {
@@ -682,28 +1086,136 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+static const unsigned int RESCAN_BATCH = 256;
+
+// Blocks read and filtered by the rescan workers between two passes over the wallet
+struct CRescanBatch
+{
+    std::set<CTxDestination> setDest;
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<CBlock> vBlock;
+    std::vector<std::vector<uint256> > vHash;
+    std::vector<std::vector<char> > vfPaysUs;
+};
+
+// Reads every nStep'th block of the batch from disk and flags the transactions
+// with an output to one of our destinations. Outputs without a plain destination
+// are flagged as well and left to IsMine; the wallet isn't touched here.
+void static ThreadRescanBatch(CRescanBatch* pbatch, unsigned int nFirst, unsigned int nStep)
+{
+    for (unsigned int n = nFirst; n < pbatch->vIndex.size() && !fShutdown; n += nStep)
+    {
+        CBlock& block = pbatch->vBlock[n];
+        block.ReadFromDisk(pbatch->vIndex[n], true);
+        pbatch->vHash[n].resize(block.vtx.size());
+        pbatch->vfPaysUs[n].assign(block.vtx.size(), false);
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i];
+            pbatch->vHash[n][i] = tx.GetHash();
+            BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            {
+                CTxDestination dest;
+                if (!ExtractDestination(txout.scriptPubKey, dest) || pbatch->setDest.count(dest))
+                {
+                    pbatch->vfPaysUs[n][i] = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// Worker threads read and filter RESCAN_BATCH blocks at a time against a
+// snapshot of our keys and scripts; cs_main is held only to collect each
+// batch from the chain and while the few transactions that pay us or touch
+// the wallet are applied in chain order. Progress is published in
+// nRescanHeight and the scan stops early once AbortRescan is called.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    int64 nStart = GetTimeMillis();
 
-    CBlockIndex* pindex = pindexStart;
+    CRescanBatch batch;
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        std::set<CKeyID> setKeys;
+        GetKeys(setKeys);
+        BOOST_FOREACH(const CKeyID& keyID, setKeys)
+            batch.setDest.insert(keyID);
+        LOCK(cs_KeyStore);
+        for (ScriptMap::const_iterator mi = mapScripts.begin(); mi != mapScripts.end(); ++mi)
+            batch.setDest.insert((*mi).first);
+    }
+
+    unsigned int nThreads = max(1, (int)boost::thread::hardware_concurrency());
+    {
+        LOCK(cs_rescan);
+        fAbortRescan = false;
+    }
+    CBlockIndex* pindexLast = NULL;
+    while (!fShutdown)
+    {
+        batch.vIndex.clear();
+        {
+            LOCK(cs_main);
+            CBlockIndex* pindex = pindexStart;
+            if (pindexLast)
+            {
+                // continue after the last block scanned, from where the
+                // chain forked off if it was reorganized meanwhile
+                while (pindexLast->pprev && !pindexLast->IsInMainChain())
+                    pindexLast = pindexLast->pprev;
+                pindex = pindexLast->pnext;
+            }
+            for (; pindex && batch.vIndex.size() < RESCAN_BATCH; pindex = pindex->pnext)
+                batch.vIndex.push_back(pindex);
+        }
+        if (batch.vIndex.empty())
+            break;
+        {
+            LOCK(cs_rescan);
+            if (fAbortRescan)
+                break;
+            nRescanHeight = batch.vIndex[0]->nHeight;
+        }
+        pindexLast = batch.vIndex.back();
+        batch.vBlock.assign(batch.vIndex.size(), CBlock());
+        batch.vHash.assign(batch.vIndex.size(), std::vector<uint256>());
+        batch.vfPaysUs.assign(batch.vIndex.size(), std::vector<char>());
+
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&ThreadRescanBatch, &batch, i, nThreads));
+        threads.join_all();
+        if (fShutdown)
+            break;
+
+        LOCK2(cs_main, cs_wallet);
+        for (unsigned int n = 0; n < batch.vIndex.size(); n++)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            CBlock& block = batch.vBlock[n];
+            for (unsigned int i = 0; i < block.vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                // Anything that neither pays us, is already ours nor spends
+                // a wallet transaction would be ignored by AddToWalletIfInvolvingMe
+                const CTransaction& tx = block.vtx[i];
+                bool fInvolved = batch.vfPaysUs[n][i] || mapWallet.count(batch.vHash[n][i]);
+                for (unsigned int j = 0; j < tx.vin.size() && !fInvolved; j++)
+                    fInvolved = mapWallet.count(tx.vin[j].prevout.hash);
+                if (fInvolved && AddToWalletIfInvolvingMe(tx, &block, fUpdate))
                     ret++;
             }
-            pindex = pindex->pnext;
         }
     }
+
+    LOCK(cs_rescan);
+    if (fAbortRescan || fShutdown)
+        printf("ScanForWalletTransactions() : aborted at block %d\n", nRescanHeight);
+    printf("ScanForWalletTransactions() : %d transactions found in %"PRI64d"ms\n", ret, GetTimeMillis() - nStart);
+    nRescanHeight = -1;
     return ret;
 }
 
@@ -731,6 +1243,11 @@ void CWallet::ReacceptWalletTransactions()
             if (wtx.IsCoinBase() && wtx.IsSpent(0))
                 continue;
 
+            // Nothing left to mark spent and nothing to reaccept, so there
+            // is no need to read its index from the txdb
+            if (!setUnspentTx.count(item.first) && wtx.GetDepthInMainChain() > 0)
+                continue;
+
             CTxIndex txindex;
             bool fUpdated = false;
             if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
@@ -757,6 +1274,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateUnspent(item.first);
                 }
             }
             else
@@ -857,18 +1375,35 @@ void CWallet::ResendWalletTransactions()
 /* Calculates either available or unconfirmed balance or both:
  * bit 0 = available balance;
  * bit 1 = unconfirmed balance
- * NOTE: this code makes use of TX_MATURITY rather than IsConfirmed() */
+ * NOTE: this code makes use of TX_MATURITY rather than IsConfirmed()
+ * Only transactions in setUnspentTx can have available credit; the sums are
+ * kept until the wallet changes or nTransactionsUpdated moves on a new best
+ * block or a memory pool change, either of which may alter depths */
 int64 CWallet::GetBalance(uint nSettings) const {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for(map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-        const CWalletTx* pcoin = &(*it).second;
-        int nDepth = pcoin->GetDepthInMainChain();
-        if((nSettings & 0x1) && (nDepth >= TX_MATURITY))
-          nTotal += pcoin->GetAvailableCredit();
-        if((nSettings & 0x2) && (nDepth < TX_MATURITY) && (nDepth > 0))
-          nTotal += pcoin->GetAvailableCredit();
+    unsigned int nUpdated = nTransactionsUpdated;
+    if(!fBalanceCached || (nBalanceUpdated != nUpdated)) {
+        nBalanceCached[0] = 0;
+        nBalanceCached[1] = 0;
+        BOOST_FOREACH(const uint256& hash, setUnspentTx) {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+            if(mi == mapWallet.end())
+              continue;
+            const CWalletTx* pcoin = &(*mi).second;
+            int nDepth = pcoin->GetDepthInMainChain();
+            if(nDepth >= TX_MATURITY)
+              nBalanceCached[0] += pcoin->GetAvailableCredit();
+            else if(nDepth > 0)
+              nBalanceCached[1] += pcoin->GetAvailableCredit();
+        }
+        nBalanceUpdated = nUpdated;
+        fBalanceCached = true;
     }
+    int64 nTotal = 0;
+    if(nSettings & 0x1)
+      nTotal += nBalanceCached[0];
+    if(nSettings & 0x2)
+      nTotal += nBalanceCached[1];
     return(nTotal);
 }
 
@@ -877,16 +1412,19 @@ int64 CWallet::GetBalance(uint nSettings) const {
  * bit 2 = immature only */
 int64 CWallet::GetMinted(uint nSettings) const {
     int64 nTotal = 0;
+    if(!(nSettings & 0x1))
+      return(nTotal);
     LOCK(cs_wallet);
-    for(map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-        const CWalletTx* pcoin = &(*it).second;
-        if(((nSettings & 0x1) && pcoin->IsCoinBase())) {
-            int nDepth = pcoin->GetDepthInMainChain();
-            if(nDepth > 0) {
-                if(((nSettings & 0x4) && (nDepth < nBaseMaturity)) || !(nSettings & 0x4)) {
-                    /* PoW base transactions have zero debit */                
-                      nTotal += CWallet::GetCredit(*pcoin);
-                }
+    BOOST_FOREACH(const uint256& hash, setCoinBaseTx) {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if(mi == mapWallet.end())
+          continue;
+        const CWalletTx* pcoin = &(*mi).second;
+        int nDepth = pcoin->GetDepthInMainChain();
+        if(nDepth > 0) {
+            if(((nSettings & 0x4) && (nDepth < nBaseMaturity)) || !(nSettings & 0x4)) {
+                /* PoW base transactions have zero debit */
+                  nTotal += CWallet::GetCredit(*pcoin);
             }
         }
     }
@@ -900,8 +1438,11 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTx)
         {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             if (!pcoin->IsFinal())
@@ -915,71 +1456,96 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
             // If output is less than minimum value, then don't include transaction.
             // This is to help deal with dust spam clogging up create transactions.
+            int nDepth = -2;
             for(unsigned int i = 0; i < pcoin->vout.size(); i++)
                 if(!(pcoin->IsSpent(i)) &&
                   IsMine(pcoin->vout[i]) &&
                   !IsLockedCoin((*it).first, i) && 
                   (pcoin->vout[i].nValue >= nMinimumInputValue) &&
                   (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+                {
+                    if(nDepth == -2)
+                      nDepth = pcoin->GetDepthInMainChain();
+                    vCoins.push_back(COutput(pcoin, i, nDepth));
+                }
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
-                                  vector<char>& vfBest, int64& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
+static const int BNB_MAX_TRIES = 100000;
 
+// Finds the subset of vValue, which is sorted largest first, with the smallest
+// total reaching nTargetValue. Coins are taken largest first and the search
+// backs out of a branch once it overshoots the best total found so far or can
+// no longer reach the target, skipping over coins of the same value as one it
+// has just left out. It stops at an exact match or after BNB_MAX_TRIES steps
+// with the best subset seen; that starts out as all of vValue.
+static void SelectCoinsBnB(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTotalLower, int64 nTargetValue,
+                           vector<char>& vfBest, int64& nBest)
+{
     vfBest.assign(vValue.size(), true);
     nBest = nTotalLower;
 
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    // vRemaining[i] is the total of vValue[i] and everything after it
+    vector<int64> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<unsigned int> vSelected;
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < BNB_MAX_TRIES && nBest != nTargetValue; nTries++)
     {
-        vfIncluded.assign(vValue.size(), false);
-        int64 nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        bool fBacktrack = (nTotal + vRemaining[i] < nTargetValue);
+        if (!fBacktrack)
         {
-            for (unsigned int i = 0; i < vValue.size(); i++)
+            if (nTotal + vValue[i].first < nBest)
             {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                vSelected.push_back(i);
+                nTotal += vValue[i].first;
+                i++;
+                if (nTotal >= nTargetValue)
                 {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
+                    nBest = nTotal;
+                    vfBest.assign(vValue.size(), false);
+                    BOOST_FOREACH(unsigned int n, vSelected)
+                        vfBest[n] = true;
+                    fBacktrack = true;
                 }
             }
+            else
+            {
+                // Too big to improve on nBest, and so is anything of the same value
+                for (i++; i < vValue.size() && vValue[i].first == vValue[i - 1].first; i++);
+            }
         }
+        if (!fBacktrack)
+            continue;
+
+        // Leave out the coin taken last, along with those of the same value
+        if (vSelected.empty())
+            break;
+        i = vSelected.back();
+        vSelected.pop_back();
+        nTotal -= vValue[i].first;
+        for (i++; i < vValue.size() && vValue[i].first == vValue[i - 1].first; i++);
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
-    // List of values less than target
+    // List of values less than target, largest first like vCoins
     pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<int64>::max();
     coinLowestLarger.second.first = NULL;
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1027,16 +1593,15 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Solve subset sum by branch and bound
     vector<char> vfBest;
     int64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    SelectCoinsBnB(vValue, nTotalLower, nTargetValue, vfBest, nBest);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        SelectCoinsBnB(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest);
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+    // If we have a bigger coin and (either the search didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
     if (coinLowestLarger.second.first &&
         ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
@@ -1063,11 +1628,9 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     return true;
 }
 
-bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
+// vCoins is what AvailableCoins returned, sorted by CompareOutputValue
+bool CWallet::SelectCoins(int64 nTargetValue, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
-    
     // Coin Control -> return all selected outputs 
     // (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
@@ -1088,6 +1651,52 @@ bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned
 
 
 
+// The most signing can add to an input spending txout: DER signatures run to
+// 72 bytes plus the hash type, and pay-to-key-hash inputs carry the public key
+// as well. Scripts it can't size count as nothing, leaving them to the fee
+// check after signing.
+static unsigned int GetMaxSignatureSize(const CKeyStore& keystore, const CTxOut& txout)
+{
+    vector<vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(txout.scriptPubKey, whichType, vSolutions))
+        return 0;
+
+    unsigned int nSize = 0;
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+        nSize = 1 + 73;
+        break;
+    case TX_PUBKEYHASH:
+    {
+        CPubKey vchPubKey;
+        if (!keystore.GetPubKey(CKeyID(uint160(vSolutions[0])), vchPubKey))
+            return 0;
+        nSize = 1 + 73 + 1 + vchPubKey.Raw().size();
+        break;
+    }
+    case TX_MULTISIG:
+        // OP_0 and the required signatures
+        nSize = 1 + vSolutions.front()[0] * (1 + 73);
+        break;
+    default:
+        return 0;
+    }
+    // The script length takes three bytes instead of one from 253 on
+    return nSize + (nSize >= 253 ? 2 : 0);
+}
+
+// Fee a transaction of nTxSize bytes has to pay, dPriority being the sum of
+// its input values times their depths
+static int64 GetRequiredFee(const CTransaction& tx, unsigned int nTxSize, double dPriority)
+{
+    int64 nPayFee = nTransactionFee * (1 + (int64)nTxSize / 1000);
+    bool fAllowFree = CTransaction::AllowFree(dPriority / nTxSize);
+    int64 nMinFee = tx.GetMinFee(nTxSize, fAllowFree, GMF_SEND);
+    return max(nPayFee, nMinFee);
+}
+
 bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, const CCoinControl* coinControl)
 {
     int64 nValue = 0;
@@ -1107,6 +1716,12 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
         // txdb must be opened before the mapWallet lock
         CTxDB txdb("r");
         {
+            // Gather the spendable outputs once, largest first; raising
+            // the fee below only reruns the selection over them
+            vector<COutput> vCoins;
+            AvailableCoins(vCoins, true, coinControl);
+            sort(vCoins.begin(), vCoins.end(), CompareOutputValue());
+
             nFeeRet = nTransactionFee;
             loop
             {
@@ -1123,7 +1738,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64 nValueIn = 0;
-                if(!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                if(!SelectCoins(nTotalValue, vCoins, setCoins, nValueIn, coinControl))
                   return false;
                 BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins) {
                     int64 nCredit = pcoin.first->vout[pcoin.second].nValue;
@@ -1182,24 +1797,40 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
                     wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
+                // Size the transaction as it will be once signed, allowing for
+                // the longest signatures, and settle the fee before signing so
+                // that every input gets signed just once
+                unsigned int nMaxTxSize = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                    nMaxTxSize += GetMaxSignatureSize(*this, coin.first->vout[coin.second]);
+                int64 nMaxTxFee = GetRequiredFee(wtxNew, nMaxTxSize, dPriority);
+                if (nFeeRet < nMaxTxFee)
+                {
+                    nFeeRet = nMaxTxFee;
+                    continue;
+                }
+
                 // Sign
+                vector<CScript> vScriptPubKey;
+                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                    vScriptPubKey.push_back(coin.first->vout[coin.second].scriptPubKey);
+                PrewarmSigningKeys(vScriptPubKey);
                 int nIn = 0;
+                const CSignatureHashData txdata(wtxNew);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &txdata))
                         return false;
 
                 // Limit size
                 unsigned int nTxSize = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
                 if(nTxSize >= MAX_BLOCK_SIZE_GEN/5) return false;
-                dPriority /= nTxSize;
 
-                // Check that enough fee is included
-                int64 nPayFee = nTransactionFee * (1 + (int64)nTxSize / 1000);
-                bool fAllowFree = CTransaction::AllowFree(dPriority);
-                int64 nMinFee = wtxNew.GetMinFee(nTxSize, fAllowFree, GMF_SEND);
-                if (nFeeRet < max(nPayFee, nMinFee))
+                // Check that enough fee is included; only inputs the size
+                // model above can't account for may leave it short
+                int64 nRequiredFee = GetRequiredFee(wtxNew, nTxSize, dPriority);
+                if (nFeeRet < nRequiredFee)
                 {
-                    nFeeRet = max(nPayFee, nMinFee);
+                    nFeeRet = nRequiredFee;
                     continue;
                 }
 
@@ -1248,6 +1879,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspent(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -1306,6 +1938,58 @@ string CWallet::SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew,
 
 
 
+// Pays every recipient in vecSend, starting a new transaction once the outputs
+// of the current one would fill half of nMaxTxSize, which leaves the other half
+// for inputs and change. Each transaction copies wtxTemplate's account and
+// comments, and the key cache spares decrypting a key again for each part. Returns an
+// error message or "", with the transactions committed so far in vHashRet.
+string CWallet::SendMoneyBatch(const vector<pair<CScript, int64> >& vecSend, const CWalletTx& wtxTemplate, unsigned int nMaxTxSize,
+                               vector<uint256>& vHashRet)
+{
+    vHashRet.clear();
+    if (IsLocked())
+    {
+        string strError = _("Error: Wallet locked, unable to create transaction  ");
+        printf("SendMoneyBatch() : %s", strError.c_str());
+        return strError;
+    }
+
+    vector<vector<pair<CScript, int64> > > vParts(1);
+    unsigned int nPartSize = 0;
+    BOOST_FOREACH(const PAIRTYPE(CScript, int64)& s, vecSend)
+    {
+        unsigned int nSize = ::GetSerializeSize(CTxOut(s.second, s.first), SER_NETWORK, PROTOCOL_VERSION);
+        if (!vParts.back().empty() && nPartSize + nSize > nMaxTxSize / 2)
+        {
+            vParts.push_back(vector<pair<CScript, int64> >());
+            nPartSize = 0;
+        }
+        vParts.back().push_back(s);
+        nPartSize += nSize;
+    }
+
+    LOCK2(cs_main, cs_wallet);
+    for (unsigned int i = 0; i < vParts.size(); i++)
+    {
+        const vector<pair<CScript, int64> >& vecPart = vParts[i];
+        CWalletTx wtxNew = wtxTemplate;
+        CReserveKey reservekey(this);
+        int64 nFeeRequired = 0;
+        if (!CreateTransaction(vecPart, wtxNew, reservekey, nFeeRequired))
+        {
+            string strError = strprintf(_("Error: Transaction creation failed after %d of %d transactions  "), (int)vHashRet.size(), (int)vParts.size());
+            printf("SendMoneyBatch() : %s", strError.c_str());
+            return strError;
+        }
+        if (!CommitTransaction(wtxNew, reservekey))
+            return _("Error: The transaction was rejected.  This might happen if some of the coins in your wallet were already spent, such as if you used a copy of wallet.dat and coins were spent in the copy but not marked as spent here.");
+        vHashRet.push_back(wtxNew.GetHash());
+    }
+    return "";
+}
+
+
+
 string CWallet::SendMoneyToDestination(const CTxDestination& address, int64 nValue, CWalletTx& wtxNew, bool fAskFee)
 {
     // Check amount
@@ -1330,6 +2014,7 @@ int CWallet::LoadWallet(bool& fFirstRunRet)
         return false;
     fFirstRunRet = false;
     int nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    CacheRedeemScripts();
     if (nLoadWalletRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -1346,6 +2031,10 @@ int CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    // keys and transactions come out of wallet.dat in any order, so the
+    // wallet's indexes can only be built once everything is loaded
+    ReindexWallet();
+
     CreateThread(ThreadFlushWalletDB, &strWalletFile);
     return DB_LOAD_OK;
 }
@@ -1434,12 +2123,9 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        vector<CKey> vKey;
+        MakeNewKeys(nKeys, CanSupportFeature(FEATURE_COMPRPUBKEY), vKey);
+        AddKeysToPool(vKey);
         printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
     }
     return true;
@@ -1453,24 +2139,56 @@ bool CWallet::TopUpKeyPool()
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
+        if (setKeyPool.size() < (nTargetSize + 1))
         {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%d\n", nEnd, setKeyPool.size());
+            vector<CKey> vKey;
+            MakeNewKeys(nTargetSize + 1 - setKeyPool.size(), CanSupportFeature(FEATURE_COMPRPUBKEY), vKey);
+            AddKeysToPool(vKey);
         }
     }
     return true;
 }
 
+// Same as TopUpKeyPool, except that the keys are made without holding
+// cs_wallet, so a large refill doesn't stall the rest of the wallet
+bool CWallet::TopUpKeyPoolInBackground()
+{
+    unsigned int nMissing = 0;
+    bool fCompressed;
+    {
+        LOCK(cs_wallet);
+        if (IsLocked())
+            return false;
+        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
+        if (setKeyPool.size() < (nTargetSize + 1))
+            nMissing = nTargetSize + 1 - setKeyPool.size();
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+    }
+    if (nMissing == 0)
+        return true;
+
+    vector<CKey> vKey;
+    MakeNewKeys(nMissing, fCompressed, vKey);
+    if (fShutdown)
+        return false;
+
+    {
+        LOCK(cs_wallet);
+        // The wallet may have been locked meanwhile
+        if (IsLocked())
+            return false;
+        // and other refills or key requests may have changed the pool size
+        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
+        if (setKeyPool.size() >= (nTargetSize + 1))
+            return true;
+        vKey.resize(min((unsigned int)vKey.size(), nTargetSize + 1 - (unsigned int)setKeyPool.size()));
+        AddKeysToPool(vKey);
+    }
+    return true;
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -15,11 +15,15 @@
 #include "ui_interface.h"
 
 class CWalletTx;
+class CAccountingEntry;
 class CReserveKey;
 class CWalletDB;
 class COutput;
 class CCoinControl;
 
+// size sendbatch keeps each of its transactions under by default
+static const unsigned int DEFAULT_BATCH_TX_SIZE = 50000;
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -65,7 +69,7 @@ public:
 class CWallet : public CCryptoKeyStore
 {
 private:
-    bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool SelectCoins(int64 nTargetValue, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -75,6 +79,42 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // transactions still holding unspent outputs of ours and coin base transactions,
+    // so balances and coin selection needn't walk all of mapWallet
+    std::set<uint256> setUnspentTx;
+    std::set<uint256> setCoinBaseTx;
+
+    // available and unconfirmed balances as of nBalanceUpdated
+    mutable int64 nBalanceCached[2];
+    mutable unsigned int nBalanceUpdated;
+    mutable bool fBalanceCached;
+
+    // scriptPubKeys of our pay-to-pubkey, pay-to-pubkey-hash and pay-to-script-hash
+    // outputs, so IsMine can turn most foreign outputs away without running Solver;
+    // guarded by cs_KeyStore
+    std::set<CScript> setMyScripts;
+    // our redeem scripts by the key and script IDs they refer to, so a new key
+    // or script only has the scripts depending on it checked; guarded by cs_KeyStore
+    std::multimap<uint160, CScriptID> mapScriptRefs;
+
+    // height a wallet rescan has reached, -1 while none runs, and the request
+    // to stop it; guarded by cs_rescan
+    mutable CCriticalSection cs_rescan;
+    int nRescanHeight;
+    bool fAbortRescan;
+
+    void CacheKeyScripts(const CPubKey& vchPubKey, bool fDependents = true);
+    void IndexRedeemScript(const CScript& redeemScript);
+    void CacheRedeemScript(const CScriptID& scriptID);
+    void CacheDependentScripts(const uint160& id);
+    void CacheRedeemScripts();
+
+    void AddKeysToPool(const std::vector<CKey>& vKey);
+
+    void IndexWalletTx(const uint256& hash, const CWalletTx& wtx);
+    void IndexTxHistory(const uint256& hash, CWalletTx& wtx);
+    void UnindexWalletTx(const uint256& hash, const CWalletTx& wtx);
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -95,6 +135,9 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fBalanceCached = false;
+        nRescanHeight = -1;
+        fAbortRescan = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -104,11 +147,24 @@ public:
         fFileBacked = true;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        fBalanceCached = false;
+        nRescanHeight = -1;
+        fAbortRescan = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
     std::map<uint256, int> mapRequestCount;
 
+    // wallet transactions and accounting entries by time, as listtransactions reports them
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::multimap<int64, TxPair> TxItems;
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+
+    // wallet transactions paying each of our destinations, and those sent from each named account
+    std::map<CTxDestination, std::set<uint256> > mapAddressTx;
+    std::map<std::string, std::set<uint256> > mapFromAccountTx;
+
     std::map<CTxDestination, std::string> mapAddressBook;
 
     CPubKey vchDefaultKey;
@@ -119,7 +175,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -129,30 +185,47 @@ public:
     // keystore implementation
     // Generate a new key
     CPubKey GenerateNewKey();
+    // Set up the keys for signing the given outputs ahead of time
+    void PrewarmSigningKeys(const std::vector<CScript>& vScriptPubKey) const;
     // Adds a key to the store, and saves it to disk.
     bool AddKey(const CKey& key);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key) { return CCryptoKeyStore::AddKey(key); }
+    bool LoadKey(const CKey& key);
 
     bool LoadMinVersion(int nVersion) { nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
     // Adds an encrypted key to the store, and saves it to disk.
     bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     // Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret) { SetMinVersion(FEATURE_WALLETCRYPT); return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret); }
+    bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddCScript(const CScript& redeemScript);
-    bool LoadCScript(const CScript& redeemScript) { return CCryptoKeyStore::AddCScript(redeemScript); }
+    bool LoadCScript(const CScript& redeemScript);
 
     bool Unlock(const SecureString& strWalletPassphrase);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
     bool EncryptWallet(const SecureString& strWalletPassphrase);
 
     void MarkDirty();
+    void UpdateUnspent(const uint256& hash);
+    void ReindexWallet();
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+    void GetAccountTransactions(const std::string& strAccount, std::set<uint256>& setTx) const;
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    // height a running rescan has reached, or -1
+    int GetRescanHeight() const { LOCK(cs_rescan); return nRescanHeight; }
+    // asks a running rescan to stop; false if none runs
+    bool AbortRescan()
+    {
+        LOCK(cs_rescan);
+        if (nRescanHeight < 0)
+            return false;
+        fAbortRescan = true;
+        return true;
+    }
     int ScanForWalletTransaction(const uint256& hashTx);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
@@ -162,10 +235,13 @@ public:
     bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
+    std::string SendMoneyBatch(const std::vector<std::pair<CScript, int64> >& vecSend, const CWalletTx& wtxTemplate, unsigned int nMaxTxSize,
+                               std::vector<uint256>& vHashRet);
     std::string SendMoneyToDestination(const CTxDestination &address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
     bool NewKeyPool();
     bool TopUpKeyPool();
+    bool TopUpKeyPoolInBackground();
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -176,10 +252,7 @@ public:
 
     bool IsMine(const CTxIn& txin) const;
     int64 GetDebit(const CTxIn& txin) const;
-    bool IsMine(const CTxOut& txout) const
-    {
-        return ::IsMine(*this, txout.scriptPubKey);
-    }
+    bool IsMine(const CTxOut& txout) const;
     int64 GetCredit(const CTxOut& txout) const
     {
         if (!MoneyRange(txout.nValue))
@@ -104,6 +104,103 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 }
 
 
+// A "tx", "key" or "wkey" record of the wallet being loaded. Unserializing
+// and hashing the transactions and checking every private key against its
+// public key is most of the work of loading a large wallet, so these are
+// decoded by worker threads and only handed to the wallet afterwards.
+struct CWalletLoadItem
+{
+    unsigned int nRecord;
+    std::string strType;
+    uint256 hash;
+    CWalletTx* pwtx;
+    CKey key;
+    bool fUpgraded;
+    std::string strError;
+
+    CWalletLoadItem()
+    {
+        nRecord = 0;
+        pwtx = NULL;
+        fUpgraded = false;
+    }
+};
+
+// Decodes every nStep'th item. Transactions are unserialized straight into
+// their mapWallet entry, which was created beforehand; nothing else of the
+// wallet is touched.
+void static ThreadDecodeWalletRecords(CWallet* pwallet, vector<pair<CDataStream, CDataStream> >* pvRecords, vector<CWalletLoadItem>* pvItems, unsigned int nFirst, unsigned int nStep)
+{
+    for (unsigned int i = nFirst; i < pvItems->size(); i += nStep)
+    {
+        CWalletLoadItem& item = (*pvItems)[i];
+        CDataStream& ssKey = (*pvRecords)[item.nRecord].first;
+        CDataStream& ssValue = (*pvRecords)[item.nRecord].second;
+        try
+        {
+            if (item.strType == "tx")
+            {
+                CWalletTx& wtx = *item.pwtx;
+                ssValue >> wtx;
+                wtx.BindWallet(pwallet);
+
+                if (wtx.GetHash() != item.hash)
+                    printf("Error in wallet.dat, hash mismatch\n");
+
+                // Undo serialize changes in 31600
+                if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+                {
+                    if (!ssValue.empty())
+                    {
+                        char fTmp;
+                        char fUnused;
+                        ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+                        printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), item.hash.ToString().c_str());
+                        wtx.fTimeReceivedIsTxTime = fTmp;
+                    }
+                    else
+                    {
+                        printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, item.hash.ToString().c_str());
+                        wtx.fTimeReceivedIsTxTime = 0;
+                    }
+                    item.fUpgraded = true;
+                }
+            }
+            else
+            {
+                vector<unsigned char> vchPubKey;
+                ssKey >> vchPubKey;
+                if (item.strType == "key")
+                {
+                    CPrivKey pkey;
+                    ssValue >> pkey;
+                    item.key.SetPubKey(vchPubKey);
+                    item.key.SetPrivKey(pkey);
+                    if (item.key.GetPubKey() != vchPubKey)
+                        item.strError = "CPrivKey pubkey inconsistency";
+                    else if (!item.key.IsValid())
+                        item.strError = "invalid CPrivKey";
+                }
+                else
+                {
+                    CWalletKey wkey;
+                    ssValue >> wkey;
+                    item.key.SetPubKey(vchPubKey);
+                    item.key.SetPrivKey(wkey.vchPrivKey);
+                    if (item.key.GetPubKey() != vchPubKey)
+                        item.strError = "CWalletKey pubkey inconsistency";
+                    else if (!item.key.IsValid())
+                        item.strError = "invalid CWalletKey";
+                }
+            }
+        }
+        catch (std::exception &e)
+        {
+            item.strError = strprintf("cannot unserialize %s record", item.strType.c_str());
+        }
+    }
+}
+
 int CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -130,12 +227,13 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        unsigned int nThreads = max(1, (int)boost::thread::hardware_concurrency());
+        vector<char> vchBuffer;
         loop
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            // Read next run of records
+            vector<pair<CDataStream, CDataStream> > vRecords;
+            int ret = ReadAtCursorBulk(pcursor, vchBuffer, vRecords);
             if (ret == DB_NOTFOUND)
                 break;
             else if (ret != 0)
@@ -144,163 +242,145 @@ int CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
-            // Unserialize
-            // Taking advantage of the fact that pair serialization
-            // is just the two items serialized one after the other
-            string strType;
-            ssKey >> strType;
-            if (strType == "name")
-            {
-                string strAddress;
-                ssKey >> strAddress;
-                ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()];
-            }
-            else if (strType == "tx")
+            // Transactions and keys are decoded by the worker threads, the
+            // rest in order below
+            vector<string> vType(vRecords.size());
+            vector<CWalletLoadItem> vItems;
+            vItems.reserve(vRecords.size());
+            for (unsigned int n = 0; n < vRecords.size(); n++)
             {
-                uint256 hash;
-                ssKey >> hash;
-                CWalletTx& wtx = pwallet->mapWallet[hash];
-                ssValue >> wtx;
-                wtx.BindWallet(pwallet);
-
-                if (wtx.GetHash() != hash)
-                    printf("Error in wallet.dat, hash mismatch\n");
-
-                // Undo serialize changes in 31600
-                if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+                vRecords[n].first >> vType[n];
+                if (vType[n] == "tx" || vType[n] == "key" || vType[n] == "wkey")
                 {
-                    if (!ssValue.empty())
-                    {
-                        char fTmp;
-                        char fUnused;
-                        ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                        printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = fTmp;
-                    }
-                    else
+                    vItems.push_back(CWalletLoadItem());
+                    CWalletLoadItem& item = vItems.back();
+                    item.nRecord = n;
+                    item.strType = vType[n];
+                    if (item.strType == "tx")
                     {
-                        printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = 0;
+                        vRecords[n].first >> item.hash;
+                        item.pwtx = &pwallet->mapWallet[item.hash];
                     }
-                    vWalletUpgrade.push_back(hash);
                 }
-
-                //// debug print
-                //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-                //printf(" %12"PRI64d"  %s  %s  %s\n",
-                //    wtx.vout[0].nValue,
-                //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-                //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-                //    wtx.mapValue["message"].c_str());
             }
-            else if (strType == "acentry")
+            if (!vItems.empty())
             {
-                string strAccount;
-                ssKey >> strAccount;
-                uint64 nNumber;
-                ssKey >> nNumber;
-                if (nNumber > nAccountingEntryNumber)
-                    nAccountingEntryNumber = nNumber;
+                boost::thread_group threads;
+                for (unsigned int i = 0; i < nThreads; i++)
+                    threads.create_thread(boost::bind(&ThreadDecodeWalletRecords, pwallet, &vRecords, &vItems, i, nThreads));
+                threads.join_all();
             }
-            else if (strType == "key" || strType == "wkey")
+
+            unsigned int nItem = 0;
+            for (unsigned int n = 0; n < vRecords.size(); n++)
             {
-                vector<unsigned char> vchPubKey;
-                ssKey >> vchPubKey;
-                CKey key;
-                if (strType == "key")
+                CDataStream& ssKey = vRecords[n].first;
+                CDataStream& ssValue = vRecords[n].second;
+
+                // Unserialize
+                // Taking advantage of the fact that pair serialization
+                // is just the two items serialized one after the other
+                const string& strType = vType[n];
+                if (strType == "name")
                 {
-                    CPrivKey pkey;
-                    ssValue >> pkey;
-                    key.SetPubKey(vchPubKey);
-                    key.SetPrivKey(pkey);
-                    if (key.GetPubKey() != vchPubKey)
+                    string strAddress;
+                    ssKey >> strAddress;
+                    ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()];
+                }
+                else if (strType == "tx")
+                {
+                    const CWalletLoadItem& item = vItems[nItem++];
+                    if (!item.strError.empty())
                     {
-                        printf("Error reading wallet database: CPrivKey pubkey inconsistency\n");
+                        printf("Error reading wallet database: %s\n", item.strError.c_str());
                         return DB_CORRUPT;
                     }
-                    if (!key.IsValid())
+                    if (item.fUpgraded)
+                        vWalletUpgrade.push_back(item.hash);
+                }
+                else if (strType == "acentry")
+                {
+                    string strAccount;
+                    ssKey >> strAccount;
+                    uint64 nNumber;
+                    ssKey >> nNumber;
+                    if (nNumber > nAccountingEntryNumber)
+                        nAccountingEntryNumber = nNumber;
+
+                    CAccountingEntry acentry;
+                    acentry.strAccount = strAccount;
+                    ssValue >> acentry;
+                    pwallet->AddAccountingEntry(acentry);
+                }
+                else if (strType == "key" || strType == "wkey")
+                {
+                    const CWalletLoadItem& item = vItems[nItem++];
+                    if (!item.strError.empty())
                     {
-                        printf("Error reading wallet database: invalid CPrivKey\n");
+                        printf("Error reading wallet database: %s\n", item.strError.c_str());
+                        return DB_CORRUPT;
+                    }
+                    if (!pwallet->LoadKey(item.key))
+                    {
+                        printf("Error reading wallet database: LoadKey failed\n");
                         return DB_CORRUPT;
                     }
                 }
-                else
+                else if (strType == "mkey")
                 {
-                    CWalletKey wkey;
-                    ssValue >> wkey;
-                    key.SetPubKey(vchPubKey);
-                    key.SetPrivKey(wkey.vchPrivKey);
-                    if (key.GetPubKey() != vchPubKey)
+                    unsigned int nID;
+                    ssKey >> nID;
+                    CMasterKey kMasterKey;
+                    ssValue >> kMasterKey;
+                    if(pwallet->mapMasterKeys.count(nID) != 0)
                     {
-                        printf("Error reading wallet database: CWalletKey pubkey inconsistency\n");
+                        printf("Error reading wallet database: duplicate CMasterKey id %u\n", nID);
                         return DB_CORRUPT;
                     }
-                    if (!key.IsValid())
+                    pwallet->mapMasterKeys[nID] = kMasterKey;
+                    if (pwallet->nMasterKeyMaxID < nID)
+                        pwallet->nMasterKeyMaxID = nID;
+                }
+                else if (strType == "ckey")
+                {
+                    vector<unsigned char> vchPubKey;
+                    ssKey >> vchPubKey;
+                    vector<unsigned char> vchPrivKey;
+                    ssValue >> vchPrivKey;
+                    if (!pwallet->LoadCryptedKey(vchPubKey, vchPrivKey))
                     {
-                        printf("Error reading wallet database: invalid CWalletKey\n");
+                        printf("Error reading wallet database: LoadCryptedKey failed\n");
                         return DB_CORRUPT;
                     }
+                    fIsEncrypted = true;
                 }
-                if (!pwallet->LoadKey(key))
+                else if (strType == "defaultkey")
                 {
-                    printf("Error reading wallet database: LoadKey failed\n");
-                    return DB_CORRUPT;
+                    ssValue >> pwallet->vchDefaultKey;
                 }
-            }
-            else if (strType == "mkey")
-            {
-                unsigned int nID;
-                ssKey >> nID;
-                CMasterKey kMasterKey;
-                ssValue >> kMasterKey;
-                if(pwallet->mapMasterKeys.count(nID) != 0)
+                else if (strType == "pool")
                 {
-                    printf("Error reading wallet database: duplicate CMasterKey id %u\n", nID);
-                    return DB_CORRUPT;
+                    int64 nIndex;
+                    ssKey >> nIndex;
+                    pwallet->setKeyPool.insert(nIndex);
                 }
-                pwallet->mapMasterKeys[nID] = kMasterKey;
-                if (pwallet->nMasterKeyMaxID < nID)
-                    pwallet->nMasterKeyMaxID = nID;
-            }
-            else if (strType == "ckey")
-            {
-                vector<unsigned char> vchPubKey;
-                ssKey >> vchPubKey;
-                vector<unsigned char> vchPrivKey;
-                ssValue >> vchPrivKey;
-                if (!pwallet->LoadCryptedKey(vchPubKey, vchPrivKey))
+                else if (strType == "version")
                 {
-                    printf("Error reading wallet database: LoadCryptedKey failed\n");
-                    return DB_CORRUPT;
+                    ssValue >> nFileVersion;
+                    if (nFileVersion == 10300)
+                        nFileVersion = 300;
                 }
-                fIsEncrypted = true;
-            }
-            else if (strType == "defaultkey")
-            {
-                ssValue >> pwallet->vchDefaultKey;
-            }
-            else if (strType == "pool")
-            {
-                int64 nIndex;
-                ssKey >> nIndex;
-                pwallet->setKeyPool.insert(nIndex);
-            }
-            else if (strType == "version")
-            {
-                ssValue >> nFileVersion;
-                if (nFileVersion == 10300)
-                    nFileVersion = 300;
-            }
-            else if (strType == "cscript")
-            {
-                uint160 hash;
-                ssKey >> hash;
-                CScript script;
-                ssValue >> script;
-                if (!pwallet->LoadCScript(script))
+                else if (strType == "cscript")
                 {
-                    printf("Error reading wallet database: LoadCScript failed\n");
-                    return DB_CORRUPT;
+                    uint160 hash;
+                    ssKey >> hash;
+                    CScript script;
+                    ssValue >> script;
+                    if (!pwallet->LoadCScript(script))
+                    {
+                        printf("Error reading wallet database: LoadCScript failed\n");
+                        return DB_CORRUPT;
+                    }
                 }
             }
         }